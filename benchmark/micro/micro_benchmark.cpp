@@ -0,0 +1,391 @@
+/*
+ * Copyright 2012 The FLWOR Foundation.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <new>
+#include <string>
+#include <vector>
+
+#include <libcouchbase/couchbase.h>
+
+#include <zorba/item_factory.h>
+#include <zorba/store_manager.h>
+#include <zorba/vector_item_sequence.h>
+#include <zorba/zorba.h>
+
+#include "couchbase.h"
+#include "xml_codec.h"
+
+/*******************************************************************************
+ * Every allocation of the process is counted, including the ones done by
+ * Zorba, to report allocations per operation.
+ ******************************************************************************/
+
+static std::atomic<unsigned long long> theAllocations(0);
+
+void*
+operator new(size_t aSize)
+{
+  ++theAllocations;
+  void* lPtr = malloc(aSize ? aSize : 1);
+  if (!lPtr)
+    throw std::bad_alloc();
+  return lPtr;
+}
+
+void
+operator delete(void* aPtr) noexcept
+{
+  free(aPtr);
+}
+
+namespace zorba { namespace couchbase {
+
+/*******************************************************************************
+ * Micro benchmarks of the code paths of the module that don't need a
+ * server: option parsing, decoding of get and view responses (built as
+ * synthetic lcb_get_resp_t/lcb_http_resp_t), item creation, encoding of
+ * put values and building of design documents. Derives from the function
+ * classes to reach their protected helpers. The view callbacks get a
+ * libcouchbase instance that is created but never connected.
+ *
+ * Usage: couchbase_micro_benchmark [--iterations N] [--filter SUBSTRING]
+ * The results are written to stdout as a JSON array.
+ ******************************************************************************/
+
+class MicroBenchmark : public CreateViewFunction
+{
+  protected:
+    //the callbacks of the view requests, called with synthetic responses
+    class ViewCallbacks : public ViewItemSequence
+    {
+      public:
+        using ViewItemSequence::view_callback;
+    };
+
+    size_t theIterations;
+    std::string theFilter;
+    bool theIsFirst;
+    ItemFactory* theFactory;
+
+    Item
+      createObject(const std::vector<std::pair<std::string, Item> >& aMembers);
+
+    static std::string
+      createPayload(size_t aSize);
+
+    static void
+      setResponse(lcb_get_resp_t& aResp, const std::string& aKey, const std::string& aValue);
+
+    void
+      run(const std::string& aName, const std::function<void()>& aCase);
+
+  public:
+    MicroBenchmark(size_t aIterations, const std::string& aFilter)
+      : CreateViewFunction(NULL), theIterations(aIterations), theFilter(aFilter),
+        theIsFirst(true), theFactory(CouchbaseModule::getItemFactory()) {}
+
+    void
+      runAll();
+};
+
+Item
+MicroBenchmark::createObject(const std::vector<std::pair<std::string, Item> >& aMembers)
+{
+  std::vector<std::pair<Item, Item> > lPairs;
+  for (size_t i = 0; i < aMembers.size(); ++i)
+    lPairs.push_back(std::make_pair(theFactory->createString(aMembers[i].first), aMembers[i].second));
+  return theFactory->createJSONObject(lPairs);
+}
+
+std::string
+MicroBenchmark::createPayload(size_t aSize)
+{
+  //JSON-ish text with some non ASCII (latin-1 representable) characters
+  static const char* PATTERN = "{\"name\":\"M\xc3\xbcller\",\"city\":\"Z\xc3\xbcrich\",\"pop\":42}";
+  std::string lPayload;
+  lPayload.reserve(aSize);
+  while (lPayload.size() < aSize)
+    lPayload += PATTERN;
+  lPayload.resize(aSize);
+  //don't cut a multi byte sequence
+  while (!lPayload.empty() && ((unsigned char)lPayload[lPayload.size() - 1] & 0x80))
+    lPayload.resize(lPayload.size() - 1);
+  return lPayload;
+}
+
+void
+MicroBenchmark::setResponse(lcb_get_resp_t& aResp, const std::string& aKey, const std::string& aValue)
+{
+  memset(&aResp, 0, sizeof(aResp));
+  aResp.version = 0;
+  aResp.v.v0.key = aKey.data();
+  aResp.v.v0.nkey = aKey.size();
+  aResp.v.v0.bytes = aValue.data();
+  aResp.v.v0.nbytes = aValue.size();
+}
+
+void
+MicroBenchmark::run(const std::string& aName, const std::function<void()>& aCase)
+{
+  if (!theFilter.empty() && aName.find(theFilter) == std::string::npos)
+    return;
+
+  size_t lWarmup = theIterations / 10 + 1;
+  for (size_t i = 0; i < lWarmup; ++i)
+    aCase();
+
+  unsigned long long lAllocations = theAllocations;
+  std::chrono::steady_clock::time_point lStart = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < theIterations; ++i)
+    aCase();
+  std::chrono::nanoseconds lTime = std::chrono::steady_clock::now() - lStart;
+  lAllocations = theAllocations - lAllocations;
+
+  std::cout << (theIsFirst ? "[\n" : ",\n")
+            << "  {\"name\":\"" << aName << "\",\"iterations\":" << theIterations
+            << ",\"ns-per-op\":" << (double)lTime.count() / theIterations
+            << ",\"allocations-per-op\":" << (double)lAllocations / theIterations << "}";
+  theIsFirst = false;
+}
+
+void
+MicroBenchmark::runAll()
+{
+  //option parsing
+  Item lGetOptionsItem = createObject({
+    { "type", theFactory->createString("text") },
+    { "expiration-time", theFactory->createInteger(60) },
+    { "encoding", theFactory->createString("UTF-8") } });
+  run("get-options", [&]() {
+    GetOptions lOptions;
+    lOptions.setOptions(lGetOptionsItem);
+  });
+
+  Item lPutOptionsItem = createObject({
+    { "operation", theFactory->createString("set") },
+    { "type", theFactory->createString("text") },
+    { "expiration-time", theFactory->createInteger(60) },
+    { "wait", theFactory->createString("false") } });
+  run("put-options", [&]() {
+    PutOptions lOptions;
+    lOptions.setOptions(lPutOptionsItem);
+  });
+
+  Item lViewOptionsItem = createObject({
+    { "stale", theFactory->createString("ok") },
+    { "limit", theFactory->createInteger(100) },
+    { "include-docs", theFactory->createBoolean(false) },
+    { "cache-ttl", theFactory->createInteger(10) } });
+  run("view-options", [&]() {
+    ViewOptions lOptions;
+    lOptions.setOptions(lViewOptionsItem);
+  });
+
+  //get responses, as handled by the get callback
+  std::string lKey = "micro-benchmark-key";
+  TraceFile_t lNoTrace;
+  size_t lSizes[] = { 16, 1024, 65536 };
+  for (size_t s = 0; s < sizeof(lSizes) / sizeof(lSizes[0]); ++s)
+  {
+    std::string lSize = std::to_string(lSizes[s]);
+    std::string lPayload = createPayload(lSizes[s]);
+    lcb_get_resp_t lResp;
+    setResponse(lResp, lKey, lPayload);
+
+    GetOptions lText(LCB_TEXT);
+    run("get-text-" + lSize, [&]() {
+      GetItemSequence::createItem(lText, &lResp, lNoTrace);
+    });
+
+    GetOptions lBinary(LCB_BASE64);
+    run("get-binary-" + lSize, [&]() {
+      GetItemSequence::createItem(lBinary, &lResp, lNoTrace);
+    });
+
+    //the value as stored by a put with "encoding" : "ISO-8859-1"
+    String lEncodedValue;
+    encode(String(lPayload), "ISO-8859-1", lEncodedValue);
+    std::string lLatin1(lEncodedValue.c_str(), lEncodedValue.size());
+    lcb_get_resp_t lLatin1Resp;
+    setResponse(lLatin1Resp, lKey, lLatin1);
+    Item lLatin1OptionsItem = createObject({
+      { "type", theFactory->createString("text") },
+      { "encoding", theFactory->createString("ISO-8859-1") } });
+    GetOptions lLatin1Options;
+    lLatin1Options.setOptions(lLatin1OptionsItem);
+    run("get-text-latin1-" + lSize, [&]() {
+      GetItemSequence::createItem(lLatin1Options, &lLatin1Resp, lNoTrace);
+    });
+
+    //put values
+    String lValue(lPayload);
+    run("put-encode-latin1-" + lSize, [&]() {
+      String lEncoded;
+      encode(lValue, "ISO-8859-1", lEncoded);
+    });
+  }
+
+  //a wide JSON document, read as a whole or projected to two members
+  std::string lWide = "{";
+  for (int i = 0; i < 300; ++i)
+    lWide += "\"field" + std::to_string(i) + "\":{\"value\":" + std::to_string(i) + ",\"label\":\"some text\"},";
+  lWide += "\"name\":\"wide\"}";
+  lcb_get_resp_t lWideResp;
+  setResponse(lWideResp, lKey, lWide);
+  GetOptions lJson(LCB_JSON);
+  run("get-json-full", [&]() {
+    GetItemSequence::createItem(lJson, &lWideResp, lNoTrace);
+  });
+  Item lProjectItem = createObject({
+    { "project", theFactory->createString("field150.value") } });
+  GetOptions lProjected(LCB_JSON);
+  lProjected.setOptions(lProjectItem);
+  run("get-json-project", [&]() {
+    GetItemSequence::createItem(lProjected, &lWideResp, lNoTrace);
+  });
+
+  //XML documents, stored as text by other clients or encoded by put-xml
+  std::string lXmlText = "<orders xmlns=\"urn:orders\">";
+  for (int i = 0; i < 100; ++i)
+    lXmlText += "<order id=\"" + std::to_string(i) + "\" state=\"open\"><item sku=\"a1\">widget</item><!-- note --></order>";
+  lXmlText += "</orders>";
+  std::istringstream lXmlStream(lXmlText);
+  Item lXmlDoc = CouchbaseModule::getXmlDataManager()->parseXML(lXmlStream);
+  std::string lXmlEncoded;
+  XmlCodec::encode(lXmlDoc, lXmlEncoded);
+
+  lcb_get_resp_t lXmlTextResp;
+  setResponse(lXmlTextResp, lKey, lXmlText);
+  lcb_get_resp_t lXmlEncodedResp;
+  setResponse(lXmlEncodedResp, lKey, lXmlEncoded);
+  lXmlEncodedResp.v.v0.flags = XML_FLAGS;
+  GetOptions lXml(LCB_XML);
+  run("get-xml-parse", [&]() {
+    GetItemSequence::createItem(lXml, &lXmlTextResp, lNoTrace);
+  });
+  run("get-xml-decode", [&]() {
+    GetItemSequence::createItem(lXml, &lXmlEncodedResp, lNoTrace);
+  });
+  run("put-xml-encode", [&]() {
+    std::string lEncoded;
+    XmlCodec::encode(lXmlDoc, lEncoded);
+  });
+
+  //view response chunks, as handled by the view callback; the rows refer
+  //to fewer documents than a get batch of include-docs, so the document
+  //join scans them without sending anything
+  std::string lRows = "{\"total_rows\":1000,\"rows\":[";
+  for (int i = 0; i < 1000; ++i)
+  {
+    if (i > 0)
+      lRows += ",";
+    lRows += "{\"id\":\"doc" + std::to_string(i % 50) + "\",\"key\":\"Z\xc3\xbcrich\",\"value\":" + std::to_string(i) + "}";
+  }
+  lRows += "]}";
+  lcb_http_resp_t lHttpResp;
+  memset(&lHttpResp, 0, sizeof(lHttpResp));
+  lHttpResp.version = 0;
+  lHttpResp.v.v0.status = LCB_HTTP_STATUS_OK;
+  lHttpResp.v.v0.bytes = lRows.data();
+  lHttpResp.v.v0.nbytes = lRows.size();
+
+  lcb_t lInstance;
+  struct lcb_create_st lCreateOptions;
+  memset(&lCreateOptions, 0, sizeof(lCreateOptions));
+  if (lcb_create(&lInstance, &lCreateOptions) == LCB_SUCCESS)
+  {
+    {
+      ViewOptions lRowOptions;
+      ItemSequence_t lNoPaths = new VectorItemSequence(std::vector<Item>());
+      Iterator_t lPaths = lNoPaths->getIterator();
+      ViewItemSequence::ViewIterator* lViewIterator =
+        new ViewItemSequence::ViewIterator(lInstance, lPaths, lRowOptions);
+      Iterator_t lViewIteratorGuard(lViewIterator);
+      String lViewPath("_design/micro/_view/rows");
+
+      run("view-chunk-utf8", [&]() {
+        ViewItemSequence::ViewRequest lRequest(lViewIterator, lInstance, lViewPath);
+        ViewCallbacks::view_callback(NULL, lInstance, &lRequest, LCB_SUCCESS, &lHttpResp);
+      });
+      run("view-chunk-include-docs", [&]() {
+        ViewItemSequence::ViewRequest lRequest(lViewIterator, lInstance, lViewPath);
+        lRequest.theDocJoin.reset(new ViewDocJoin(lInstance));
+        ViewCallbacks::view_callback(NULL, lInstance, &lRequest, LCB_SUCCESS, &lHttpResp);
+      });
+    }
+    lcb_destroy(lInstance);
+  }
+
+  //design documents of cb:create-view
+  std::vector<Item> lViewNames;
+  std::vector<Item> lViewOptions;
+  for (int i = 0; i < 3; ++i)
+  {
+    lViewNames.push_back(theFactory->createString("view" + std::to_string(i)));
+    lViewOptions.push_back(createObject({
+      { "key", theFactory->createString("doc.state") },
+      { "values", theFactory->createString("doc.pop") },
+      { "reduce", theFactory->createString("_sum") } }));
+  }
+  run("design-document", [&]() {
+    std::vector<Item> lPaths;
+    ItemSequence_t lNames = new VectorItemSequence(lViewNames);
+    ItemSequence_t lOptions = new VectorItemSequence(lViewOptions);
+    buildDesignDocument("micro", lNames->getIterator(), lOptions->getIterator(), lPaths);
+  });
+
+  std::cout << (theIsFirst ? "[]" : "\n]") << std::endl;
+}
+
+} /*namespace couchbase*/ } /*namespace zorba*/
+
+int
+main(int argc, char** argv)
+{
+  size_t lIterations = 10000;
+  std::string lFilter;
+  for (int i = 1; i + 1 < argc; i += 2)
+  {
+    std::string lArg = argv[i];
+    if (lArg == "--iterations")
+      lIterations = strtoul(argv[i + 1], NULL, 10);
+    else if (lArg == "--filter")
+      lFilter = argv[i + 1];
+    else
+    {
+      std::cerr << "usage: couchbase_micro_benchmark [--iterations N] [--filter SUBSTRING]" << std::endl;
+      return 2;
+    }
+  }
+  if (lIterations == 0)
+    lIterations = 1;
+
+  void* lStore = zorba::StoreManager::getStore();
+  zorba::Zorba* lZorba = zorba::Zorba::getInstance(lStore);
+  {
+    zorba::couchbase::MicroBenchmark lBenchmark(lIterations, lFilter);
+    lBenchmark.runAll();
+  }
+  lZorba->shutdown();
+  zorba::StoreManager::shutdownStore(lStore);
+  return 0;
+}
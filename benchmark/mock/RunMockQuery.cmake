@@ -0,0 +1,67 @@
+# Copyright 2012 The FLWOR Foundation.
+# 
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+# 
+# http://www.apache.org/licenses/LICENSE-2.0
+# 
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+# Runs the query QUERY with the zorba executable ZORBA against the mock
+# server MOCK and compares its result with the file EXPECTED. The external
+# variable $host is bound to the endpoint of the mock. If the file OPTIONS
+# exists it holds further arguments of the mock (e.g. --tmpfail-prefix);
+# with --servers N the endpoints of the other servers are bound to $host2
+# ... $hostN.
+# Called by the mock query tests (see benchmark/CMakeLists.txt):
+#
+#   cmake -D MOCK=... -D ZORBA=... -D URI_PATH=... -D LIB_PATH=...
+#         -D QUERY=... -D EXPECTED=... -D OPTIONS=... -D OUTPUT=...
+#         -P RunMockQuery.cmake
+
+SET (MOCK_ARGS "")
+IF (EXISTS "${OPTIONS}")
+  FILE (READ "${OPTIONS}" MOCK_ARGS)
+  STRING (STRIP "${MOCK_ARGS}" MOCK_ARGS)
+  SEPARATE_ARGUMENTS (MOCK_ARGS)
+ENDIF (EXISTS "${OPTIONS}")
+
+SET (HOST_ARGS -e "host:=@HOST@")
+IF ("${MOCK_ARGS}" MATCHES "--servers;([0-9]+)")
+  SET (SERVERS ${CMAKE_MATCH_1})
+  IF (SERVERS GREATER 1)
+    FOREACH (SERVER RANGE 2 ${SERVERS})
+      LIST (APPEND HOST_ARGS -e "host${SERVER}:=@HOST${SERVER}@")
+    ENDFOREACH (SERVER)
+  ENDIF (SERVERS GREATER 1)
+ENDIF ("${MOCK_ARGS}" MATCHES "--servers;([0-9]+)")
+
+GET_FILENAME_COMPONENT (OUTPUT_DIR "${OUTPUT}" PATH)
+FILE (MAKE_DIRECTORY "${OUTPUT_DIR}")
+
+EXECUTE_PROCESS (
+  COMMAND "${MOCK}" ${MOCK_ARGS}
+    -- "${ZORBA}"
+    --uri-path "${URI_PATH}"
+    --lib-path "${LIB_PATH}"
+    ${HOST_ARGS}
+    --omit-xml-declaration
+    -o "${OUTPUT}"
+    -f -q "${QUERY}"
+  RESULT_VARIABLE RESULT)
+IF (NOT RESULT EQUAL 0)
+  MESSAGE (FATAL_ERROR "${QUERY} failed: ${RESULT}")
+ENDIF (NOT RESULT EQUAL 0)
+
+FILE (READ "${OUTPUT}" ACTUAL_RESULT)
+FILE (READ "${EXPECTED}" EXPECTED_RESULT)
+STRING (STRIP "${ACTUAL_RESULT}" ACTUAL_RESULT)
+STRING (STRIP "${EXPECTED_RESULT}" EXPECTED_RESULT)
+IF (NOT ACTUAL_RESULT STREQUAL EXPECTED_RESULT)
+  MESSAGE (FATAL_ERROR "${QUERY}: expected\n${EXPECTED_RESULT}\nbut got\n${ACTUAL_RESULT}")
+ENDIF (NOT ACTUAL_RESULT STREQUAL EXPECTED_RESULT)
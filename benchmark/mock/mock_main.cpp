@@ -0,0 +1,172 @@
+/*
+ * Copyright 2012 The FLWOR Foundation.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <sys/wait.h>
+
+#include <chrono>
+#include <csignal>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "mock_server.h"
+
+using namespace zorba::couchbase;
+
+/*******************************************************************************
+ * Usage: couchbase_mock [--host H] [--http-port P] [--memcached-port P]
+ *                       [--bucket B] [--latency-us N] [--tmpfail-prefix K]
+ *                       [--servers N] [-- command ...]
+ *
+ * With --tmpfail-prefix the first get and the first store of every key
+ * starting with K are answered with a temporary failure (ETMPFAIL).
+ *
+ * With --servers N, N independent servers (each with its own bucket) are
+ * started; given ports are used by the first server, the next servers use
+ * the following ports.
+ *
+ * Without command the servers run until they are killed. With a command
+ * the servers are started, the command is run (every @HOSTi@ in its
+ * arguments is replaced by the host:port of the HTTP endpoint of the i-th
+ * server, the value of the "host" connect option, and @HOST@ by the one
+ * of the first server) and its exit status is returned.
+ ******************************************************************************/
+
+static void
+usage()
+{
+  std::cerr << "usage: couchbase_mock [--host H] [--http-port P] [--memcached-port P]"
+            << " [--bucket B] [--latency-us N] [--tmpfail-prefix K] [--servers N]"
+            << " [-- command ...]" << std::endl;
+  exit(2);
+}
+
+static std::string
+quote(const std::string& aArg)
+{
+  std::string lRes = "'";
+  for (size_t i = 0; i < aArg.size(); ++i)
+  {
+    if (aArg[i] == '\'')
+      lRes += "'\\''";
+    else
+      lRes += aArg[i];
+  }
+  return lRes + "'";
+}
+
+int
+main(int argc, char** argv)
+{
+  std::string lHost = "127.0.0.1";
+  unsigned short lHttpPort = 0;
+  unsigned short lMemcachedPort = 0;
+  std::string lBucket = "default";
+  unsigned int lLatency = 0;
+  std::string lTmpFailPrefix;
+  unsigned int lServers = 1;
+
+  int i = 1;
+  for (; i < argc; ++i)
+  {
+    std::string lArg = argv[i];
+    if (lArg == "--")
+    {
+      ++i;
+      break;
+    }
+    if (i + 1 == argc)
+      usage();
+    if (lArg == "--host")
+      lHost = argv[++i];
+    else if (lArg == "--http-port")
+      lHttpPort = atoi(argv[++i]);
+    else if (lArg == "--memcached-port")
+      lMemcachedPort = atoi(argv[++i]);
+    else if (lArg == "--bucket")
+      lBucket = argv[++i];
+    else if (lArg == "--latency-us")
+      lLatency = strtoul(argv[++i], NULL, 10);
+    else if (lArg == "--tmpfail-prefix")
+      lTmpFailPrefix = argv[++i];
+    else if (lArg == "--servers")
+      lServers = strtoul(argv[++i], NULL, 10);
+    else
+      usage();
+  }
+
+  if (lServers == 0)
+    usage();
+
+  signal(SIGPIPE, SIG_IGN);
+  std::vector<std::unique_ptr<MockServer> > lMockServers;
+  std::vector<std::string> lEndpoints;
+  for (unsigned int s = 0; s < lServers; ++s)
+  {
+    MockServer* lServer = new MockServer(lHost,
+      lHttpPort ? lHttpPort + s : 0,
+      lMemcachedPort ? lMemcachedPort + s : 0,
+      lBucket, lLatency);
+    lMockServers.push_back(std::unique_ptr<MockServer>(lServer));
+    lServer->setTmpFailPrefix(lTmpFailPrefix);
+    if (!lServer->start())
+    {
+      std::cerr << "couchbase_mock: can't bind " << lHost << std::endl;
+      return 1;
+    }
+
+    std::ostringstream lEndpoint;
+    lEndpoint << lHost << ":" << lServer->getHttpPort();
+    lEndpoints.push_back(lEndpoint.str());
+    std::cerr << "couchbase_mock: http " << lEndpoint.str()
+              << ", memcached " << lHost << ":" << lServer->getMemcachedPort() << std::endl;
+  }
+
+  if (i >= argc)
+  {
+    while (true)
+      std::this_thread::sleep_for(std::chrono::hours(1));
+  }
+
+  std::string lCommand;
+  for (; i < argc; ++i)
+  {
+    std::string lArg = argv[i];
+    size_t lPos;
+    while ((lPos = lArg.find("@HOST@")) != std::string::npos)
+      lArg.replace(lPos, 6, lEndpoints[0]);
+    for (unsigned int s = 0; s < lServers; ++s)
+    {
+      std::ostringstream lPlaceholder;
+      lPlaceholder << "@HOST" << s + 1 << "@";
+      std::string lStrPlaceholder = lPlaceholder.str();
+      while ((lPos = lArg.find(lStrPlaceholder)) != std::string::npos)
+        lArg.replace(lPos, lStrPlaceholder.size(), lEndpoints[s]);
+    }
+    if (!lCommand.empty())
+      lCommand += ' ';
+    lCommand += quote(lArg);
+  }
+  int lStatus = system(lCommand.c_str());
+  if (lStatus == -1 || !WIFEXITED(lStatus))
+    return 1;
+  return WEXITSTATUS(lStatus);
+}
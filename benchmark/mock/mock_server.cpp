@@ -0,0 +1,797 @@
+/*
+ * Copyright 2012 The FLWOR Foundation.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+#include <thread>
+
+#include "mock_server.h"
+
+namespace zorba { namespace couchbase {
+
+/*******************************************************************************
+ ******************************************************************************/
+
+//memcached binary protocol
+static const uint8_t REQUEST_MAGIC = 0x80;
+static const uint8_t RESPONSE_MAGIC = 0x81;
+static const size_t HEADER_SIZE = 24;
+
+static const uint8_t CMD_GET = 0x00;
+static const uint8_t CMD_SET = 0x01;
+static const uint8_t CMD_ADD = 0x02;
+static const uint8_t CMD_REPLACE = 0x03;
+static const uint8_t CMD_DELETE = 0x04;
+static const uint8_t CMD_QUIT = 0x07;
+static const uint8_t CMD_FLUSH = 0x08;
+static const uint8_t CMD_GETQ = 0x09;
+static const uint8_t CMD_NOOP = 0x0a;
+static const uint8_t CMD_VERSION = 0x0b;
+static const uint8_t CMD_GETK = 0x0c;
+static const uint8_t CMD_GETKQ = 0x0d;
+static const uint8_t CMD_APPEND = 0x0e;
+static const uint8_t CMD_PREPEND = 0x0f;
+static const uint8_t CMD_STAT = 0x10;
+static const uint8_t CMD_TOUCH = 0x1c;
+static const uint8_t CMD_GAT = 0x1d;
+static const uint8_t CMD_SASL_LIST_MECHS = 0x20;
+static const uint8_t CMD_SASL_AUTH = 0x21;
+static const uint8_t CMD_SASL_STEP = 0x22;
+static const uint8_t CMD_OBSERVE = 0x92;
+
+static const uint16_t STATUS_UNKNOWN_COMMAND = 0x81;
+static const uint16_t STATUS_TMPFAIL = 0x86;
+
+//observe key states
+static const uint8_t OBS_PERSISTED = 0x01;
+static const uint8_t OBS_NOT_FOUND = 0x80;
+
+static uint16_t
+readUInt16(const char* aData)
+{
+  return ((uint8_t)aData[0] << 8) | (uint8_t)aData[1];
+}
+
+static uint32_t
+readUInt32(const char* aData)
+{
+  return ((uint32_t)readUInt16(aData) << 16) | readUInt16(aData + 2);
+}
+
+static uint64_t
+readUInt64(const char* aData)
+{
+  return ((uint64_t)readUInt32(aData) << 32) | readUInt32(aData + 4);
+}
+
+static void
+appendUInt16(std::string& aOut, uint16_t aValue)
+{
+  aOut += (char)(aValue >> 8);
+  aOut += (char)(aValue & 0xff);
+}
+
+static void
+appendUInt32(std::string& aOut, uint32_t aValue)
+{
+  appendUInt16(aOut, aValue >> 16);
+  appendUInt16(aOut, aValue & 0xffff);
+}
+
+static void
+appendUInt64(std::string& aOut, uint64_t aValue)
+{
+  appendUInt32(aOut, aValue >> 32);
+  appendUInt32(aOut, aValue & 0xffffffff);
+}
+
+static bool
+readFully(int aSocket, char* aBuffer, size_t aLen)
+{
+  while (aLen > 0)
+  {
+    ssize_t lRead = recv(aSocket, aBuffer, aLen, 0);
+    if (lRead <= 0)
+      return false;
+    aBuffer += lRead;
+    aLen -= lRead;
+  }
+  return true;
+}
+
+static bool
+writeFully(int aSocket, const std::string& aData)
+{
+  const char* lData = aData.data();
+  size_t lLen = aData.size();
+  while (lLen > 0)
+  {
+    ssize_t lWritten = send(aSocket, lData, lLen, MSG_NOSIGNAL);
+    if (lWritten <= 0)
+      return false;
+    lData += lWritten;
+    lLen -= lWritten;
+  }
+  return true;
+}
+
+static void
+appendResponse(
+  std::string& aOut,
+  uint8_t aOpcode,
+  uint16_t aStatus,
+  uint32_t aOpaque,
+  uint64_t aCas,
+  const std::string& aExtras,
+  const std::string& aKey,
+  const std::string& aValue)
+{
+  aOut += (char)RESPONSE_MAGIC;
+  aOut += (char)aOpcode;
+  appendUInt16(aOut, aKey.size());
+  aOut += (char)aExtras.size();
+  aOut += (char)0;
+  appendUInt16(aOut, aStatus);
+  appendUInt32(aOut, aExtras.size() + aKey.size() + aValue.size());
+  appendUInt32(aOut, aOpaque);
+  appendUInt64(aOut, aCas);
+  aOut += aExtras;
+  aOut += aKey;
+  aOut += aValue;
+}
+
+/*******************************************************************************
+ ******************************************************************************/
+
+time_t
+MockBucket::getExpiration(uint32_t aExpTime)
+{
+  //like memcached: up to 30 days relative, absolute unix time otherwise
+  if (aExpTime == 0)
+    return 0;
+  if (aExpTime <= 30 * 24 * 3600)
+    return time(NULL) + aExpTime;
+  return aExpTime;
+}
+
+MockBucket::Document*
+MockBucket::find(const std::string& aKey)
+{
+  std::map<std::string, Document>::iterator lIter = theDocuments.find(aKey);
+  if (lIter == theDocuments.end())
+    return NULL;
+  if (lIter->second.theExpires != 0 && lIter->second.theExpires <= time(NULL))
+  {
+    theDocuments.erase(lIter);
+    return NULL;
+  }
+  return &lIter->second;
+}
+
+MockBucket::status_t
+MockBucket::get(const std::string& aKey, Document& aDocument)
+{
+  std::lock_guard<std::mutex> lLock(theMutex);
+  Document* lDocument = find(aKey);
+  if (!lDocument)
+    return STATUS_KEY_NOT_FOUND;
+  aDocument = *lDocument;
+  return STATUS_SUCCESS;
+}
+
+MockBucket::status_t
+MockBucket::store(
+  uint8_t aOpcode,
+  const std::string& aKey,
+  const std::string& aValue,
+  uint32_t aFlags,
+  uint32_t aExpTime,
+  uint64_t aCas,
+  uint64_t& aNewCas)
+{
+  std::lock_guard<std::mutex> lLock(theMutex);
+  Document* lDocument = find(aKey);
+  if (aCas != 0)
+  {
+    if (!lDocument)
+      return STATUS_KEY_NOT_FOUND;
+    if (lDocument->theCas != aCas)
+      return STATUS_KEY_EXISTS;
+  }
+
+  switch (aOpcode)
+  {
+    case CMD_ADD:
+      if (lDocument)
+        return STATUS_KEY_EXISTS;
+      break;
+    case CMD_REPLACE:
+      if (!lDocument)
+        return STATUS_KEY_NOT_FOUND;
+      break;
+    case CMD_APPEND:
+    case CMD_PREPEND:
+      if (!lDocument)
+        return STATUS_NOT_STORED;
+      if (aOpcode == CMD_APPEND)
+        lDocument->theValue += aValue;
+      else
+        lDocument->theValue.insert(0, aValue);
+      lDocument->theCas = aNewCas = theNextCas++;
+      return STATUS_SUCCESS;
+    default:
+      break;
+  }
+
+  Document& lNew = theDocuments[aKey];
+  lNew.theValue = aValue;
+  lNew.theFlags = aFlags;
+  lNew.theExpires = getExpiration(aExpTime);
+  lNew.theCas = aNewCas = theNextCas++;
+  return STATUS_SUCCESS;
+}
+
+MockBucket::status_t
+MockBucket::remove(const std::string& aKey, uint64_t aCas)
+{
+  std::lock_guard<std::mutex> lLock(theMutex);
+  Document* lDocument = find(aKey);
+  if (!lDocument)
+    return STATUS_KEY_NOT_FOUND;
+  if (aCas != 0 && lDocument->theCas != aCas)
+    return STATUS_KEY_EXISTS;
+  theDocuments.erase(aKey);
+  return STATUS_SUCCESS;
+}
+
+MockBucket::status_t
+MockBucket::touch(const std::string& aKey, uint32_t aExpTime)
+{
+  std::lock_guard<std::mutex> lLock(theMutex);
+  Document* lDocument = find(aKey);
+  if (!lDocument)
+    return STATUS_KEY_NOT_FOUND;
+  lDocument->theExpires = getExpiration(aExpTime);
+  return STATUS_SUCCESS;
+}
+
+void
+MockBucket::flush()
+{
+  std::lock_guard<std::mutex> lLock(theMutex);
+  theDocuments.clear();
+}
+
+void
+MockBucket::getIds(std::vector<std::string>& aIds)
+{
+  std::lock_guard<std::mutex> lLock(theMutex);
+  time_t lNow = time(NULL);
+  aIds.reserve(theDocuments.size());
+  for (std::map<std::string, Document>::const_iterator lIter = theDocuments.begin();
+       lIter != theDocuments.end(); ++lIter)
+  {
+    if (lIter->second.theExpires == 0 || lIter->second.theExpires > lNow)
+      aIds.push_back(lIter->first);
+  }
+}
+
+void
+MockBucket::putDesign(const std::string& aName, const std::string& aBody)
+{
+  std::lock_guard<std::mutex> lLock(theMutex);
+  theDesignDocuments[aName] = aBody;
+}
+
+bool
+MockBucket::getDesign(const std::string& aName, std::string& aBody)
+{
+  std::lock_guard<std::mutex> lLock(theMutex);
+  std::map<std::string, std::string>::const_iterator lIter = theDesignDocuments.find(aName);
+  if (lIter == theDesignDocuments.end())
+    return false;
+  aBody = lIter->second;
+  return true;
+}
+
+bool
+MockBucket::removeDesign(const std::string& aName)
+{
+  std::lock_guard<std::mutex> lLock(theMutex);
+  return theDesignDocuments.erase(aName) > 0;
+}
+
+/*******************************************************************************
+ ******************************************************************************/
+
+const unsigned int MockServer::NUM_VBUCKETS;
+
+int
+MockServer::listenOn(const std::string& aHost, unsigned short& aPort)
+{
+  int lSocket = socket(AF_INET, SOCK_STREAM, 0);
+  if (lSocket < 0)
+    return -1;
+  int lOn = 1;
+  setsockopt(lSocket, SOL_SOCKET, SO_REUSEADDR, &lOn, sizeof(lOn));
+
+  struct sockaddr_in lAddress;
+  memset(&lAddress, 0, sizeof(lAddress));
+  lAddress.sin_family = AF_INET;
+  lAddress.sin_port = htons(aPort);
+  if (inet_pton(AF_INET, aHost.c_str(), &lAddress.sin_addr) != 1
+      || bind(lSocket, (struct sockaddr*)&lAddress, sizeof(lAddress)) != 0
+      || listen(lSocket, 128) != 0)
+  {
+    close(lSocket);
+    return -1;
+  }
+
+  socklen_t lLen = sizeof(lAddress);
+  getsockname(lSocket, (struct sockaddr*)&lAddress, &lLen);
+  aPort = ntohs(lAddress.sin_port);
+  return lSocket;
+}
+
+bool
+MockServer::start()
+{
+  theHttpSocket = listenOn(theHost, theHttpPort);
+  theMemcachedSocket = listenOn(theHost, theMemcachedPort);
+  if (theHttpSocket < 0 || theMemcachedSocket < 0)
+    return false;
+
+  std::thread(&MockServer::acceptLoop, this, theHttpSocket, true).detach();
+  std::thread(&MockServer::acceptLoop, this, theMemcachedSocket, false).detach();
+  return true;
+}
+
+void
+MockServer::delay() const
+{
+  if (theLatency > 0)
+    std::this_thread::sleep_for(std::chrono::microseconds(theLatency));
+}
+
+bool
+MockServer::failTemporarily(bool aIsStore, const std::string& aKey)
+{
+  if (theTmpFailPrefix.empty() || aKey.compare(0, theTmpFailPrefix.size(), theTmpFailPrefix) != 0)
+    return false;
+  std::lock_guard<std::mutex> lLock(theTmpFailMutex);
+  return theTmpFailed.insert((aIsStore ? "store:" : "get:") + aKey).second;
+}
+
+void
+MockServer::acceptLoop(int aSocket, bool aIsHttp)
+{
+  while (true)
+  {
+    int lClient = accept(aSocket, NULL, NULL);
+    if (lClient < 0)
+      continue;
+    int lOn = 1;
+    setsockopt(lClient, IPPROTO_TCP, TCP_NODELAY, &lOn, sizeof(lOn));
+    if (aIsHttp)
+      std::thread(&MockServer::serveHttp, this, lClient).detach();
+    else
+      std::thread(&MockServer::serveMemcached, this, lClient).detach();
+  }
+}
+
+/*******************************************************************************
+ ******************************************************************************/
+
+void
+MockServer::serveMemcached(int aSocket)
+{
+  char lHeader[HEADER_SIZE];
+  std::string lBody;
+  std::string lOut;
+  while (readFully(aSocket, lHeader, HEADER_SIZE))
+  {
+    if ((uint8_t)lHeader[0] != REQUEST_MAGIC)
+      break;
+    uint8_t lOpcode = lHeader[1];
+    uint16_t lKeyLen = readUInt16(lHeader + 2);
+    uint8_t lExtLen = lHeader[4];
+    uint32_t lBodyLen = readUInt32(lHeader + 8);
+    uint32_t lOpaque = readUInt32(lHeader + 12);
+    uint64_t lCas = readUInt64(lHeader + 16);
+    if ((size_t)lKeyLen + lExtLen > lBodyLen)
+      break;
+
+    lBody.resize(lBodyLen);
+    if (lBodyLen > 0 && !readFully(aSocket, &lBody[0], lBodyLen))
+      break;
+    const char* lExtras = lBody.data();
+    std::string lKey(lBody, lExtLen, lKeyLen);
+    std::string lValue(lBody, lExtLen + lKeyLen);
+
+    lOut.clear();
+    switch (lOpcode)
+    {
+      case CMD_GET:
+      case CMD_GETQ:
+      case CMD_GETK:
+      case CMD_GETKQ:
+      case CMD_GAT:
+      {
+        if (failTemporarily(false, lKey))
+        {
+          appendResponse(lOut, lOpcode, STATUS_TMPFAIL, lOpaque, 0, "", "", "Temporary failure");
+          break;
+        }
+        MockBucket::status_t lStatus = MockBucket::STATUS_SUCCESS;
+        if (lOpcode == CMD_GAT)
+          lStatus = lExtLen >= 4
+            ? theBucket.touch(lKey, readUInt32(lExtras))
+            : MockBucket::STATUS_KEY_NOT_FOUND;
+        MockBucket::Document lDocument;
+        if (lStatus == MockBucket::STATUS_SUCCESS)
+          lStatus = theBucket.get(lKey, lDocument);
+        bool lWithKey = lOpcode == CMD_GETK || lOpcode == CMD_GETKQ;
+        if (lStatus == MockBucket::STATUS_SUCCESS)
+        {
+          std::string lFlags;
+          appendUInt32(lFlags, lDocument.theFlags);
+          appendResponse(lOut, lOpcode, lStatus, lOpaque, lDocument.theCas,
+                         lFlags, lWithKey ? lKey : "", lDocument.theValue);
+        }
+        else if (lOpcode != CMD_GETQ && lOpcode != CMD_GETKQ)
+        {
+          appendResponse(lOut, lOpcode, lStatus, lOpaque, 0, "", lWithKey ? lKey : "", "Not found");
+        }
+        break;
+      }
+      case CMD_SET:
+      case CMD_ADD:
+      case CMD_REPLACE:
+      case CMD_APPEND:
+      case CMD_PREPEND:
+      {
+        if (failTemporarily(true, lKey))
+        {
+          appendResponse(lOut, lOpcode, STATUS_TMPFAIL, lOpaque, 0, "", "", "Temporary failure");
+          break;
+        }
+        uint32_t lFlags = lExtLen >= 8 ? readUInt32(lExtras) : 0;
+        uint32_t lExpTime = lExtLen >= 8 ? readUInt32(lExtras + 4) : 0;
+        uint64_t lNewCas = 0;
+        MockBucket::status_t lStatus =
+          theBucket.store(lOpcode, lKey, lValue, lFlags, lExpTime, lCas, lNewCas);
+        appendResponse(lOut, lOpcode, lStatus, lOpaque, lNewCas, "", "", "");
+        break;
+      }
+      case CMD_DELETE:
+        appendResponse(lOut, lOpcode, theBucket.remove(lKey, lCas), lOpaque, 0, "", "", "");
+        break;
+      case CMD_TOUCH:
+        appendResponse(lOut, lOpcode,
+                       lExtLen >= 4 ? theBucket.touch(lKey, readUInt32(lExtras)) : MockBucket::STATUS_KEY_NOT_FOUND,
+                       lOpaque, 0, "", "", "");
+        break;
+      case CMD_OBSERVE:
+      {
+        //body: (vbucket, key length, key)*, answered as persisted
+        std::string lResult;
+        size_t lPos = 0;
+        while (lPos + 4 <= lValue.size())
+        {
+          uint16_t lVBucket = readUInt16(lValue.data() + lPos);
+          uint16_t lLen = readUInt16(lValue.data() + lPos + 2);
+          if (lPos + 4 + lLen > lValue.size())
+            break;
+          std::string lObserved(lValue, lPos + 4, lLen);
+          lPos += 4 + lLen;
+
+          MockBucket::Document lDocument;
+          bool lFound = theBucket.get(lObserved, lDocument) == MockBucket::STATUS_SUCCESS;
+          appendUInt16(lResult, lVBucket);
+          appendUInt16(lResult, lLen);
+          lResult += lObserved;
+          lResult += (char)(lFound ? OBS_PERSISTED : OBS_NOT_FOUND);
+          appendUInt64(lResult, lFound ? lDocument.theCas : 0);
+        }
+        appendResponse(lOut, lOpcode, MockBucket::STATUS_SUCCESS, lOpaque, 0, "", "", lResult);
+        break;
+      }
+      case CMD_FLUSH:
+        theBucket.flush();
+        appendResponse(lOut, lOpcode, MockBucket::STATUS_SUCCESS, lOpaque, 0, "", "", "");
+        break;
+      case CMD_NOOP:
+      case CMD_SASL_AUTH:
+      case CMD_SASL_STEP:
+        appendResponse(lOut, lOpcode, MockBucket::STATUS_SUCCESS, lOpaque, 0, "", "", "");
+        break;
+      case CMD_SASL_LIST_MECHS:
+        appendResponse(lOut, lOpcode, MockBucket::STATUS_SUCCESS, lOpaque, 0, "", "", "PLAIN");
+        break;
+      case CMD_VERSION:
+        appendResponse(lOut, lOpcode, MockBucket::STATUS_SUCCESS, lOpaque, 0, "", "", "2.0.1-mock");
+        break;
+      case CMD_STAT:
+        //only the terminating packet
+        appendResponse(lOut, lOpcode, MockBucket::STATUS_SUCCESS, lOpaque, 0, "", "", "");
+        break;
+      case CMD_QUIT:
+        close(aSocket);
+        return;
+      default:
+        appendResponse(lOut, lOpcode, STATUS_UNKNOWN_COMMAND, lOpaque, 0, "", "", "Unknown command");
+    }
+
+    if (!lOut.empty())
+    {
+      delay();
+      if (!writeFully(aSocket, lOut))
+        break;
+    }
+  }
+  close(aSocket);
+}
+
+/*******************************************************************************
+ ******************************************************************************/
+
+static std::string
+httpResponse(int aStatus, const std::string& aBody)
+{
+  const char* lReason = aStatus == 200 ? "OK"
+    : aStatus == 201 ? "Created"
+    : aStatus == 404 ? "Not Found"
+    : "Bad Request";
+  std::ostringstream lOut;
+  lOut << "HTTP/1.1 " << aStatus << " " << lReason << "\r\n"
+       << "Content-Type: application/json\r\n"
+       << "Content-Length: " << aBody.size() << "\r\n"
+       << "Connection: close\r\n\r\n"
+       << aBody;
+  return lOut.str();
+}
+
+static std::string
+getParameter(const std::string& aQuery, const std::string& aName)
+{
+  size_t lPos = 0;
+  while (lPos < aQuery.size())
+  {
+    size_t lEnd = aQuery.find('&', lPos);
+    if (lEnd == std::string::npos)
+      lEnd = aQuery.size();
+    size_t lEq = aQuery.find('=', lPos);
+    if (lEq != std::string::npos && lEq < lEnd && aQuery.compare(lPos, lEq - lPos, aName) == 0)
+      return aQuery.substr(lEq + 1, lEnd - lEq - 1);
+    lPos = lEnd + 1;
+  }
+  return "";
+}
+
+static void
+appendJSONString(std::string& aOut, const std::string& aValue)
+{
+  aOut += '"';
+  for (size_t i = 0; i < aValue.size(); ++i)
+  {
+    char c = aValue[i];
+    if (c == '"' || c == '\\')
+      aOut += '\\';
+    if ((unsigned char)c < 0x20)
+    {
+      char lBuf[8];
+      snprintf(lBuf, sizeof(lBuf), "\\u%04x", c);
+      aOut += lBuf;
+    }
+    else
+      aOut += c;
+  }
+  aOut += '"';
+}
+
+std::string
+MockServer::getConfig() const
+{
+  std::ostringstream lNode;
+  lNode << theHost << ":" << theMemcachedPort;
+  std::ostringstream lConfig;
+  lConfig << "{\"name\":\"" << theBucketName << "\",\"bucketType\":\"membase\","
+          << "\"authType\":\"sasl\",\"saslPassword\":\"\",\"nodeLocator\":\"vbucket\","
+          << "\"uri\":\"/pools/default/buckets/" << theBucketName << "\","
+          << "\"streamingUri\":\"/pools/default/bucketsStreaming/" << theBucketName << "\","
+          << "\"bucketCapabilities\":[\"touch\",\"couchapi\"],"
+          << "\"nodes\":[{\"hostname\":\"" << theHost << ":" << theHttpPort << "\","
+          << "\"couchApiBase\":\"http://" << theHost << ":" << theHttpPort << "/" << theBucketName << "\","
+          << "\"status\":\"healthy\",\"version\":\"2.0.1-mock\","
+          << "\"ports\":{\"direct\":" << theMemcachedPort << ",\"proxy\":0}}],"
+          << "\"vBucketServerMap\":{\"hashAlgorithm\":\"CRC\",\"numReplicas\":0,"
+          << "\"serverList\":[\"" << lNode.str() << "\"],\"vBucketMap\":[";
+  for (unsigned int i = 0; i < NUM_VBUCKETS; ++i)
+    lConfig << (i > 0 ? "," : "") << "[0]";
+  lConfig << "]}}";
+  return lConfig.str();
+}
+
+void
+MockServer::serveHttp(int aSocket)
+{
+  //read the header
+  std::string lRequest;
+  char lBuffer[4096];
+  size_t lHeaderEnd;
+  while ((lHeaderEnd = lRequest.find("\r\n\r\n")) == std::string::npos)
+  {
+    ssize_t lRead = recv(aSocket, lBuffer, sizeof(lBuffer), 0);
+    if (lRead <= 0)
+    {
+      close(aSocket);
+      return;
+    }
+    lRequest.append(lBuffer, lRead);
+  }
+
+  std::istringstream lHead(lRequest.substr(0, lHeaderEnd));
+  std::string lMethod;
+  std::string lTarget;
+  lHead >> lMethod >> lTarget;
+  size_t lContentLength = 0;
+  std::string lLine;
+  while (std::getline(lHead, lLine))
+  {
+    if (strncasecmp(lLine.c_str(), "Content-Length:", 15) == 0)
+      lContentLength = strtoul(lLine.c_str() + 15, NULL, 10);
+  }
+
+  std::string lBody = lRequest.substr(lHeaderEnd + 4);
+  while (lBody.size() < lContentLength)
+  {
+    ssize_t lRead = recv(aSocket, lBuffer, sizeof(lBuffer), 0);
+    if (lRead <= 0)
+      break;
+    lBody.append(lBuffer, lRead);
+  }
+
+  std::string lPath = lTarget;
+  std::string lQuery;
+  size_t lQueryStart = lTarget.find('?');
+  if (lQueryStart != std::string::npos)
+  {
+    lPath = lTarget.substr(0, lQueryStart);
+    lQuery = lTarget.substr(lQueryStart + 1);
+  }
+
+  delay();
+  std::string lStreaming = "/pools/default/bucketsStreaming/" + theBucketName;
+  std::string lBucketPrefix = "/" + theBucketName + "/";
+  if (lPath == lStreaming)
+  {
+    //the configuration is sent as one chunk terminated by four newlines,
+    //the connection stays open for updates that never come
+    std::string lChunk = getConfig() + "\n\n\n\n";
+    std::ostringstream lOut;
+    lOut << "HTTP/1.1 200 OK\r\nContent-Type: application/json\r\n"
+         << "Transfer-Encoding: chunked\r\n\r\n"
+         << std::hex << lChunk.size() << "\r\n" << lChunk << "\r\n";
+    if (writeFully(aSocket, lOut.str()))
+    {
+      while (recv(aSocket, lBuffer, sizeof(lBuffer), 0) > 0)
+        ;
+    }
+  }
+  else if (lPath == "/pools/default/buckets/" + theBucketName)
+  {
+    writeFully(aSocket, httpResponse(200, getConfig()));
+  }
+  else if (lPath == "/pools")
+  {
+    writeFully(aSocket, httpResponse(200,
+      "{\"pools\":[{\"name\":\"default\",\"uri\":\"/pools/default\","
+      "\"streamingUri\":\"/poolsStreaming/default\"}],\"implementationVersion\":\"2.0.1-mock\"}"));
+  }
+  else if (lPath.compare(0, lBucketPrefix.size(), lBucketPrefix) == 0)
+  {
+    serveView(aSocket, lMethod, lPath.substr(lBucketPrefix.size()), lQuery, lBody);
+  }
+  else
+  {
+    writeFully(aSocket, httpResponse(404, "{\"error\":\"not_found\",\"reason\":\"missing\"}"));
+  }
+  close(aSocket);
+}
+
+void
+MockServer::serveView(
+  int aSocket,
+  const std::string& aMethod,
+  const std::string& aPath,
+  const std::string& aQuery,
+  const std::string& aBody)
+{
+  static const std::string NOT_FOUND = "{\"error\":\"not_found\",\"reason\":\"missing\"}";
+  static const std::string DESIGN = "_design/";
+  if (aPath.compare(0, DESIGN.size(), DESIGN) != 0)
+  {
+    writeFully(aSocket, httpResponse(404, NOT_FOUND));
+    return;
+  }
+
+  std::string lName = aPath.substr(DESIGN.size());
+  size_t lViewStart = lName.find("/_view/");
+  if (lViewStart == std::string::npos)
+  {
+    //design document
+    std::string lDesign;
+    if (aMethod == "PUT")
+    {
+      theBucket.putDesign(lName, aBody);
+      writeFully(aSocket, httpResponse(201, "{\"ok\":true,\"id\":\"_design/" + lName + "\"}"));
+    }
+    else if (aMethod == "DELETE")
+    {
+      if (theBucket.removeDesign(lName))
+        writeFully(aSocket, httpResponse(200, "{\"ok\":true,\"id\":\"_design/" + lName + "\"}"));
+      else
+        writeFully(aSocket, httpResponse(404, NOT_FOUND));
+    }
+    else if (theBucket.getDesign(lName, lDesign))
+      writeFully(aSocket, httpResponse(200, lDesign));
+    else
+      writeFully(aSocket, httpResponse(404, NOT_FOUND));
+    return;
+  }
+
+  std::string lDesign;
+  if (!theBucket.getDesign(lName.substr(0, lViewStart), lDesign))
+  {
+    writeFully(aSocket, httpResponse(404, NOT_FOUND));
+    return;
+  }
+
+  //every document is a row with its id as key, map functions are not run
+  std::vector<std::string> lIds;
+  theBucket.getIds(lIds);
+  size_t lSkip = strtoul(getParameter(aQuery, "skip").c_str(), NULL, 10);
+  std::string lLimitParam = getParameter(aQuery, "limit");
+  size_t lLimit = lLimitParam.empty() ? lIds.size() : strtoul(lLimitParam.c_str(), NULL, 10);
+
+  std::ostringstream lTotal;
+  lTotal << "{\"total_rows\":" << lIds.size() << ",\"rows\":[";
+  std::string lResult = lTotal.str();
+  for (size_t i = lSkip, lCount = 0; i < lIds.size() && lCount < lLimit; ++i, ++lCount)
+  {
+    if (lCount > 0)
+      lResult += ',';
+    lResult += "{\"id\":";
+    appendJSONString(lResult, lIds[i]);
+    lResult += ",\"key\":";
+    appendJSONString(lResult, lIds[i]);
+    lResult += ",\"value\":null}";
+  }
+  lResult += "]}";
+  writeFully(aSocket, httpResponse(200, lResult));
+}
+
+} /*namespace couchbase*/ } /*namespace zorba*/
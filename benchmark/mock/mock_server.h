@@ -0,0 +1,209 @@
+/*
+ * Copyright 2012 The FLWOR Foundation.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _COM_ZORBA_WWW_MODULES_COUCHBASE_MOCK_SERVER_H_
+#define _COM_ZORBA_WWW_MODULES_COUCHBASE_MOCK_SERVER_H_
+
+#include <ctime>
+#include <map>
+#include <mutex>
+#include <set>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+namespace zorba { namespace couchbase {
+
+/*******************************************************************************
+ * In memory bucket of the mock server. Documents expire lazily, i.e. an
+ * expired document is dropped when it is accessed.
+ ******************************************************************************/
+
+class MockBucket
+{
+  public:
+    class Document
+    {
+      public:
+        std::string theValue;
+        uint32_t theFlags;
+        uint64_t theCas;
+        time_t theExpires;
+
+        Document() : theFlags(0), theCas(0), theExpires(0) {}
+    };
+
+    typedef enum
+    {
+      STATUS_SUCCESS = 0x00,
+      STATUS_KEY_NOT_FOUND = 0x01,
+      STATUS_KEY_EXISTS = 0x02,
+      STATUS_NOT_STORED = 0x05
+    } status_t;
+
+  protected:
+    std::map<std::string, Document> theDocuments;
+    std::map<std::string, std::string> theDesignDocuments;
+    uint64_t theNextCas;
+    std::mutex theMutex;
+
+    Document*
+      find(const std::string& aKey);
+
+    static time_t
+      getExpiration(uint32_t aExpTime);
+
+  public:
+    MockBucket() : theNextCas(1) {}
+
+    status_t
+      get(const std::string& aKey, Document& aDocument);
+
+    /*
+     * aOpcode is the memcached opcode of the command (set, add, replace,
+     * append or prepend).
+     */
+    status_t
+      store(
+        uint8_t aOpcode,
+        const std::string& aKey,
+        const std::string& aValue,
+        uint32_t aFlags,
+        uint32_t aExpTime,
+        uint64_t aCas,
+        uint64_t& aNewCas);
+
+    status_t
+      remove(const std::string& aKey, uint64_t aCas);
+
+    status_t
+      touch(const std::string& aKey, uint32_t aExpTime);
+
+    void
+      flush();
+
+    /*
+     * Returns the ids of the documents, sorted.
+     */
+    void
+      getIds(std::vector<std::string>& aIds);
+
+    void
+      putDesign(const std::string& aName, const std::string& aBody);
+
+    bool
+      getDesign(const std::string& aName, std::string& aBody);
+
+    bool
+      removeDesign(const std::string& aName);
+};
+
+/*******************************************************************************
+ * Single node Couchbase server sufficient for libcouchbase 2.x clients: it
+ * speaks the memcached binary protocol on one port and serves the cluster
+ * configuration (/pools/...), design documents and views over HTTP on
+ * another. Every response is delayed by the configured latency. Each
+ * connection is served by its own thread.
+ ******************************************************************************/
+
+class MockServer
+{
+  public:
+    static const unsigned int NUM_VBUCKETS = 64;
+
+  protected:
+    std::string theHost;
+    unsigned short theHttpPort;
+    unsigned short theMemcachedPort;
+    std::string theBucketName;
+    unsigned int theLatency;
+    int theHttpSocket;
+    int theMemcachedSocket;
+    MockBucket theBucket;
+    //the first get and the first store of every key with this prefix fail
+    //with a temporary error
+    std::string theTmpFailPrefix;
+    std::set<std::string> theTmpFailed;
+    std::mutex theTmpFailMutex;
+
+    static int
+      listenOn(const std::string& aHost, unsigned short& aPort);
+
+    void
+      delay() const;
+
+    /*
+     * Returns true if the command (aIsStore for the store commands, gets
+     * otherwise) has to be answered with a temporary failure.
+     */
+    bool
+      failTemporarily(bool aIsStore, const std::string& aKey);
+
+    void
+      acceptLoop(int aSocket, bool aIsHttp);
+
+    void
+      serveMemcached(int aSocket);
+
+    void
+      serveHttp(int aSocket);
+
+    std::string
+      getConfig() const;
+
+    void
+      serveView(
+        int aSocket,
+        const std::string& aMethod,
+        const std::string& aPath,
+        const std::string& aQuery,
+        const std::string& aBody);
+
+  public:
+    /*
+     * aLatency is in microseconds. Ports given as 0 are chosen by the
+     * system once the server is started.
+     */
+    MockServer(
+      const std::string& aHost,
+      unsigned short aHttpPort,
+      unsigned short aMemcachedPort,
+      const std::string& aBucket,
+      unsigned int aLatency)
+      : theHost(aHost), theHttpPort(aHttpPort), theMemcachedPort(aMemcachedPort),
+        theBucketName(aBucket), theLatency(aLatency), theHttpSocket(-1),
+        theMemcachedSocket(-1) {}
+
+    /*
+     * Binds both ports and starts serving them in background threads.
+     * Returns false if a port can't be bound.
+     */
+    bool
+      start();
+
+    void
+      setTmpFailPrefix(const std::string& aPrefix) { theTmpFailPrefix = aPrefix; }
+
+    unsigned short
+      getHttpPort() const { return theHttpPort; }
+
+    unsigned short
+      getMemcachedPort() const { return theMemcachedPort; }
+};
+
+} /*namespace couchbase*/ } /*namespace zorba*/
+
+#endif //_COM_ZORBA_WWW_MODULES_COUCHBASE_MOCK_SERVER_H_
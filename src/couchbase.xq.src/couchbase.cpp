@@ -16,9 +16,11 @@
  */
 
 #include <algorithm>
+#include <chrono>
 #include <cstdio>
 #include <iostream>
 #include <sstream>
+#include <thread>
 
 #include <libcouchbase/couchbase.h>
 
@@ -33,6 +35,9 @@
 #include <zorba/vector_item_sequence.h>
 
 #include "couchbase.h"
+#include "instance_pool.h"
+#include "view_cache.h"
+#include "xml_codec.h"
 
 namespace zorba { namespace couchbase {
 
@@ -42,6 +47,8 @@ namespace zorba { namespace couchbase {
 zorba::ExternalFunction*
   CouchbaseModule::getExternalFunction(const zorba::String& localname)
 {
+  //queries may be compiled concurrently
+  std::lock_guard<std::mutex> lLock(theFunctionsMutex);
   FuncMap_t::iterator lIte = theFunctions.find(localname);
 
   ExternalFunction*& lFunc = theFunctions[localname];
@@ -52,6 +59,14 @@ zorba::ExternalFunction*
     {
       lFunc = new ConnectFunction(this);
     }
+    else if (localname == "connect-all")
+    {
+      lFunc = new ConnectAllFunction(this);
+    }
+    else if (localname == "connect-sharded")
+    {
+      lFunc = new ConnectShardedFunction(this);
+    }
     else if (localname == "get-text")
     {
       lFunc = new GetTextFunction(this);
@@ -68,6 +83,30 @@ zorba::ExternalFunction*
     {
       lFunc = new PutBinaryFunction(this);
     }
+    else if (localname == "get-json")
+    {
+      lFunc = new GetJsonFunction(this);
+    }
+    else if (localname == "get-xml")
+    {
+      lFunc = new GetXmlFunction(this);
+    }
+    else if (localname == "put-xml")
+    {
+      lFunc = new PutXmlFunction(this);
+    }
+    else if (localname == "disconnect")
+    {
+      lFunc = new DisconnectFunction(this);
+    }
+    else if (localname == "stats")
+    {
+      lFunc = new StatsFunction(this);
+    }
+    else if (localname == "reset-stats")
+    {
+      lFunc = new ResetStatsFunction(this);
+    }
     else if (localname == "remove")
     {
       lFunc = new RemoveFunction(this);
@@ -80,6 +119,10 @@ zorba::ExternalFunction*
     {
       lFunc = new TouchFunction(this);
     }
+    else if (localname == "copy")
+    {
+      lFunc = new CopyFunction(this);
+    }
     else if (localname == "view-text")
     {
       lFunc = new ViewFunction(this);
@@ -92,6 +135,14 @@ zorba::ExternalFunction*
     {
       lFunc = new DeleteViewFunction(this);
     }
+    else if (localname == "publish-view")
+    {
+      lFunc = new PublishViewFunction(this);
+    }
+    else if (localname == "wait-for-index")
+    {
+      lFunc = new WaitForIndexFunction(this);
+    }
   }
 
   return lFunc;
@@ -172,6 +223,12 @@ CouchbaseFunction::isNotJSONError()
   throwError("CB0002", "Options parameter is not a JSON object"); 
 }
 
+void
+CouchbaseFunction::memoryLimitError()
+{
+  throwError("CB0015", "The memory limit of the connection or of the query was exceeded");
+}
+
 void
 CouchbaseFunction::libCouchbaseError(lcb_t aInstance, lcb_error_t aError) 
 { 
@@ -188,17 +245,39 @@ CouchbaseFunction::getInstance(const DynamicContext* aDctx, const String& aIdent
   {
     if ((lInstance = lInstanceMap->getInstance(aIdent)))
       return lInstance;
+    if (lInstanceMap->isSharded(aIdent))
+      throwError("CB0018", "The function is not supported on a sharded connection.");
   }
   throwError("CB0000", "No instance of couchbase with the given identifier was found.");
   return NULL;
 }
 
+ShardSet
+CouchbaseFunction::getShards(const DynamicContext* aDctx, const String& aIdent) const
+{
+  ShardSet lShards;
+  InstanceMap* lInstanceMap;
+  if ((lInstanceMap = dynamic_cast<InstanceMap*>(aDctx->getExternalFunctionParameter("couchbaseInstanceMap"))))
+  {
+    lcb_t lInstance;
+    if ((lInstance = lInstanceMap->getInstance(aIdent)))
+    {
+      lShards.theInstances.push_back(lInstance);
+      return lShards;
+    }
+    if (lInstanceMap->getShards(aIdent, lShards))
+      return lShards;
+  }
+  throwError("CB0000", "No instance of couchbase with the given identifier was found.");
+  return lShards;
+}
+
 String
-  CouchbaseFunction::ViewOptions::getPathOptions()
+  CouchbaseFunction::ViewOptions::getPathOptions(bool aWithStale)
 {
   String lPathOptions("?");
   bool lAmp = false;
-  if (theStaleOption != "")
+  if (aWithStale && theStaleOption != "")
   {
     lPathOptions.append(theStaleOption);
     lAmp = true;
@@ -210,6 +289,20 @@ String
     lPathOptions.append(theLimitOption);
     lAmp = true;
   }
+  if (theGroupOption != "")
+  {
+    if(lAmp)
+      lPathOptions.append("&");
+    lPathOptions.append(theGroupOption);
+    lAmp = true;
+  }
+  if (theReduceOption != "")
+  {
+    if(lAmp)
+      lPathOptions.append("&");
+    lPathOptions.append(theReduceOption);
+    lAmp = true;
+  }
 
   if (lPathOptions == "?")
     lPathOptions = "";
@@ -271,14 +364,101 @@ void
       Item lValue = aOptions.getObjectValue(lStrKey);
       try
       {
-        int lLimit = lValue.getIntValue();
-        theLimitOption = "limit=" + lLimit;  
+        std::ostringstream lLimit;
+        lLimit << "limit=" << lValue.getIntValue();
+        theLimitOption = lLimit.str();
       }
       catch (ZorbaException& e)
       {
         throwError("CB0009", " limit option must be an integer value");
       } 
     }
+    else if (lStrKey == "group")
+    {
+      Item lValue = aOptions.getObjectValue(lStrKey);
+      try
+      {
+        theGroupOption = lValue.getBooleanValue() ? "group=true" : "group=false";
+      }
+      catch (ZorbaException& e)
+      {
+        throwError("CB0010", " group option must be a boolean value");
+      }
+    }
+    else if (lStrKey == "group_level")
+    {
+      Item lValue = aOptions.getObjectValue(lStrKey);
+      try
+      {
+        std::ostringstream lLevel;
+        lLevel << "group_level=" << lValue.getUnsignedIntValue();
+        theGroupOption = lLevel.str();
+      }
+      catch (ZorbaException& e)
+      {
+        throwError("CB0009", " group_level option must be an integer value");
+      }
+    }
+    else if (lStrKey == "reduce")
+    {
+      Item lValue = aOptions.getObjectValue(lStrKey);
+      try
+      {
+        theReduceOption = lValue.getBooleanValue() ? "reduce=true" : "reduce=false";
+      }
+      catch (ZorbaException& e)
+      {
+        throwError("CB0010", " reduce option must be a boolean value");
+      }
+    }
+    else if (lStrKey == "concurrency")
+    {
+      Item lValue = aOptions.getObjectValue(lStrKey);
+      try
+      {
+        theConcurrency = lValue.getUnsignedIntValue();
+      }
+      catch (ZorbaException& e)
+      {
+        throwError("CB0009", " concurrency option must be an integer value");
+      }
+    }
+    else if (lStrKey == "cache-ttl")
+    {
+      Item lValue = aOptions.getObjectValue(lStrKey);
+      try
+      {
+        theCacheTTL = lValue.getUnsignedIntValue();
+      }
+      catch (ZorbaException& e)
+      {
+        throwError("CB0009", " cache-ttl option must be an integer value");
+      }
+    }
+    else if (lStrKey == "deadline")
+    {
+      Item lValue = aOptions.getObjectValue(lStrKey);
+      try
+      {
+        theDeadline.set(lValue.getUnsignedIntValue());
+      }
+      catch (ZorbaException& e)
+      {
+        throwError("CB0009", " deadline option must be an integer value");
+      }
+    }
+    else if (lStrKey == "include-docs")
+    {
+      Item lValue = aOptions.getObjectValue(lStrKey);
+      try
+      {
+        theIncludeDocs = lValue.getBooleanValue();
+      }
+      catch (ZorbaException& e)
+      {
+        throwError("CB0010", " include-docs option must be a boolean value");
+      }
+    }
     else
     {
       std::ostringstream lMsg;
@@ -289,6 +469,13 @@ void
   lIter->close();
 }
 
+void
+Deadline::check() const
+{
+  if (hasPassed())
+    CouchbaseFunction::throwError("CB0013", "The deadline of the operation expired");
+}
+
 void 
   CouchbaseFunction::GetOptions::setOptions(Item& aOptions)
 {
@@ -332,6 +519,18 @@ void
         throwError("CB0009", " expiration-time option must be an integer value");
       }
     }
+    else if (lStrKey == "deadline")
+    {
+      Item lValue = aOptions.getObjectValue(lStrKey);
+      try
+      {
+        theDeadline.set(lValue.getUnsignedIntValue());
+      }
+      catch (ZorbaException& e)
+      {
+        throwError("CB0009", " deadline option must be an integer value");
+      }
+    }
     else if (lStrKey == "encoding")
     {
       Item lValue = aOptions.getObjectValue(lStrKey);
@@ -343,6 +542,20 @@ void
         throwError("CB0006", lMsg.str().c_str());
       }
     }
+    else if (lStrKey == "project")
+    {
+      Item lValue = aOptions.getObjectValue(lStrKey);
+      if (lValue.isJSONItem())
+      {
+        int lSize = lValue.getArraySize()+1;
+        for (int i = 1; i < lSize; i++)
+          theBuilder.addPath(lValue.getArrayValue(i).getStringValue().c_str());
+      }
+      else
+      {
+        theBuilder.addPath(lValue.getStringValue().c_str());
+      }
+    }
     else
     {
       std::ostringstream lMsg;
@@ -352,6 +565,8 @@ void
   }
   lIter->close();
 
+  if (theBuilder.isProjected() && theType != LCB_JSON)
+    throwError("CB0007", "project: option only supported for JSON values");
 }
 
 void 
@@ -434,6 +649,18 @@ CouchbaseFunction::PutOptions::setOptions(Item& aOptions)
             throwError("CB0006", lMsg.str().c_str());
       }
     }
+    else if (lStrKey == "deadline")
+    {
+      Item lValue = aOptions.getObjectValue(lStrKey);
+      try
+      {
+        theDeadline.set(lValue.getUnsignedIntValue());
+      }
+      catch (ZorbaException& e)
+      {
+        throwError("CB0009", " deadline option must be an integer value");
+      }
+    }
     else if (lStrKey == "wait")
     {
       Item lValue = aOptions.getObjectValue(lStrKey);
@@ -469,595 +696,2535 @@ CouchbaseFunction::PutOptions::setOptions(Item& aOptions)
 /*******************************************************************************
  ******************************************************************************/
 
-InstanceMap::InstanceMap()
-{   
-  InstanceMap::instanceMap = new InstanceMap_t();
+InstanceData*
+InstanceData::get(lcb_t aInstance)
+{
+  return (InstanceData*) lcb_get_cookie(aInstance);
 }
 
-bool
-InstanceMap::storeInstance(const String& aKeyName, lcb_t aInstance)
+const TraceFile_t&
+InstanceData::getTrace(lcb_t aInstance)
 {
-  std::pair<InstanceMap_t::iterator, bool> ret;
-  ret = instanceMap->insert(std::pair<String, lcb_t>(aKeyName, aInstance));
-  return ret.second;
+  static const TraceFile_t theNoTrace;
+  InstanceData* lData = get(aInstance);
+  return lData ? lData->theTrace : theNoTrace;
 }
 
-lcb_t
-InstanceMap::getInstance(const String& aKeyName)
+void
+InstanceData::logSlow(lcb_t aInstance, SlowLog::Entry& aEntry, std::chrono::microseconds aDuration, bool aIsKeyed)
 {
-  InstanceMap::InstanceMap_t::iterator lIter = instanceMap->find(aKeyName);
-  
-  if (lIter == instanceMap->end())
-    return NULL;
-  
-  lcb_t lInstance = lIter->second;
-
-  return lInstance;
+  InstanceData* lData = get(aInstance);
+  if (!lData || !lData->theSlowLog || (uint64_t)aDuration.count() < lData->theSlowThreshold)
+    return;
+
+  aEntry.theDuration = aDuration.count();
+  if (aIsKeyed)
+    aEntry.theNode = getNode(aInstance, aEntry.theKey, aEntry.theKeyLen);
+  lData->theSlowLog->write(aEntry, lData->theSlowMaxPerSecond);
 }
 
-bool
-InstanceMap::deleteInstance(const String& aKeyName)
+int
+InstanceData::getServerIndex(lcb_t aInstance, const char* aKey, size_t aKeyLen)
 {
-  InstanceMap::InstanceMap_t::iterator lIter = instanceMap->find(aKeyName);
+  lcb_cntl_vbinfo_t lInfo;
+  memset(&lInfo, 0, sizeof(lInfo));
+  lInfo.v.v0.key = aKey;
+  lInfo.v.v0.nkey = aKeyLen;
+  if (lcb_cntl(aInstance, LCB_CNTL_GET, LCB_CNTL_VBMAP, &lInfo) != LCB_SUCCESS
+      || lInfo.v.v0.server_index < 0)
+    return -1;
+  return lInfo.v.v0.server_index;
+}
 
-  if (lIter == instanceMap->end())
-    return false;
+std::string
+InstanceData::getNode(lcb_t aInstance, const char* aKey, size_t aKeyLen)
+{
+  int lIndex = getServerIndex(aInstance, aKey, aKeyLen);
+  if (lIndex < 0)
+    return "";
+
+  const char* const* lServers = lcb_get_server_list(aInstance);
+  if (!lServers)
+    return "";
+  for (int i = 0; lServers[i]; ++i)
+  {
+    if (i == lIndex)
+      return lServers[i];
+  }
+  return "";
+}
 
-  lcb_destroy(lIter->second);
+/*******************************************************************************
+ ******************************************************************************/
 
-  instanceMap->erase(lIter);
+MemoryCharge::MemoryCharge(lcb_t aInstance)
+  : theData(InstanceData::get(aInstance)), theBytes(0)
+{
+  if (theData)
+    theQueryMemory = theData->theQueryMemory;
+}
 
+bool
+MemoryCharge::grow(size_t aBytes)
+{
+  if (!theData)
+    return true;
+  if (!theData->theMemory.canCharge(aBytes)
+      || (theQueryMemory && !theQueryMemory->canCharge(aBytes)))
+    return false;
+  theData->theMemory.charge(aBytes);
+  if (theQueryMemory)
+    theQueryMemory->charge(aBytes);
+  theBytes += aBytes;
   return true;
 }
 
-/*******************************************************************************
- ******************************************************************************/
+void
+MemoryCharge::clear()
+{
+  if (!theData || theBytes == 0)
+    return;
+  theData->theMemory.release(theBytes);
+  if (theQueryMemory)
+    theQueryMemory->release(theBytes);
+  theBytes = 0;
+}
 
-zorba::ItemSequence_t
-ConnectFunction::evaluate(
-  const Arguments_t& aArgs,
-  const zorba::StaticContext* aSctx,
-  const zorba::DynamicContext* aDctx) const
+void
+InstanceData::destroyInstance(lcb_t aInstance)
 {
-  DynamicContext* lDctx = const_cast<DynamicContext*>(aDctx);
-  
-  InstanceMap* lInstanceMap;
-  if (!(lInstanceMap = dynamic_cast<InstanceMap*>(lDctx->getExternalFunctionParameter("couchbaseInstanceMap"))))
-  {
-    lInstanceMap = new InstanceMap();
-    lDctx->addExternalFunctionParameter("couchbaseInstanceMap", lInstanceMap);
-  }
+  //a shared I/O loop has to outlive the instance
+  InstanceData* lData = get(aInstance);
+  lcb_destroy(aInstance);
+  delete lData;
+}
 
-  Item lHost;
-  Item lUserName;
-  Item lPassword;
-  Item lBucket;
+void
+InstanceData::error_callback(lcb_t instance, lcb_error_t error, const char* errinfo)
+{
+  InstanceData* lData = get(instance);
+  if (lData)
+    lData->theHasFailed = true;
+}
 
-  Item lOptions = getOneItemArgument(aArgs, 0);
+void
+InstanceData::wait(lcb_t aInstance)
+{
+  lcb_wait(aInstance);
+  InstanceData* lData = get(aInstance);
+  if (lData)
+    lData->theHasPending = false;
+}
 
-  if (lOptions.isJSONItem())
+void
+InstanceData::releaseInstance(lcb_t aInstance)
+{
+  InstanceData* lData = get(aInstance);
+  if (lData)
   {
-    Iterator_t lKeys = lOptions.getObjectKeys();
-    lKeys->open();
-    Item lKey;
-    while (lKeys->next(lKey))
-    {
-      String lStrKey = lKey.getStringValue();
-      if (lStrKey == "host")
-      {
-        lHost = lOptions.getObjectValue(lStrKey);
-      }
-      else if (lStrKey == "username")
-      {
-        lUserName = lOptions.getObjectValue(lStrKey);
-      }
-      else if (lStrKey == "password")
-      {
-        lPassword = lOptions.getObjectValue(lStrKey);
-      }
-      else if (lStrKey == "bucket")
-      {
-        lBucket = lOptions.getObjectValue(lStrKey);
-      }
-      else
-      {
-        std::ostringstream lMsg;
-        lMsg << lStrKey << ": option not supported";
-        throwError("CB0007", lMsg.str().c_str());
-      }
-    }
-    lKeys->close();
+    lData->theIsReleased = true;
+    if (lData->theUsers > 0)
+      return;
   }
+  //the callbacks of pending commands would run on the next wait of
+  //whoever takes the instance from the pool
+  if (lData && !lData->thePoolKey.empty() && !lData->theHasFailed
+      && !lData->theHasPending && !std::uncaught_exception())
+    InstancePool::getInstance().release(lData->thePoolKey, aInstance);
   else
-  {
-    isNotJSONError();
-  }
-  
-  struct lcb_create_st create_options;
-  memset(&create_options, 0, sizeof(create_options));
-  
-  if (lHost.isNull())
-    throwError ("CB0001", "Missing declaration of the couchbase server host");
-  String lStrHost = lHost.getStringValue();
-  create_options.v.v0.host = lStrHost.c_str();
+    destroyInstance(aInstance);
+}
 
-  if (lBucket.isNull())
-    throwError ("CB0001", "Missing declaration of the couchbase bucket");
-  String lStrBucket = lBucket.getStringValue();
-  create_options.v.v0.bucket = lStrBucket.c_str();
+void
+InstanceData::addUser(lcb_t aInstance)
+{
+  InstanceData* lData = get(aInstance);
+  if (lData)
+    ++lData->theUsers;
+}
 
-  if (!lUserName.isNull())
-  {
-    String lStrUserName = lUserName.getStringValue();
-    if (lStrUserName != "null")
-      create_options.v.v0.user = lStrUserName.c_str();
-  }
+void
+InstanceData::removeUser(lcb_t aInstance)
+{
+  InstanceData* lData = get(aInstance);
+  if (!lData)
+    return;
+  lData->theLastUse = time(NULL);
+  if (--lData->theUsers == 0 && lData->theIsReleased)
+    releaseInstance(aInstance);
+}
+
+/*******************************************************************************
+ ******************************************************************************/
+
+void
+Operation::installCallbacks(lcb_t aInstance)
+{
+  lcb_set_get_callback(aInstance, get_callback);
+  lcb_set_store_callback(aInstance, store_callback);
+  lcb_set_remove_callback(aInstance, remove_callback);
+  lcb_set_touch_callback(aInstance, touch_callback);
+  lcb_set_observe_callback(aInstance, observe_callback);
+  lcb_set_http_data_callback(aInstance, http_data_callback);
+  lcb_set_http_complete_callback(aInstance, http_complete_callback);
+}
 
-  if (!lPassword.isNull())
+void
+Operation::start(lcb_t aInstance, size_t aBytesOut, const String& aKey, size_t aBatch)
+{
+  theStart = std::chrono::steady_clock::now();
+  //reused operations (polls, view batches) log each request on its own
+  theBytesIn = 0;
+  InstanceData* lData = InstanceData::get(aInstance);
+  if (!lData)
+    return;
+  lData->theHasPending = true;
+  lData->theStats.addBytesOut(aBytesOut);
+  if (lData->theTrace || lData->theSlowLog)
   {
-    String lStrPassword = lPassword.getStringValue();
-    if (lStrPassword != "null")
-      create_options.v.v0.passwd = lStrPassword.c_str();
+    theTraceKey.assign(aKey.c_str(), aKey.size());
+    theBatch = aBatch;
+    theBytesOut = aBytesOut;
   }
+}
 
-  lcb_t lInstance;
-  lcb_error_t lError;
-  
-  lError = lcb_create(&lInstance, &create_options);
-  if (lError != LCB_SUCCESS)
+bool
+Operation::retry(lcb_t aInstance, std::vector<std::string>* aKeys)
+{
+  InstanceData* lData = InstanceData::get(aInstance);
+  if (theRetryKeys.empty() || !lData)
   {
-    throwError("LCB0001", "Error creating a libcouchbase Instance");
-    lcb_strerror(NULL, lError);
+    theRetryRound = 0;
+    return false;
   }
 
-  //Connect to couchbase
-  if ((lError = lcb_connect(lInstance)) != LCB_SUCCESS)
+  ++theRetryRound;
+  lData->theStats.addRetries(theRetryKeys.size());
   {
-    throwError("LCB0001", "Error connecting to the couchbase server");
-    lcb_strerror(NULL, lError);
+    TraceSpan lSpan(lData->theTrace, "retry-wait", "phase");
+    lSpan.addArg("keys", theRetryKeys.size());
+    std::this_thread::sleep_for(lData->theRetry.getDelay(theRetryRound));
   }
-
-  lcb_wait(lInstance);
-  
-  uuid lUUID;
-  uuid::create(&lUUID);
-  
-  std::stringstream lStream;
-  lStream << lUUID;
-
-  String lStrUUID = lStream.str();
-
-  lInstanceMap->storeInstance(lStrUUID, lInstance);
-
-  return ItemSequence_t(new SingletonItemSequence(CouchbaseModule::getItemFactory()->createAnyURI(lStrUUID)));   
+  if (aKeys)
+    aKeys->swap(theRetryKeys);
+  theRetryKeys.clear();
+  return true;
 }
 
-/*******************************************************************************
- ******************************************************************************/
-
-zorba::ItemSequence_t
-RemoveFunction::evaluate(
-  const Arguments_t& aArgs,
-  const zorba::StaticContext* aSctx,
-  const zorba::DynamicContext* aDctx) const
+bool
+Operation::defer(lcb_t aInstance, lcb_error_t aError, const void* aKey, size_t aKeyLen) const
 {
-  String lInstanceID = getOneStringArgument(aArgs, 0);
-  lcb_t lInstance = getInstance(aDctx, lInstanceID);
-  Iterator_t lKeys = getIterArgument(aArgs, 1);
-
-
-  lcb_error_t lError;
-  Item lKey;
-  lKeys->open();
-  while (lKeys->next(lKey))
-  {
-    lcb_remove_cmd_st lCmd;
-    String lStrKey = lKey.getStringValue();
-    lCmd.v.v0.key = lStrKey.c_str();
-    lCmd.v.v0.nkey = lStrKey.size(); 
-    lcb_remove_cmd_st *lCommand[1] = {&lCmd};
-
-    lError = lcb_remove(lInstance, NULL, 1, lCommand);
-    if (lError != LCB_SUCCESS)
-    {
-      CouchbaseFunction::libCouchbaseError (lInstance, lError);
-    } 
-    
-    lcb_wait(lInstance);
-  }
-  lKeys->close();
-
-  return ItemSequence_t(new EmptySequence());  
+  InstanceData* lData = InstanceData::get(aInstance);
+  if (!lData || !aKey || !RetryPolicy::isTemporary(aError)
+      || theRetryRound + 1 >= lData->theRetry.theMaxAttempts)
+    return false;
+  theRetryKeys.push_back(std::string((const char*)aKey, aKeyLen));
+  return true;
 }
 
-/*******************************************************************************
- ******************************************************************************/
-
 void
-CouchbaseFunction::GetItemSequence::get_callback(lcb_t instance, const void *cookie, lcb_error_t error, const lcb_get_resp_t *resp)
+Operation::record(
+  lcb_t aInstance,
+  const void* aCookie,
+  InstanceStats::op_type_t aType,
+  lcb_error_t aError,
+  size_t aBytesIn,
+  const void* aKey,
+  size_t aKeyLen)
 {
-  if (error != LCB_SUCCESS)
+  InstanceData* lData = InstanceData::get(aInstance);
+  const Operation* lOperation = (const Operation*) aCookie;
+  if (!lData || !lOperation)
+    return;
+
+  //commands of a batch are sent at different times, the operation only
+  //knows the last send
+  std::chrono::steady_clock::time_point lStart = lOperation->theStart;
+  size_t lBatch = lOperation->theBatch;
+  size_t lBytesOut = lOperation->theBytesOut;
+  if (lOperation->theCommandLog && aKey)
+    lOperation->theCommandLog->getSent(aKey, aKeyLen, lStart, lBatch, lBytesOut);
+
+  std::chrono::steady_clock::time_point lEnd = std::chrono::steady_clock::now();
+  std::chrono::microseconds lLatency = std::chrono::duration_cast<std::chrono::microseconds>(
+    lEnd - lStart);
+  lData->theStats.record(aType, lLatency.count(), aError, aBytesIn);
+
+  //the key of the response, batched operations only know their first key
+  const char* lKey = (const char*) aKey;
+  if (!lKey)
   {
-    libCouchbaseError (instance, error);
+    lKey = lOperation->theTraceKey.data();
+    aKeyLen = lOperation->theTraceKey.size();
   }
-  
-  GetOptions* lRes = (GetOptions*)cookie;
-  
-  lcb_storage_type_t lType = lRes->getGetType();
-
-  if (lType == LCB_TEXT)
-  {
-    String lEncoding = lRes->getEncoding();
-    String lTmp((const char*)resp->v.v0.bytes, resp->v.v0.nbytes);
-    if (lEncoding != "" && transcode::is_necessary(lEncoding.c_str()))
-    {    
-      transcode::stream<std::istringstream> lTranscoder(lEncoding.c_str(), lTmp.c_str());
-      lTmp.clear();
 
-      char buf[1024];
-      while (lTranscoder.good())
-      {
-        lTranscoder.read(buf, 1024);
-        lTmp.append(buf, lTranscoder.gcount());
-      }      
-    }
-    lRes->theItem = CouchbaseModule::getItemFactory()->createString(lTmp);
-  }
-  else if (lType == LCB_BASE64)
+  if (lData->theSlowLog)
   {
-    //unsigned char lData[resp->v.v0.nbytes];
-    //size_t lLen = resp->v.v0.nbytes;
-    //memcpy(lData, resp->v.v0.bytes, lLen);
-    lRes->theItem = CouchbaseModule::getItemFactory()->createBase64Binary(reinterpret_cast<char const*>(resp->v.v0.bytes), resp->v.v0.nbytes, false);
+    SlowLog::Entry lEntry(InstanceStats::getName(aType), "server");
+    lEntry.theKey = lKey;
+    lEntry.theKeyLen = aKeyLen;
+    if (aType == InstanceStats::OP_STORE && lBytesOut >= aKeyLen)
+      lEntry.theValueSize = lBytesOut - aKeyLen;
+    else if (aType == InstanceStats::OP_HTTP && lOperation->theBytesIn > 0)
+      lEntry.theValueSize = lOperation->theBytesIn;
+    else
+      lEntry.theValueSize = aBytesIn;
+    InstanceData::logSlow(aInstance, lEntry, lLatency, aType != InstanceStats::OP_HTTP);
   }
-  else
+
+  if (lData->theTrace)
   {
-    throwError ("CB0004", "The requested collection has a not recognized type");
+    std::string lArgs;
+    TraceSpan::appendArg(lArgs, "key", lKey, aKeyLen);
+    TraceSpan::appendArg(lArgs, "batch", lBatch);
+    TraceSpan::appendArg(lArgs, "bytes-out", lBytesOut);
+    TraceSpan::appendArg(lArgs, "bytes-in", aBytesIn);
+    if (aError != LCB_SUCCESS)
+    {
+      const char* lError = lcb_strerror(aInstance, aError);
+      TraceSpan::appendArg(lArgs, "error", lError, strlen(lError));
+    }
+    lData->theTrace->complete(InstanceStats::getName(aType), "operation", lStart, lEnd, lArgs);
   }
 }
 
 void
-CouchbaseFunction::GetItemSequence::GetIterator::open()
+Operation::get_callback(lcb_t instance, const void* cookie, lcb_error_t error, const lcb_get_resp_t* resp)
 {
-  lcb_set_get_callback(theInstance, GetItemSequence::get_callback);
-  theKeys->open();
+  if (resp)
+    record(instance, cookie, InstanceStats::OP_GET, error, resp->v.v0.nbytes, resp->v.v0.key, resp->v.v0.nkey);
+  else
+    record(instance, cookie, InstanceStats::OP_GET, error, 0);
+  const Operation* lOperation = (const Operation*) cookie;
+  if (lOperation && resp && lOperation->defer(instance, error, resp->v.v0.key, resp->v.v0.nkey))
+    return;
+  if (lOperation && lOperation->theGetCallback)
+    lOperation->theGetCallback(instance, lOperation->theCookie, error, resp);
 }
 
 void
-CouchbaseFunction::GetItemSequence::GetIterator::close()
+Operation::store_callback(lcb_t instance, const void* cookie, lcb_storage_t operation, lcb_error_t error, const lcb_store_resp_t* resp)
 {
-  theKeys->close();
+  if (resp)
+    record(instance, cookie, InstanceStats::OP_STORE, error, 0, resp->v.v0.key, resp->v.v0.nkey);
+  else
+    record(instance, cookie, InstanceStats::OP_STORE, error, 0);
+  const Operation* lOperation = (const Operation*) cookie;
+  if (lOperation && resp && lOperation->defer(instance, error, resp->v.v0.key, resp->v.v0.nkey))
+    return;
+  if (lOperation && lOperation->theStoreCallback)
+    lOperation->theStoreCallback(instance, lOperation->theCookie, operation, error, resp);
 }
 
-bool
-CouchbaseFunction::GetItemSequence::GetIterator::next(Item& aItem)
+void
+Operation::remove_callback(lcb_t instance, const void* cookie, lcb_error_t error, const lcb_remove_resp_t* resp)
 {
-  Item lKey;
-  if (theKeys->next(lKey))
-  {
-    GetOptions* lValue = &theOptions;
-    String lStrKey = lKey.getStringValue();
-    lcb_get_cmd_st lGet;
-    lGet.v.v0.key = lStrKey.c_str();
-    lGet.v.v0.nkey = lStrKey.size();
-    unsigned int lExpTime = theOptions.getExpTime();
-    if (lExpTime > 0)
-    {
-      lGet.v.v0.exptime = lExpTime;
-    }
-
-    lcb_get_cmd_st *lCommand[1] = {&lGet};
+  if (resp)
+    record(instance, cookie, InstanceStats::OP_REMOVE, error, 0, resp->v.v0.key, resp->v.v0.nkey);
+  else
+    record(instance, cookie, InstanceStats::OP_REMOVE, error, 0);
+  const Operation* lOperation = (const Operation*) cookie;
+  if (lOperation && resp && lOperation->defer(instance, error, resp->v.v0.key, resp->v.v0.nkey))
+    return;
+  if (lOperation && lOperation->theRemoveCallback)
+    lOperation->theRemoveCallback(instance, lOperation->theCookie, error, resp);
+}
 
-    theError = lcb_get(theInstance, lValue, 1, lCommand);
+void
+Operation::touch_callback(lcb_t instance, const void* cookie, lcb_error_t error, const lcb_touch_resp_t* resp)
+{
+  if (resp)
+    record(instance, cookie, InstanceStats::OP_TOUCH, error, 0, resp->v.v0.key, resp->v.v0.nkey);
+  else
+    record(instance, cookie, InstanceStats::OP_TOUCH, error, 0);
+  const Operation* lOperation = (const Operation*) cookie;
+  if (lOperation && resp && lOperation->defer(instance, error, resp->v.v0.key, resp->v.v0.nkey))
+    return;
+  if (lOperation && lOperation->theTouchCallback)
+    lOperation->theTouchCallback(instance, lOperation->theCookie, error, resp);
+}
 
-    if (theError != LCB_SUCCESS)
-    {
-      libCouchbaseError (theInstance, theError);
-    } 
-    lcb_wait(theInstance);
-    
-    if (lValue->theItem.isNull())
-      return false;
+void
+Operation::observe_callback(lcb_t instance, const void* cookie, lcb_error_t error, const lcb_observe_resp_t* resp)
+{
+  //the last callback of an observe has no key
+  if (!resp || !resp->v.v0.key)
+    record(instance, cookie, InstanceStats::OP_OBSERVE, error, 0);
+  const Operation* lOperation = (const Operation*) cookie;
+  if (lOperation && lOperation->theObserveCallback)
+    lOperation->theObserveCallback(instance, lOperation->theCookie, error, resp);
+}
 
-    aItem = lValue->theItem;
+void
+Operation::http_data_callback(lcb_http_request_t request, lcb_t instance, const void* cookie, lcb_error_t error, const lcb_http_resp_t* resp)
+{
+  InstanceData* lData = InstanceData::get(instance);
+  const Operation* lOperation = (const Operation*) cookie;
+  if (lData && resp)
+    lData->theStats.addBytesIn(resp->v.v0.nbytes);
+  if (lOperation && resp)
+    lOperation->theBytesIn += resp->v.v0.nbytes;
+  if (lOperation && lOperation->theHttpDataCallback)
+    lOperation->theHttpDataCallback(request, instance, lOperation->theCookie, error, resp);
+}
 
-    return true;
-  }
-  else
-  {
-    return false;
-  }
+void
+Operation::http_complete_callback(lcb_http_request_t request, lcb_t instance, const void* cookie, lcb_error_t error, const lcb_http_resp_t* resp)
+{
+  record(instance, cookie, InstanceStats::OP_HTTP, error, resp ? resp->v.v0.nbytes : 0);
+  const Operation* lOperation = (const Operation*) cookie;
+  if (lOperation && lOperation->theHttpCompleteCallback)
+    lOperation->theHttpCompleteCallback(request, instance, lOperation->theCookie, error, resp);
 }
 
 /*******************************************************************************
  ******************************************************************************/
 
-zorba::ItemSequence_t
-GetTextFunction::evaluate(
-  const Arguments_t& aArgs,
-  const zorba::StaticContext* aSctx,
-  const zorba::DynamicContext* aDctx) const
+NodeScheduler::NodeScheduler(lcb_t aInstance)
+  : theInstance(aInstance), theOperation(this)
 {
-  String lInstanceID = getOneStringArgument(aArgs, 0);
-  lcb_t lInstance = getInstance(aDctx, lInstanceID);
-  Iterator_t lKeys = getIterArgument(aArgs, 1);
-  GetOptions lOptions(LCB_TEXT);
-  if (aArgs.size() > 2)
-  {
-    Item lOptionsArg = getOneItemArgument(aArgs, 2);
-    lOptions.setOptions(lOptionsArg);
-  }
- 
-  return ItemSequence_t(new GetItemSequence(lInstance,lKeys, lOptions));   
+  theOperation.theCommandLog = this;
+  theOperation.theStoreCallback = store_callback;
+  theOperation.theRemoveCallback = remove_callback;
+  theOperation.theTouchCallback = touch_callback;
+  clear();
 }
 
-/*******************************************************************************
- ******************************************************************************/
-
-zorba::ItemSequence_t
-GetBinaryFunction::evaluate(
-  const Arguments_t& aArgs,
-  const zorba::StaticContext* aSctx,
-  const zorba::DynamicContext* aDctx) const
+void
+NodeScheduler::clear()
 {
-  String lInstanceID = getOneStringArgument(aArgs, 0);
-  lcb_t lInstance = getInstance(aDctx, lInstanceID);
-  Iterator_t lKeys = getIterArgument(aArgs, 1);
-  GetOptions lOptions(LCB_BASE64);
-  if (aArgs.size() > 2)
-  {
-    Item lOptionsArg = getOneItemArgument(aArgs, 2);
-    lOptions.setOptions(lOptionsArg);
-  }
- 
-  return ItemSequence_t(new GetItemSequence(lInstance,lKeys, lOptions));   
+  theKeys.clear();
+  theServers.clear();
+  theSent.clear();
+  theSendTimes.clear();
+  theSendBatches.clear();
+  theResults.clear();
+  theError = std::exception_ptr();
+  theOperation.theRetryKeys.clear();
+  theOperation.theRetryRound = 0;
+
+  size_t lServers = 0;
+  const char* const* lList = lcb_get_server_list(theInstance);
+  while (lList && lList[lServers])
+    ++lServers;
+  theQueues.assign(lServers + 1, std::deque<size_t>());
+  theInFlight.assign(lServers + 1, 0);
 }
 
-/*******************************************************************************
- ******************************************************************************/
+size_t
+NodeScheduler::add(const String& aKey)
+{
+  size_t lUnknown = theQueues.size() - 1;
+  int lServer = InstanceData::getServerIndex(theInstance, aKey.c_str(), aKey.size());
+  size_t lQueue = (lServer < 0 || (size_t)lServer >= lUnknown) ? lUnknown : lServer;
+
+  size_t lCommand = theKeys.size();
+  theKeys.push_back(std::string(aKey.c_str(), aKey.size()));
+  theServers.push_back(lQueue);
+  theSendTimes.push_back(std::chrono::steady_clock::time_point());
+  theSendBatches.push_back(0);
+  theResults.push_back(LCB_SUCCESS);
+  theQueues[lQueue].push_back(lCommand);
+  return lCommand;
+}
 
-void CouchbaseFunction::observe_callback(lcb_t instance, const void *cookie, lcb_error_t error, const lcb_observe_resp_t *resp)
+void
+NodeScheduler::flush(size_t aServer)
 {
-  if (error != LCB_SUCCESS)
+  if (theError)
+    return;
+
+  std::deque<size_t>& lQueue = theQueues[aServer];
+  std::vector<size_t> lCommands;
+  while (!lQueue.empty() && theInFlight[aServer] < WINDOW)
   {
-    libCouchbaseError (instance, error);
+    size_t lCommand = lQueue.front();
+    lQueue.pop_front();
+    theSent[theKeys[lCommand]].push_back(lCommand);
+    ++theInFlight[aServer];
+    lCommands.push_back(lCommand);
   }
-  
-  PutOptions* lWait = (PutOptions*) cookie;
-  //verify is coming from the master
-  if (resp->v.v0.from_master > 0)
+  if (lCommands.empty())
+    return;
+
+  std::chrono::steady_clock::time_point lNow = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < lCommands.size(); ++i)
   {
-    lcb_observe_t lStatus = resp->v.v0.status;if (lStatus == LCB_OBSERVE_NOT_FOUND)
+    theSendTimes[lCommands[i]] = lNow;
+    theSendBatches[lCommands[i]] = lCommands.size();
+  }
+  try
+  {
+    send(lCommands);
+  }
+  catch (...)
+  {
+    //the commands were not scheduled, the send may have been a refill
+    //from a callback
+    for (size_t i = 0; i < lCommands.size(); ++i)
     {
-      throwError("CB0011", "Variable stored not found.");
+      std::deque<size_t>& lSent = theSent[theKeys[lCommands[i]]];
+      lSent.pop_back();
+      if (lSent.empty())
+        theSent.erase(theKeys[lCommands[i]]);
+      --theInFlight[aServer];
     }
-    //check for flag of persisntancy
-    lWait->setWaiting(lStatus & LCB_OBSERVE_PERSISTED?false:true);
+    fail(std::current_exception());
   }
 }
 
-void CouchbaseFunction::put (lcb_t aInstance, Iterator_t aKeys, Iterator_t aValues, PutOptions aOptions)
+void
+NodeScheduler::flushAll()
 {
-  lcb_error_t lError;
-  Item lKey;
-  Item lValue;
+  for (size_t i = 0; i < theQueues.size(); ++i)
+    flush(i);
+}
 
-  aKeys->open();
-  aValues->open();
-  while (aKeys->next(lKey))
-  {
-    if (!aValues->next(lValue))
-      throwError("CB0005", "The number of key/value's on the save function is not the same.");
+bool
+NodeScheduler::complete(const void* aKey, size_t aKeyLen, size_t& aCommand)
+{
+  std::map<std::string, std::deque<size_t> >::iterator lIter =
+    theSent.find(std::string((const char*)aKey, aKeyLen));
+  if (lIter == theSent.end())
+    return false;
 
-    String lStrKey = lKey.getStringValue();
+  aCommand = lIter->second.front();
+  lIter->second.pop_front();
+  if (lIter->second.empty())
+    theSent.erase(lIter);
 
-    //TODO: add more options
-    lcb_store_cmd_st lPut;
-    lPut.v.v0.key = lStrKey.c_str();
-    lPut.v.v0.nkey = lStrKey.size();
-    
-    const char* lData;
-    size_t lLen = 0;
-    lPut.v.v0.datatype = aOptions.getOperationType();
-    String lStrValue;
-    if (lPut.v.v0.datatype == LCB_TEXT)
-    {
-      String lEncoding = aOptions.getEncoding();
-      lStrValue = lValue.getStringValue();
-      if (lEncoding != "" && transcode::is_necessary(lEncoding.c_str()))
-      {
-        std::stringstream lStream;        
-        transcode::attach(lStream, lEncoding.c_str());
-        lStream << lStrValue.c_str();
-        lStrValue.clear();
-        lStrValue = lStream.str();
-        lData = lStrValue.c_str();
-        lLen = lStrValue.size();
-      }
-      else
-      {
-        lData = lStrValue.c_str();
-        lLen = lStrValue.size();
-      }
-    }
-    else if (lPut.v.v0.datatype == LCB_BASE64)
+  size_t lServer = theServers[aCommand];
+  --theInFlight[lServer];
+  flush(lServer);
+  return true;
+}
+
+bool
+NodeScheduler::getSent(
+  const void* aKey,
+  size_t aKeyLen,
+  std::chrono::steady_clock::time_point& aTime,
+  size_t& aBatch,
+  size_t& aBytesOut) const
+{
+  std::map<std::string, std::deque<size_t> >::const_iterator lIter =
+    theSent.find(std::string((const char*)aKey, aKeyLen));
+  if (lIter == theSent.end())
+    return false;
+
+  size_t lCommand = lIter->second.front();
+  aTime = theSendTimes[lCommand];
+  aBatch = theSendBatches[lCommand];
+  aBytesOut = getBytesOut(lCommand);
+  return true;
+}
+
+void
+NodeScheduler::run(const Deadline& aDeadline)
+{
+  const TraceFile_t& lTrace = InstanceData::getTrace(theInstance);
+  std::vector<std::string> lRetryKeys;
+  do
+  {
+    //the responses of deferred commands were not passed on, so their
+    //slots are still taken
+    for (size_t i = 0; i < lRetryKeys.size(); ++i)
     {
-      lData = lValue.getBase64BinaryValue(lLen);
+      size_t lCommand;
+      if (complete(lRetryKeys[i].data(), lRetryKeys[i].size(), lCommand))
+        theQueues[theServers[lCommand]].push_back(lCommand);
     }
-    else
+    if (!lRetryKeys.empty() && aDeadline.hasPassed())
     {
-      throwError ("CB0004", " Storing type not recognized");
+      theOperation.theRetryRound = 0;
+      aDeadline.check();
     }
+    lRetryKeys.clear();
 
-    lPut.v.v0.bytes = lData;
-    lPut.v.v0.nbytes = lLen;
-    lPut.v.v0.operation = aOptions.getOperation();
-    unsigned int lExpTime = aOptions.getExmpTime();
-    if (lExpTime > 0)
+    flushAll();
     {
-      lPut.v.v0.exptime = lExpTime;
+      TraceSpan lWait(lTrace, "lcb_wait", "phase");
+      InstanceData::wait(theInstance);
     }
 
-    lcb_store_cmd_st *lCommands[1] = {&lPut};
-    lError = lcb_store(aInstance, NULL, 1, lCommands);
-    
-    if (lError != LCB_SUCCESS)
+    if (theError)
     {
-      libCouchbaseError (aInstance, lError);
-    } 
-    //Wait for store
-    lcb_wait(aInstance);
-    //Check if wait for disk
-    if (aOptions.getWaitType() != CB_WAIT_FALSE)
-    {     
-      lcb_set_observe_callback(aInstance, observe_callback);
-      PutOptions* lOptions = &aOptions;
-      do {
-        lcb_observe_cmd_t lObserve;
-        lObserve.version = 0;
-        lObserve.v.v0.key = lStrKey.c_str();
-        lObserve.v.v0.nkey = lStrKey.size();
-        lcb_observe_cmd_t* lCommands[1] = { &lObserve };
-        lcb_observe(aInstance, lOptions, 1, lCommands);
-        lcb_wait(aInstance);
-      }while(lOptions->isWaiting());
+      std::exception_ptr lError = theError;
+      theError = std::exception_ptr();
+      theOperation.theRetryKeys.clear();
+      theOperation.theRetryRound = 0;
+      std::rethrow_exception(lError);
     }
-  }
-
-  if (aValues->next(lValue))
-    throwError("CB0005", "The number of key/value's on the save function is not the same.");
 
-  aKeys->close();
-  aValues->close();
+    //nothing is in flight anymore, the keys to retry are dropped
+    if (!theOperation.theRetryKeys.empty() && aDeadline.hasPassed())
+    {
+      theOperation.theRetryKeys.clear();
+      theOperation.theRetryRound = 0;
+      aDeadline.check();
+    }
+  } while (theOperation.retry(theInstance, &lRetryKeys));
+}
 
+void
+NodeScheduler::cancel()
+{
+  for (size_t i = 0; i < theQueues.size(); ++i)
+    theQueues[i].clear();
+  InstanceData::wait(theInstance);
+  theError = std::exception_ptr();
+  theOperation.theRetryKeys.clear();
+  theOperation.theRetryRound = 0;
 }
 
-/*******************************************************************************
- ******************************************************************************/
+void
+NodeScheduler::store_callback(lcb_t instance, const void* cookie, lcb_storage_t operation, lcb_error_t error, const lcb_store_resp_t* resp)
+{
+  NodeScheduler* lScheduler = (NodeScheduler*)cookie;
+  size_t lCommand;
+  if (resp && lScheduler->complete(resp->v.v0.key, resp->v.v0.nkey, lCommand))
+    lScheduler->theResults[lCommand] = error;
+}
 
-zorba::ItemSequence_t
-PutTextFunction::evaluate(
-  const Arguments_t& aArgs,
-  const zorba::StaticContext* aSctx,
-  const zorba::DynamicContext* aDctx) const
+void
+NodeScheduler::remove_callback(lcb_t instance, const void* cookie, lcb_error_t error, const lcb_remove_resp_t* resp)
 {
-  String lInstanceID = CouchbaseFunction::getOneStringArgument(aArgs, 0);
-  lcb_t lInstance = getInstance(aDctx, lInstanceID);
-  Iterator_t lKeys = getIterArgument(aArgs, 1);
-  Iterator_t lValues = getIterArgument(aArgs, 2);
-  
-  PutOptions lOptions(LCB_TEXT);
-  if (aArgs.size() > 3)
-  {
-    Item lOptionsArg = getOneItemArgument(aArgs, 3);
-    lOptions.setOptions(lOptionsArg);
-  }
+  NodeScheduler* lScheduler = (NodeScheduler*)cookie;
+  size_t lCommand;
+  if (resp && lScheduler->complete(resp->v.v0.key, resp->v.v0.nkey, lCommand))
+    lScheduler->theResults[lCommand] = error;
+}
 
-  put(lInstance, lKeys, lValues, lOptions);
-  return ItemSequence_t(new EmptySequence());  
+void
+NodeScheduler::touch_callback(lcb_t instance, const void* cookie, lcb_error_t error, const lcb_touch_resp_t* resp)
+{
+  NodeScheduler* lScheduler = (NodeScheduler*)cookie;
+  size_t lCommand;
+  if (resp && lScheduler->complete(resp->v.v0.key, resp->v.v0.nkey, lCommand))
+    lScheduler->theResults[lCommand] = error;
 }
 
 /*******************************************************************************
  ******************************************************************************/
 
-zorba::ItemSequence_t
-PutBinaryFunction::evaluate(
-  const Arguments_t& aArgs,
-  const zorba::StaticContext* aSctx,
-  const zorba::DynamicContext* aDctx) const
-{
-  String lInstanceID = CouchbaseFunction::getOneStringArgument(aArgs, 0);
-  lcb_t lInstance = getInstance(aDctx, lInstanceID);
-  Iterator_t lKeys = getIterArgument(aArgs, 1);
-  Iterator_t lValues = getIterArgument(aArgs, 2);
-  
+InstanceMap::InstanceMap()
+  : theMemory(new MemoryAccount())
+{   
+  InstanceMap::instanceMap = new InstanceMap_t();
+}
+
+bool
+InstanceMap::storeInstance(const String& aKeyName, lcb_t aInstance)
+{
+  releaseIdle();
+  std::pair<InstanceMap_t::iterator, bool> ret;
+  ret = instanceMap->insert(std::pair<String, lcb_t>(aKeyName, aInstance));
+  return ret.second;
+}
+
+lcb_t
+InstanceMap::getInstance(const String& aKeyName)
+{
+  releaseIdle();
+  return findInstance(aKeyName);
+}
+
+lcb_t
+InstanceMap::findInstance(const String& aKeyName)
+{
+  InstanceMap::InstanceMap_t::iterator lIter = instanceMap->find(aKeyName);
+  
+  if (lIter == instanceMap->end())
+    return NULL;
+  
+  lcb_t lInstance = lIter->second;
+  InstanceData::get(lInstance)->theLastUse = time(NULL);
+
+  return lInstance;
+}
+
+void
+InstanceMap::releaseIdle()
+{
+  time_t lNow = time(NULL);
+  std::set<String> lIdle;
+  for (InstanceMap_t::const_iterator lIter = instanceMap->begin();
+       lIter != instanceMap->end(); ++lIter)
+  {
+    if (InstanceData::get(lIter->second)->isIdle(lNow))
+      lIdle.insert(lIter->first);
+  }
+  if (lIdle.empty())
+    return;
+
+  //the shards of a sharded connection are used (and closed) together
+  ShardedMap_t::iterator lSharded = theSharded.begin();
+  while (lSharded != theSharded.end())
+  {
+    const std::vector<String>& lIds = lSharded->second.theIds;
+    bool lIsIdle = false;
+    for (size_t i = 0; i < lIds.size() && !lIsIdle; ++i)
+      lIsIdle = lIdle.find(lIds[i]) != lIdle.end();
+    if (lIsIdle)
+    {
+      lIdle.insert(lIds.begin(), lIds.end());
+      theSharded.erase(lSharded++);
+    }
+    else
+    {
+      ++lSharded;
+    }
+  }
+
+  for (std::set<String>::const_iterator lId = lIdle.begin(); lId != lIdle.end(); ++lId)
+  {
+    InstanceMap_t::iterator lIter = instanceMap->find(*lId);
+    if (lIter == instanceMap->end())
+      continue;
+    //an instance idle for that long is not worth keeping in the pool
+    InstanceData::get(lIter->second)->thePoolKey.clear();
+    InstanceData::releaseInstance(lIter->second);
+    instanceMap->erase(lIter);
+  }
+}
+
+bool
+InstanceMap::storeSharded(const String& aKeyName, const std::vector<String>& aIds, const std::shared_ptr<const ShardRing>& aRing)
+{
+  Sharded lSharded;
+  lSharded.theIds = aIds;
+  lSharded.theRing = aRing;
+  return theSharded.insert(std::pair<String, Sharded>(aKeyName, lSharded)).second;
+}
+
+bool
+InstanceMap::isSharded(const String& aKeyName) const
+{
+  return theSharded.find(aKeyName) != theSharded.end();
+}
+
+bool
+InstanceMap::getShards(const String& aKeyName, ShardSet& aShards)
+{
+  releaseIdle();
+  ShardedMap_t::const_iterator lIter = theSharded.find(aKeyName);
+  if (lIter == theSharded.end())
+    return false;
+
+  aShards.theInstances.clear();
+  for (size_t i = 0; i < lIter->second.theIds.size(); ++i)
+  {
+    lcb_t lInstance = findInstance(lIter->second.theIds[i]);
+    if (!lInstance)
+      return false;
+    aShards.theInstances.push_back(lInstance);
+  }
+  aShards.theRing = lIter->second.theRing;
+  return true;
+}
+
+bool
+InstanceMap::deleteInstance(const String& aKeyName)
+{
+  ShardedMap_t::iterator lSharded = theSharded.find(aKeyName);
+  if (lSharded != theSharded.end())
+  {
+    std::vector<String> lIds = lSharded->second.theIds;
+    theSharded.erase(lSharded);
+    for (size_t i = 0; i < lIds.size(); ++i)
+      deleteInstance(lIds[i]);
+    return true;
+  }
+
+  InstanceMap::InstanceMap_t::iterator lIter = instanceMap->find(aKeyName);
+
+  if (lIter == instanceMap->end())
+    return false;
+
+  InstanceData::releaseInstance(lIter->second);
+
+  instanceMap->erase(lIter);
+
+  return true;
+}
+
+/*******************************************************************************
+ ******************************************************************************/
+
+void
+ConnectFunction::ConnectOptions::setOptions(Item& aOptions)
+{
+  if (!aOptions.isJSONItem())
+    isNotJSONError();
+
+  Item lHost;
+  Item lBucket;
+  Iterator_t lKeys = aOptions.getObjectKeys();
+  lKeys->open();
+  Item lKey;
+  while (lKeys->next(lKey))
+  {
+    String lStrKey = lKey.getStringValue();
+    if (lStrKey == "host")
+    {
+      lHost = aOptions.getObjectValue(lStrKey);
+    }
+    else if (lStrKey == "username")
+    {
+      theUserName = aOptions.getObjectValue(lStrKey).getStringValue();
+      if (theUserName == "null")
+        theUserName = "";
+    }
+    else if (lStrKey == "password")
+    {
+      thePassword = aOptions.getObjectValue(lStrKey).getStringValue();
+      if (thePassword == "null")
+        thePassword = "";
+    }
+    else if (lStrKey == "bucket")
+    {
+      lBucket = aOptions.getObjectValue(lStrKey);
+    }
+    else if (lStrKey == "config-cache")
+    {
+      theConfigCache = aOptions.getObjectValue(lStrKey).getStringValue();
+    }
+    else if (lStrKey == "operation-timeout"
+             || lStrKey == "view-timeout"
+             || lStrKey == "connect-timeout")
+    {
+      Item lValue = aOptions.getObjectValue(lStrKey);
+      unsigned int lTimeout = 0;
+      try
+      {
+        lTimeout = lValue.getUnsignedIntValue();
+      }
+      catch (ZorbaException& e)
+      {
+        std::ostringstream lMsg;
+        lMsg << " " << lStrKey << " option must be an integer value";
+        throwError("CB0009", lMsg.str().c_str());
+      }
+      if (lTimeout > MAX_TIMEOUT)
+      {
+        std::ostringstream lMsg;
+        lMsg << " " << lStrKey << " option must not exceed " << MAX_TIMEOUT << " milliseconds";
+        throwError("CB0009", lMsg.str().c_str());
+      }
+      if (lStrKey == "operation-timeout")
+        theOperationTimeout = lTimeout;
+      else if (lStrKey == "view-timeout")
+        theViewTimeout = lTimeout;
+      else
+        theConnectTimeout = lTimeout;
+    }
+    else if (lStrKey == "io-plugin")
+    {
+      String lValue = aOptions.getObjectValue(lStrKey).getStringValue();
+      if (!IOLoops::getType(lValue.c_str(), theIOType))
+      {
+        std::ostringstream lMsg;
+        lMsg << lStrKey << "=" << lValue << " : option not supported";
+        throwError("CB0007", lMsg.str().c_str());
+      }
+      theHasIOType = true;
+    }
+    else if (lStrKey == "trace-file")
+    {
+      theTraceFile = aOptions.getObjectValue(lStrKey).getStringValue().c_str();
+    }
+    else if (lStrKey == "slow-op-log")
+    {
+      theSlowLog = aOptions.getObjectValue(lStrKey).getStringValue().c_str();
+    }
+    else if (lStrKey == "slow-op-threshold-ms"
+             || lStrKey == "slow-op-max-per-second")
+    {
+      Item lValue = aOptions.getObjectValue(lStrKey);
+      unsigned int lNumber = 0;
+      try
+      {
+        lNumber = lValue.getUnsignedIntValue();
+      }
+      catch (ZorbaException& e)
+      {
+        std::ostringstream lMsg;
+        lMsg << " " << lStrKey << " option must be an integer value";
+        throwError("CB0009", lMsg.str().c_str());
+      }
+      if (lStrKey == "slow-op-threshold-ms")
+        theSlowThreshold = lNumber;
+      else
+        theSlowMaxPerSecond = lNumber;
+    }
+    else if (lStrKey == "retry-max-attempts"
+             || lStrKey == "retry-delay-ms"
+             || lStrKey == "retry-max-delay-ms")
+    {
+      Item lValue = aOptions.getObjectValue(lStrKey);
+      unsigned int lNumber = 0;
+      try
+      {
+        lNumber = lValue.getUnsignedIntValue();
+      }
+      catch (ZorbaException& e)
+      {
+        std::ostringstream lMsg;
+        lMsg << " " << lStrKey << " option must be an integer value";
+        throwError("CB0009", lMsg.str().c_str());
+      }
+      if (lStrKey == "retry-max-attempts")
+        theRetry.theMaxAttempts = lNumber;
+      else if (lStrKey == "retry-delay-ms")
+        theRetry.theBaseDelay = lNumber;
+      else
+        theRetry.theMaxDelay = lNumber;
+    }
+    else if (lStrKey == "memory-limit"
+             || lStrKey == "query-memory-limit")
+    {
+      Item lValue = aOptions.getObjectValue(lStrKey);
+      long long lBytes = -1;
+      try
+      {
+        lBytes = lValue.getLongValue();
+      }
+      catch (ZorbaException& e)
+      {
+      }
+      if (lBytes < 0)
+      {
+        std::ostringstream lMsg;
+        lMsg << " " << lStrKey << " option must be a non-negative integer value";
+        throwError("CB0009", lMsg.str().c_str());
+      }
+      if (lStrKey == "memory-limit")
+        theMemoryLimit = lBytes;
+      else
+        theQueryMemoryLimit = lBytes;
+    }
+    else if (lStrKey == "io-loop")
+    {
+      theIOLoop = aOptions.getObjectValue(lStrKey).getStringValue().c_str();
+    }
+    else if (lStrKey == "shard-name")
+    {
+      theShardName = aOptions.getObjectValue(lStrKey).getStringValue().c_str();
+    }
+    else if (lStrKey == "virtual-nodes")
+    {
+      Item lValue = aOptions.getObjectValue(lStrKey);
+      try
+      {
+        theVirtualNodes = lValue.getUnsignedIntValue();
+      }
+      catch (ZorbaException& e)
+      {
+        throwError("CB0009", " virtual-nodes option must be an integer value");
+      }
+    }
+    else if (lStrKey == "idle-timeout")
+    {
+      Item lValue = aOptions.getObjectValue(lStrKey);
+      try
+      {
+        theIdleTimeout = lValue.getUnsignedIntValue();
+      }
+      catch (ZorbaException& e)
+      {
+        throwError("CB0009", " idle-timeout option must be an integer value");
+      }
+    }
+    else if (lStrKey == "pool")
+    {
+      Item lValue = aOptions.getObjectValue(lStrKey);
+      try
+      {
+        theUsePool = lValue.getBooleanValue();
+      }
+      catch (ZorbaException& e)
+      {
+        throwError("CB0010", " pool option must be a boolean value");
+      }
+    }
+    else
+    {
+      std::ostringstream lMsg;
+      lMsg << lStrKey << ": option not supported";
+      throwError("CB0007", lMsg.str().c_str());
+    }
+  }
+  lKeys->close();
+
+  if (lHost.isNull())
+    throwError ("CB0001", "Missing declaration of the couchbase server host");
+  if (lHost.isJSONItem())
+  {
+    //libcouchbase tries the bootstrap hosts in the given order
+    int lSize = lHost.getArraySize()+1;
+    for (int i = 1; i < lSize; i++)
+    {
+      if (i > 1)
+        theHost.append(";");
+      theHost.append(lHost.getArrayValue(i).getStringValue());
+    }
+    if (theHost.empty())
+      throwError ("CB0001", "Missing declaration of the couchbase server host");
+  }
+  else
+  {
+    theHost = lHost.getStringValue();
+  }
+
+  if (lBucket.isNull())
+    throwError ("CB0001", "Missing declaration of the couchbase bucket");
+  theBucket = lBucket.getStringValue();
+}
+
+std::string
+ConnectFunction::ConnectOptions::getPoolKey() const
+{
+  if (!theUsePool || !theIOLoop.empty())
+    return "";
+
+  std::string lKey = InstancePool::getKey(theHost.c_str(), theBucket.c_str(), theUserName.c_str(), thePassword.c_str());
+  //instances with other timeouts are not interchangeable
+  std::ostringstream lTimeouts;
+  lTimeouts << '\0' << theOperationTimeout << '/' << theViewTimeout << '/' << theConnectTimeout;
+  if (theHasIOType)
+    lTimeouts << '/' << (int)theIOType;
+  lKey += lTimeouts.str();
+  return lKey;
+}
+
+InstanceMap*
+ConnectFunction::getInstanceMap(const DynamicContext* aDctx)
+{
+  DynamicContext* lDctx = const_cast<DynamicContext*>(aDctx);
+  
+  InstanceMap* lInstanceMap;
+  if (!(lInstanceMap = dynamic_cast<InstanceMap*>(lDctx->getExternalFunctionParameter("couchbaseInstanceMap"))))
+  {
+    lInstanceMap = new InstanceMap();
+    lDctx->addExternalFunctionParameter("couchbaseInstanceMap", lInstanceMap);
+  }
+  return lInstanceMap;
+}
+
+lcb_t
+ConnectFunction::acquireInstance(const ConnectOptions& aOptions)
+{
+  std::string lPoolKey = aOptions.getPoolKey();
+  if (lPoolKey.empty())
+    return NULL;
+
+  TraceFile_t lTrace = openTrace(aOptions);
+  SlowLog_t lSlowLog = openSlowLog(aOptions);
+  lcb_t lPooled = InstancePool::getInstance().acquire(lPoolKey);
+  if (lPooled)
+  {
+    InstanceData* lData = InstanceData::get(lPooled);
+    lData->theIsReleased = false;
+    ++lData->theReuses;
+    lData->theIdleTimeout = aOptions.theIdleTimeout;
+    lData->theLastUse = time(NULL);
+    lData->theStats.reset();
+    lData->theMemory.resetPeak();
+    lData->theMemory.setLimit(aOptions.theMemoryLimit);
+    lData->theRetry = aOptions.theRetry;
+    lData->theTrace = lTrace;
+    setSlowLog(lData, aOptions, lSlowLog);
+  }
+  return lPooled;
+}
+
+lcb_t
+ConnectFunction::createInstance(const ConnectOptions& aOptions, IOLoop_t aIO)
+{
+  TraceFile_t lTrace = openTrace(aOptions);
+  SlowLog_t lSlowLog = openSlowLog(aOptions);
+  bool lIsShared = aIO || !aOptions.theIOLoop.empty();
+  if (!aIO && !aOptions.theIOLoop.empty())
+    aIO = IOLoops::getInstance().getShared(aOptions.theIOLoop, aOptions.theIOType);
+  else if (!aIO && aOptions.theHasIOType)
+    aIO = IOLoops::create(aOptions.theIOType);
+  if ((lIsShared || aOptions.theHasIOType) && !aIO)
+    throwError("LCB0001", "Error creating the libcouchbase I/O loop");
+
+  struct lcb_create_st create_options;
+  memset(&create_options, 0, sizeof(create_options));
+  create_options.v.v0.host = aOptions.theHost.c_str();
+  create_options.v.v0.bucket = aOptions.theBucket.c_str();
+  if (!aOptions.theUserName.empty())
+    create_options.v.v0.user = aOptions.theUserName.c_str();
+  if (!aOptions.thePassword.empty())
+    create_options.v.v0.passwd = aOptions.thePassword.c_str();
+  create_options.v.v0.io = aIO.get();
+
+  lcb_t lInstance;
+  lcb_error_t lError;
+  
+  if (aOptions.theConfigCache.empty())
+  {
+    lError = lcb_create(&lInstance, &create_options);
+  }
+  else
+  {
+    //the cluster map is read from the file if present and written to it
+    //(and refreshed on topology changes) by libcouchbase otherwise
+    struct lcb_cached_config_st lCachedConfig;
+    memset(&lCachedConfig, 0, sizeof(lCachedConfig));
+    lCachedConfig.createopt = create_options;
+    lCachedConfig.cachefile = aOptions.theConfigCache.c_str();
+    lError = lcb_create_compat(LCB_CACHED_CONFIG, &lCachedConfig, &lInstance, aIO.get());
+  }
+  if (lError != LCB_SUCCESS)
+  {
+    throwError("LCB0001", "Error creating a libcouchbase Instance");
+  }
+
+  InstanceData* lData = new InstanceData(aOptions.theHost, aOptions.theBucket);
+  //instances sharing an I/O loop can't be handed out to other threads
+  if (!lIsShared)
+    lData->thePoolKey = aOptions.getPoolKey();
+  lData->theIO = aIO;
+  lData->theTrace = lTrace;
+  setSlowLog(lData, aOptions, lSlowLog);
+  lData->theIdleTimeout = aOptions.theIdleTimeout;
+  lData->theMemory.setLimit(aOptions.theMemoryLimit);
+  lData->theRetry = aOptions.theRetry;
+  lcb_set_cookie(lInstance, lData);
+  lcb_set_error_callback(lInstance, InstanceData::error_callback);
+  Operation::installCallbacks(lInstance);
+
+  //libcouchbase expects the timeouts in microseconds
+  if (aOptions.theOperationTimeout > 0)
+  {
+    lcb_uint32_t lValue = aOptions.theOperationTimeout * 1000;
+    lcb_cntl(lInstance, LCB_CNTL_SET, LCB_CNTL_OP_TIMEOUT, &lValue);
+  }
+  if (aOptions.theViewTimeout > 0)
+  {
+    lcb_uint32_t lValue = aOptions.theViewTimeout * 1000;
+    lcb_cntl(lInstance, LCB_CNTL_SET, LCB_CNTL_VIEW_TIMEOUT, &lValue);
+  }
+  if (aOptions.theConnectTimeout > 0)
+  {
+    lcb_uint32_t lValue = aOptions.theConnectTimeout * 1000;
+    lcb_cntl(lInstance, LCB_CNTL_SET, LCB_CNTL_CONFIGURATION_TIMEOUT, &lValue);
+  }
+
+  //Connect to couchbase
+  if ((lError = lcb_connect(lInstance)) != LCB_SUCCESS)
+  {
+    InstanceData::destroyInstance(lInstance);
+    throwError("LCB0001", "Error connecting to the couchbase server");
+  }
+  return lInstance;
+}
+
+TraceFile_t
+ConnectFunction::openTrace(const ConnectOptions& aOptions)
+{
+  if (aOptions.theTraceFile.empty())
+    return TraceFile_t();
+
+  TraceFile_t lTrace = TraceFile::get(aOptions.theTraceFile);
+  if (!lTrace)
+  {
+    std::ostringstream lMsg;
+    lMsg << aOptions.theTraceFile << ": trace file can't be opened";
+    throwError("CB0014", lMsg.str().c_str());
+  }
+  return lTrace;
+}
+
+SlowLog_t
+ConnectFunction::openSlowLog(const ConnectOptions& aOptions)
+{
+  if (aOptions.theSlowThreshold < 0)
+    return SlowLog_t();
+
+  SlowLog_t lLog = SlowLog::get(aOptions.theSlowLog);
+  if (!lLog)
+  {
+    std::ostringstream lMsg;
+    lMsg << aOptions.theSlowLog << ": slow operation log can't be opened";
+    throwError("CB0014", lMsg.str().c_str());
+  }
+  return lLog;
+}
+
+void
+ConnectFunction::setSlowLog(InstanceData* aData, const ConnectOptions& aOptions, const SlowLog_t& aLog)
+{
+  aData->theSlowLog = aLog;
+  aData->theSlowThreshold = aLog ? (uint64_t)aOptions.theSlowThreshold * 1000 : 0;
+  aData->theSlowMaxPerSecond = aOptions.theSlowMaxPerSecond;
+}
+
+bool
+ConnectFunction::isConnected(lcb_t aInstance)
+{
+  InstanceData::wait(aInstance);
+  return !InstanceData::get(aInstance)->theHasFailed;
+}
+
+void
+ConnectFunction::connectAll(const std::vector<ConnectOptions>& aOptions, bool aUsePool, std::vector<lcb_t>& aInstances)
+{
+  std::vector<lcb_t> lInstances(aOptions.size(), (lcb_t)NULL);
+  std::map<int, IOLoop_t> lLoops;
+  try
+  {
+    for (size_t i = 0; i < aOptions.size(); ++i)
+    {
+      if (aUsePool)
+      {
+        lInstances[i] = acquireInstance(aOptions[i]);
+        if (lInstances[i])
+          continue;
+      }
+
+      //the remaining buckets are bootstrapped together on one event loop
+      //per plugin, unless they name a shared loop themselves
+      IOLoop_t lIO;
+      if (aOptions[i].theIOLoop.empty())
+      {
+        IOLoop_t& lLoop = lLoops[(int)aOptions[i].theIOType];
+        if (!lLoop)
+          lLoop = IOLoops::create(aOptions[i].theIOType);
+        lIO = lLoop;
+      }
+      lInstances[i] = createInstance(aOptions[i], lIO);
+    }
+
+    //every wait also drives the bootstraps of all other instances of the loop
+    for (size_t i = 0; i < lInstances.size(); ++i)
+    {
+      if (!isConnected(lInstances[i]))
+        throwError("LCB0001", "Error connecting to the couchbase server");
+    }
+  }
+  catch (...)
+  {
+    for (size_t i = 0; i < lInstances.size(); ++i)
+    {
+      if (lInstances[i])
+        InstanceData::releaseInstance(lInstances[i]);
+    }
+    throw;
+  }
+  aInstances.swap(lInstances);
+}
+
+zorba::ItemSequence_t
+ConnectFunction::evaluate(
+  const Arguments_t& aArgs,
+  const zorba::StaticContext* aSctx,
+  const zorba::DynamicContext* aDctx) const
+{
+  InstanceMap* lInstanceMap = getInstanceMap(aDctx);
+
+  Item lOptionsItem = getOneItemArgument(aArgs, 0);
+  ConnectOptions lOptions;
+  lOptions.setOptions(lOptionsItem);
+
+  lcb_t lInstance = acquireInstance(lOptions);
+  if (!lInstance)
+  {
+    lInstance = createInstance(lOptions, IOLoop_t());
+    if (!isConnected(lInstance))
+    {
+      InstanceData::destroyInstance(lInstance);
+      throwError("LCB0001", "Error connecting to the couchbase server");
+    }
+  }
+  
+  return ItemSequence_t(new SingletonItemSequence(storeInstance(lInstanceMap, lInstance, lOptions)));
+}
+
+Item
+ConnectFunction::storeInstance(InstanceMap* aInstanceMap, lcb_t aInstance, const ConnectOptions& aOptions) const
+{
+  //the last connection that sets a query limit wins
+  if (aOptions.theQueryMemoryLimit > 0)
+    aInstanceMap->getMemory()->setLimit(aOptions.theQueryMemoryLimit);
+  InstanceData::get(aInstance)->theQueryMemory = aInstanceMap->getMemory();
+
+  uuid lUUID;
+  uuid::create(&lUUID);
+  
+  std::stringstream lStream;
+  lStream << lUUID;
+
+  String lStrUUID = lStream.str();
+
+  aInstanceMap->storeInstance(lStrUUID, aInstance);
+
+  return CouchbaseModule::getItemFactory()->createAnyURI(lStrUUID);
+}
+
+/*******************************************************************************
+ ******************************************************************************/
+
+zorba::ItemSequence_t
+ConnectAllFunction::evaluate(
+  const Arguments_t& aArgs,
+  const zorba::StaticContext* aSctx,
+  const zorba::DynamicContext* aDctx) const
+{
+  InstanceMap* lInstanceMap = getInstanceMap(aDctx);
+
+  std::vector<ConnectOptions> lOptions;
+  Iterator_t lArg = getIterArgument(aArgs, 0);
+  Item lItem;
+  lArg->open();
+  while (lArg->next(lItem))
+  {
+    lOptions.push_back(ConnectOptions());
+    lOptions.back().setOptions(lItem);
+  }
+  lArg->close();
+
+  std::vector<lcb_t> lInstances;
+  connectAll(lOptions, true, lInstances);
+
+  std::vector<Item> lResult;
+  for (size_t i = 0; i < lInstances.size(); ++i)
+    lResult.push_back(storeInstance(lInstanceMap, lInstances[i], lOptions[i]));
+
+  return ItemSequence_t(new VectorItemSequence(lResult));
+}
+
+/*******************************************************************************
+ ******************************************************************************/
+
+zorba::ItemSequence_t
+ConnectShardedFunction::evaluate(
+  const Arguments_t& aArgs,
+  const zorba::StaticContext* aSctx,
+  const zorba::DynamicContext* aDctx) const
+{
+  InstanceMap* lInstanceMap = getInstanceMap(aDctx);
+
+  Item lShards = getOneItemArgument(aArgs, 0);
+  std::vector<ConnectOptions> lOptions;
+  std::shared_ptr<ShardRing> lRing(new ShardRing());
+  int lSize = lShards.getArraySize() + 1;
+  for (int i = 1; i < lSize; ++i)
+  {
+    Item lShard = lShards.getArrayValue(i);
+    lOptions.push_back(ConnectOptions());
+    lOptions.back().setOptions(lShard);
+
+    std::string lName = lOptions.back().theShardName;
+    if (lName.empty())
+      lName = std::string(lOptions.back().theHost.c_str()) + "/" + lOptions.back().theBucket.c_str();
+    if (!lRing->addShard(lName, lOptions.back().theVirtualNodes))
+    {
+      std::ostringstream lMsg;
+      lMsg << lName << ": the shard name is used twice or the shard has no virtual nodes";
+      throwError("CB0007", lMsg.str().c_str());
+    }
+  }
+  if (lOptions.empty())
+    throwError("CB0001", "Missing declaration of the shards");
+
+  //the shards share one event loop, so their batches are sent concurrently
+  std::vector<lcb_t> lInstances;
+  connectAll(lOptions, false, lInstances);
+
+  std::vector<String> lIds;
+  for (size_t i = 0; i < lInstances.size(); ++i)
+    lIds.push_back(storeInstance(lInstanceMap, lInstances[i], lOptions[i]).getStringValue());
+
+  uuid lUUID;
+  uuid::create(&lUUID);
+  std::stringstream lStream;
+  lStream << lUUID;
+  String lStrUUID = lStream.str();
+  lInstanceMap->storeSharded(lStrUUID, lIds, lRing);
+
+  return ItemSequence_t(new SingletonItemSequence(CouchbaseModule::getItemFactory()->createAnyURI(lStrUUID)));
+}
+
+/*******************************************************************************
+ ******************************************************************************/
+
+void
+CouchbaseFunction::KeyBatch::send(const std::vector<size_t>& aCommands)
+{
+  size_t lBytes = 0;
+  for (size_t i = 0; i < aCommands.size(); ++i)
+    lBytes += theKeys[aCommands[i]].size();
+  theOperation.start(theInstance, lBytes, theKeys[aCommands[0]].c_str(), aCommands.size());
+
+  lcb_error_t lError;
+  if (theType == InstanceStats::OP_TOUCH)
+  {
+    std::vector<lcb_touch_cmd_t> lTouches(aCommands.size());
+    std::vector<const lcb_touch_cmd_t*> lCommands(aCommands.size());
+    for (size_t i = 0; i < aCommands.size(); ++i)
+    {
+      const std::string& lKey = theKeys[aCommands[i]];
+      memset(&lTouches[i], 0, sizeof(lcb_touch_cmd_t));
+      lTouches[i].v.v0.key = lKey.c_str();
+      lTouches[i].v.v0.nkey = lKey.size();
+      lTouches[i].v.v0.exptime = theExpTime;
+      lCommands[i] = &lTouches[i];
+    }
+    lError = lcb_touch(theInstance, &theOperation, aCommands.size(), &lCommands[0]);
+  }
+  else
+  {
+    std::vector<lcb_remove_cmd_t> lRemoves(aCommands.size());
+    std::vector<const lcb_remove_cmd_t*> lCommands(aCommands.size());
+    for (size_t i = 0; i < aCommands.size(); ++i)
+    {
+      const std::string& lKey = theKeys[aCommands[i]];
+      memset(&lRemoves[i], 0, sizeof(lcb_remove_cmd_t));
+      lRemoves[i].v.v0.key = lKey.c_str();
+      lRemoves[i].v.v0.nkey = lKey.size();
+      lCommands[i] = &lRemoves[i];
+    }
+    lError = lcb_remove(theInstance, &theOperation, aCommands.size(), &lCommands[0]);
+  }
+  if (lError != LCB_SUCCESS)
+  {
+    libCouchbaseError (theInstance, lError);
+  }
+}
+
+void
+CouchbaseFunction::KeyBatch::runKeys(const ShardSet& aShards, Iterator_t& aKeys, InstanceStats::op_type_t aType, unsigned int aExpTime)
+{
+  std::vector<std::unique_ptr<KeyBatch> > lBatches;
+  for (size_t i = 0; i < aShards.size(); ++i)
+    lBatches.push_back(std::unique_ptr<KeyBatch>(new KeyBatch(aShards.theInstances[i], aType, aExpTime)));
+
+  Item lKey;
+  aKeys->open();
+  while (aKeys->next(lKey))
+  {
+    TraceSpan lSpan(InstanceData::getTrace(aShards.theInstances[0]), InstanceStats::getName(aType), "function");
+    for (size_t i = 0; i < lBatches.size(); ++i)
+      lBatches[i]->clear();
+    size_t lCount = 0;
+    String lFirst = lKey.getStringValue();
+    do
+    {
+      String lStrKey = lKey.getStringValue();
+      lBatches[aShards.getShard(lStrKey)]->add(lStrKey);
+    } while (++lCount < BATCH_SIZE && aKeys->next(lKey));
+    lSpan.addArg("key", lFirst.c_str(), lFirst.size());
+    lSpan.addArg("batch", lCount);
+    runAll(lBatches);
+  }
+  aKeys->close();
+}
+
+/*******************************************************************************
+ ******************************************************************************/
+
+zorba::ItemSequence_t
+RemoveFunction::evaluate(
+  const Arguments_t& aArgs,
+  const zorba::StaticContext* aSctx,
+  const zorba::DynamicContext* aDctx) const
+{
+  String lInstanceID = getOneStringArgument(aArgs, 0);
+  ShardSet lShards = getShards(aDctx, lInstanceID);
+  Iterator_t lKeys = getIterArgument(aArgs, 1);
+
+  KeyBatch::runKeys(lShards, lKeys, InstanceStats::OP_REMOVE);
+
+  return ItemSequence_t(new EmptySequence());  
+}
+
+/*******************************************************************************
+ ******************************************************************************/
+
+zorba::ItemSequence_t
+DisconnectFunction::evaluate(
+  const Arguments_t& aArgs,
+  const zorba::StaticContext* aSctx,
+  const zorba::DynamicContext* aDctx) const
+{
+  String lInstanceID = getOneStringArgument(aArgs, 0);
+  InstanceMap* lInstanceMap =
+    dynamic_cast<InstanceMap*>(aDctx->getExternalFunctionParameter("couchbaseInstanceMap"));
+
+  if (!lInstanceMap || !lInstanceMap->deleteInstance(lInstanceID))
+    throwError("CB0000", "No instance of couchbase with the given identifier was found.");
+
+  return ItemSequence_t(new EmptySequence());
+}
+
+/*******************************************************************************
+ ******************************************************************************/
+
+static void
+addMember(std::vector<std::pair<Item, Item> >& aPairs, const char* aName, const Item& aValue)
+{
+  aPairs.push_back(std::make_pair(CouchbaseModule::getItemFactory()->createString(aName), aValue));
+}
+
+static Item
+createMemory(const MemoryAccount& aAccount)
+{
+  ItemFactory* lFactory = CouchbaseModule::getItemFactory();
+  std::vector<std::pair<Item, Item> > lMemory;
+  addMember(lMemory, "current", lFactory->createUnsignedLong(aAccount.getCurrent()));
+  addMember(lMemory, "peak", lFactory->createUnsignedLong(aAccount.getPeak()));
+  addMember(lMemory, "limit", lFactory->createUnsignedLong(aAccount.getLimit()));
+  return lFactory->createJSONObject(lMemory);
+}
+
+zorba::ItemSequence_t
+StatsFunction::evaluate(
+  const Arguments_t& aArgs,
+  const zorba::StaticContext* aSctx,
+  const zorba::DynamicContext* aDctx) const
+{
+  String lInstanceID = getOneStringArgument(aArgs, 0);
+  lcb_t lInstance = getInstance(aDctx, lInstanceID);
+  InstanceData* lData = InstanceData::get(lInstance);
+  const InstanceStats& lStats = lData->theStats;
+  ItemFactory* lFactory = CouchbaseModule::getItemFactory();
+
+  std::vector<std::pair<Item, Item> > lOperations;
+  for (int i = 0; i < InstanceStats::OP_COUNT; ++i)
+  {
+    InstanceStats::op_type_t lType = (InstanceStats::op_type_t) i;
+    const LatencyHistogram& lLatencies = lStats.getLatencies(lType);
+
+    std::vector<std::pair<Item, Item> > lLatency;
+    addMember(lLatency, "min", lFactory->createUnsignedLong(lLatencies.getMin()));
+    addMember(lLatency, "mean", lFactory->createUnsignedLong(lLatencies.getMean()));
+    addMember(lLatency, "p50", lFactory->createUnsignedLong(lLatencies.getPercentile(50)));
+    addMember(lLatency, "p90", lFactory->createUnsignedLong(lLatencies.getPercentile(90)));
+    addMember(lLatency, "p99", lFactory->createUnsignedLong(lLatencies.getPercentile(99)));
+    addMember(lLatency, "p99.9", lFactory->createUnsignedLong(lLatencies.getPercentile(99.9)));
+    addMember(lLatency, "max", lFactory->createUnsignedLong(lLatencies.getMax()));
+
+    std::vector<std::pair<Item, Item> > lOperation;
+    addMember(lOperation, "count", lFactory->createUnsignedLong(lStats.getOps(lType)));
+    addMember(lOperation, "latency-us", lFactory->createJSONObject(lLatency));
+    addMember(lOperations, InstanceStats::getName(lType), lFactory->createJSONObject(lOperation));
+  }
+
+  std::vector<std::pair<Item, Item> > lErrors;
+  const InstanceStats::ErrorMap_t& lErrorMap = lStats.getErrors();
+  for (InstanceStats::ErrorMap_t::const_iterator lIter = lErrorMap.begin();
+       lIter != lErrorMap.end(); ++lIter)
+  {
+    addMember(lErrors, lcb_strerror(lInstance, lIter->first), lFactory->createUnsignedLong(lIter->second));
+  }
+
+  std::vector<std::pair<Item, Item> > lResult;
+  addMember(lResult, "operations", lFactory->createJSONObject(lOperations));
+  addMember(lResult, "bytes-in", lFactory->createUnsignedLong(lStats.getBytesIn()));
+  addMember(lResult, "bytes-out", lFactory->createUnsignedLong(lStats.getBytesOut()));
+  addMember(lResult, "retries", lFactory->createUnsignedLong(lStats.getRetries()));
+  addMember(lResult, "reused", lFactory->createUnsignedLong(lData->theReuses));
+  addMember(lResult, "errors", lFactory->createJSONObject(lErrors));
+  addMember(lResult, "memory", createMemory(lData->theMemory));
+  if (lData->theQueryMemory)
+    addMember(lResult, "query-memory", createMemory(*lData->theQueryMemory));
+  return ItemSequence_t(new SingletonItemSequence(lFactory->createJSONObject(lResult)));
+}
+
+zorba::ItemSequence_t
+ResetStatsFunction::evaluate(
+  const Arguments_t& aArgs,
+  const zorba::StaticContext* aSctx,
+  const zorba::DynamicContext* aDctx) const
+{
+  String lInstanceID = getOneStringArgument(aArgs, 0);
+  lcb_t lInstance = getInstance(aDctx, lInstanceID);
+  InstanceData* lData = InstanceData::get(lInstance);
+  lData->theStats.reset();
+  lData->theMemory.resetPeak();
+  if (lData->theQueryMemory)
+    lData->theQueryMemory->resetPeak();
+  return ItemSequence_t(new EmptySequence());
+}
+
+/*******************************************************************************
+ ******************************************************************************/
+
+void
+CouchbaseFunction::GetItemSequence::get_callback(lcb_t instance, const void *cookie, lcb_error_t error, const lcb_get_resp_t *resp)
+{
+  GetBatch* lBatch = static_cast<GetBatch*>((NodeScheduler*)cookie);
+  size_t lCommand;
+  if (!lBatch->complete(resp->v.v0.key, resp->v.v0.nkey, lCommand))
+    return;
+  GetOptions* lRes = lBatch->theOptions;
+
+  try
+  {
+    if (error != LCB_SUCCESS)
+    {
+      libCouchbaseError (instance, error);
+    }
+
+    //the value is held twice while the item is built from it
+    MemoryCharge lCharge(instance);
+    if (!lCharge.grow(resp->v.v0.nbytes))
+    {
+      lRes->theIsOverLimit = true;
+      return;
+    }
+
+    std::chrono::steady_clock::time_point lStart = std::chrono::steady_clock::now();
+    createItem(*lRes, resp, InstanceData::getTrace(instance));
+    lBatch->theItems[lCommand] = lRes->theItem;
+    lRes->theItem = Item();
+
+    SlowLog::Entry lEntry("get", "decode");
+    lEntry.theKey = (const char*)resp->v.v0.key;
+    lEntry.theKeyLen = resp->v.v0.nkey;
+    lEntry.theValueSize = resp->v.v0.nbytes;
+    InstanceData::logSlow(instance, lEntry,
+      std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - lStart), true);
+  }
+  catch (...)
+  {
+    lRes->theItem = Item();
+    lBatch->fail(std::current_exception());
+  }
+}
+
+void
+CouchbaseFunction::GetItemSequence::GetBatch::send(const std::vector<size_t>& aCommands)
+{
+  std::vector<lcb_get_cmd_t> lGets(aCommands.size());
+  std::vector<const lcb_get_cmd_t*> lCommands(aCommands.size());
+  unsigned int lExpTime = theOptions->getExpTime();
+  size_t lBytes = 0;
+  for (size_t i = 0; i < aCommands.size(); ++i)
+  {
+    const std::string& lKey = theKeys[aCommands[i]];
+    lBytes += lKey.size();
+    memset(&lGets[i], 0, sizeof(lcb_get_cmd_t));
+    lGets[i].v.v0.key = lKey.c_str();
+    lGets[i].v.v0.nkey = lKey.size();
+    if (lExpTime > 0)
+    {
+      lGets[i].v.v0.exptime = lExpTime;
+    }
+    lCommands[i] = &lGets[i];
+  }
+
+  theOperation.start(theInstance, lBytes, theKeys[aCommands[0]].c_str(), aCommands.size());
+  lcb_error_t lError = lcb_get(theInstance, &theOperation, aCommands.size(), &lCommands[0]);
+  if (lError != LCB_SUCCESS)
+  {
+    libCouchbaseError (theInstance, lError);
+  }
+}
+
+void
+CouchbaseFunction::GetItemSequence::GetIterator::open()
+{
+  theKeys->open();
+}
+
+void
+CouchbaseFunction::GetItemSequence::GetIterator::close()
+{
+  theKeys->close();
+}
+
+void
+CouchbaseFunction::GetItemSequence::createItem(GetOptions& aOptions, const lcb_get_resp_t* aResp, const TraceFile_t& aTrace)
+{
+  lcb_storage_type_t lType = aOptions.getGetType();
+  if (lType == LCB_TEXT)
+  {
+    String lTmp;
+    String lEncoding = aOptions.getEncoding();
+    if (lEncoding != "" && transcode::is_necessary(lEncoding.c_str()))
+    {
+      TraceSpan lSpan(aTrace, "transcode", "phase");
+      lSpan.addArg("bytes", aResp->v.v0.nbytes);
+      decode((const char*)aResp->v.v0.bytes, aResp->v.v0.nbytes, lEncoding, lTmp);
+    }
+    else
+    {
+      lTmp = String((const char*)aResp->v.v0.bytes, aResp->v.v0.nbytes);
+    }
+    TraceSpan lSpan(aTrace, "item", "phase");
+    aOptions.theItem = CouchbaseModule::getItemFactory()->createString(lTmp);
+  }
+  else if (lType == LCB_BASE64)
+  {
+    TraceSpan lSpan(aTrace, "item", "phase");
+    aOptions.theItem = CouchbaseModule::getItemFactory()->createBase64Binary(reinterpret_cast<char const*>(aResp->v.v0.bytes), aResp->v.v0.nbytes, false);
+  }
+  else if (lType == LCB_JSON)
+  {
+    //only values in another encoding are copied
+    const char* lData = (const char*)aResp->v.v0.bytes;
+    size_t lLen = aResp->v.v0.nbytes;
+    String lTmp;
+    String lEncoding = aOptions.getEncoding();
+    if (lEncoding != "" && transcode::is_necessary(lEncoding.c_str()))
+    {
+      TraceSpan lSpan(aTrace, "transcode", "phase");
+      lSpan.addArg("bytes", lLen);
+      decode(lData, lLen, lEncoding, lTmp);
+      lData = lTmp.c_str();
+      lLen = lTmp.size();
+    }
+    TraceSpan lSpan(aTrace, "item", "phase");
+    if (!aOptions.getBuilder().build(lData, lLen, aOptions.theItem))
+      throwError("CB0017", "The stored value is not valid JSON");
+  }
+  else if (lType == LCB_XML)
+  {
+    TraceSpan lSpan(aTrace, "item", "phase");
+    if (aResp->v.v0.flags == XML_FLAGS)
+    {
+      aOptions.theItem = XmlCodec::decode((const char*)aResp->v.v0.bytes, aResp->v.v0.nbytes);
+      if (aOptions.theItem.isNull())
+        throwError("CB0016", "The stored value is not a valid XML node encoding");
+    }
+    else
+    {
+      //documents stored as text by other clients
+      std::istringstream lStream(std::string((const char*)aResp->v.v0.bytes, aResp->v.v0.nbytes));
+      aOptions.theItem = CouchbaseModule::getXmlDataManager()->parseXML(lStream);
+    }
+  }
+  else
+  {
+    throwError ("CB0004", "The requested collection has a not recognized type");
+  }
+}
+
+bool
+CouchbaseFunction::GetItemSequence::GetIterator::next(Item& aItem)
+{
+  if (theNext == theOrder.size())
+  {
+    Item lKey;
+    if (!theKeys->next(lKey))
+      return false;
+
+    theOptions.getDeadline().check();
+    for (size_t i = 0; i < theBatches.size(); ++i)
+      theBatches[i]->clear();
+    theOrder.clear();
+    theNext = 0;
+    do
+    {
+      String lStrKey = lKey.getStringValue();
+      size_t lShard = theShards.getShard(lStrKey);
+      theOrder.push_back(std::make_pair(lShard, theBatches[lShard]->add(lStrKey)));
+    } while (theOrder.size() < NodeScheduler::BATCH_SIZE && theKeys->next(lKey));
+    for (size_t i = 0; i < theBatches.size(); ++i)
+      theBatches[i]->theItems.assign(theBatches[i]->size(), Item());
+
+    const std::string& lFirst = theBatches[theOrder[0].first]->getKey(theOrder[0].second);
+    TraceSpan lSpan(InstanceData::getTrace(theShards.theInstances[0]), "get", "function");
+    lSpan.addArg("key", lFirst.data(), lFirst.size());
+    lSpan.addArg("batch", theOrder.size());
+    NodeScheduler::runAll(theBatches, theOptions.getDeadline());
+    if (theOptions.theIsOverLimit)
+    {
+      theOptions.theIsOverLimit = false;
+      memoryLimitError();
+    }
+  }
+
+  const std::pair<size_t, size_t>& lPosition = theOrder[theNext++];
+  Item& lItem = theBatches[lPosition.first]->theItems[lPosition.second];
+  aItem = lItem;
+  //the item isn't needed anymore once it is returned
+  lItem = Item();
+  return !aItem.isNull();
+}
+
+/*******************************************************************************
+ ******************************************************************************/
+
+zorba::ItemSequence_t
+GetTextFunction::evaluate(
+  const Arguments_t& aArgs,
+  const zorba::StaticContext* aSctx,
+  const zorba::DynamicContext* aDctx) const
+{
+  String lInstanceID = getOneStringArgument(aArgs, 0);
+  ShardSet lShards = getShards(aDctx, lInstanceID);
+  Iterator_t lKeys = getIterArgument(aArgs, 1);
+  GetOptions lOptions(LCB_TEXT);
+  if (aArgs.size() > 2)
+  {
+    Item lOptionsArg = getOneItemArgument(aArgs, 2);
+    lOptions.setOptions(lOptionsArg);
+  }
+ 
+  return ItemSequence_t(new GetItemSequence(lShards,lKeys, lOptions));   
+}
+
+/*******************************************************************************
+ ******************************************************************************/
+
+zorba::ItemSequence_t
+GetBinaryFunction::evaluate(
+  const Arguments_t& aArgs,
+  const zorba::StaticContext* aSctx,
+  const zorba::DynamicContext* aDctx) const
+{
+  String lInstanceID = getOneStringArgument(aArgs, 0);
+  ShardSet lShards = getShards(aDctx, lInstanceID);
+  Iterator_t lKeys = getIterArgument(aArgs, 1);
+  GetOptions lOptions(LCB_BASE64);
+  if (aArgs.size() > 2)
+  {
+    Item lOptionsArg = getOneItemArgument(aArgs, 2);
+    lOptions.setOptions(lOptionsArg);
+  }
+ 
+  return ItemSequence_t(new GetItemSequence(lShards,lKeys, lOptions));   
+}
+
+/*******************************************************************************
+ ******************************************************************************/
+
+zorba::ItemSequence_t
+GetJsonFunction::evaluate(
+  const Arguments_t& aArgs,
+  const zorba::StaticContext* aSctx,
+  const zorba::DynamicContext* aDctx) const
+{
+  String lInstanceID = getOneStringArgument(aArgs, 0);
+  ShardSet lShards = getShards(aDctx, lInstanceID);
+  Iterator_t lKeys = getIterArgument(aArgs, 1);
+  GetOptions lOptions(LCB_JSON);
+  if (aArgs.size() > 2)
+  {
+    Item lOptionsArg = getOneItemArgument(aArgs, 2);
+    lOptions.setOptions(lOptionsArg);
+  }
+
+  return ItemSequence_t(new GetItemSequence(lShards, lKeys, lOptions));
+}
+
+/*******************************************************************************
+ ******************************************************************************/
+
+zorba::ItemSequence_t
+GetXmlFunction::evaluate(
+  const Arguments_t& aArgs,
+  const zorba::StaticContext* aSctx,
+  const zorba::DynamicContext* aDctx) const
+{
+  String lInstanceID = getOneStringArgument(aArgs, 0);
+  ShardSet lShards = getShards(aDctx, lInstanceID);
+  Iterator_t lKeys = getIterArgument(aArgs, 1);
+  GetOptions lOptions(LCB_XML);
+  if (aArgs.size() > 2)
+  {
+    Item lOptionsArg = getOneItemArgument(aArgs, 2);
+    lOptions.setOptions(lOptionsArg);
+  }
+
+  return ItemSequence_t(new GetItemSequence(lShards, lKeys, lOptions));
+}
+
+/*******************************************************************************
+ ******************************************************************************/
+
+void CouchbaseFunction::observe_callback(lcb_t instance, const void *cookie, lcb_error_t error, const lcb_observe_resp_t *resp)
+{
+  if (error != LCB_SUCCESS)
+  {
+    libCouchbaseError (instance, error);
+  }
+  
+  PutOptions* lWait = (PutOptions*) cookie;
+  //verify is coming from the master
+  if (resp->v.v0.from_master > 0)
+  {
+    lcb_observe_t lStatus = resp->v.v0.status;if (lStatus == LCB_OBSERVE_NOT_FOUND)
+    {
+      throwError("CB0011", "Variable stored not found.");
+    }
+    //check for flag of persisntancy
+    lWait->setWaiting(lStatus & LCB_OBSERVE_PERSISTED?false:true);
+  }
+}
+
+void
+CouchbaseFunction::decode(const char* aData, size_t aLen, const String& aEncoding, String& aResult)
+{
+  aResult = String(aData, aLen);
+  if (aEncoding == "" || !transcode::is_necessary(aEncoding.c_str()))
+    return;
+
+  transcode::stream<std::istringstream> lTranscoder(aEncoding.c_str(), aResult.c_str());
+  aResult.clear();
+
+  char buf[1024];
+  while (lTranscoder.good())
+  {
+    lTranscoder.read(buf, 1024);
+    aResult.append(buf, lTranscoder.gcount());
+  }
+}
+
+void
+CouchbaseFunction::encode(const String& aValue, const String& aEncoding, String& aResult)
+{
+  if (aEncoding == "" || !transcode::is_necessary(aEncoding.c_str()))
+  {
+    aResult = aValue;
+    return;
+  }
+
+  std::stringstream lStream;
+  transcode::attach(lStream, aEncoding.c_str());
+  lStream << aValue.c_str();
+  aResult = lStream.str();
+}
+
+void CouchbaseFunction::put (const ShardSet& aShards, Iterator_t aKeys, Iterator_t aValues, PutOptions aOptions)
+{
+  Item lKey;
+  Item lValue;
+  lcb_storage_type_t lType = aOptions.getOperationType();
+  const TraceFile_t& lTrace = InstanceData::getTrace(aShards.theInstances[0]);
+  std::vector<std::unique_ptr<StoreBatch> > lBatches;
+  for (size_t i = 0; i < aShards.size(); ++i)
+  {
+    lBatches.push_back(std::unique_ptr<StoreBatch>(new StoreBatch(aShards.theInstances[i],
+      aOptions.getOperation(), lType, lType == LCB_XML ? XML_FLAGS : 0, aOptions.getExmpTime())));
+  }
+  //shard and command of each key of the current batches
+  std::vector<std::pair<size_t, size_t> > lOrder;
+
+  aKeys->open();
+  aValues->open();
+  while (aKeys->next(lKey))
+  {
+    TraceSpan lSpan(lTrace, "put", "function");
+    for (size_t i = 0; i < lBatches.size(); ++i)
+      lBatches[i]->clear();
+    lOrder.clear();
+    do
+    {
+      if (!aValues->next(lValue))
+        throwError("CB0005", "The number of key/value's on the save function is not the same.");
+
+      aOptions.getDeadline().check();
+      String lStrKey = lKey.getStringValue();
+      size_t lShard = aShards.getShard(lStrKey);
+      lcb_t lInstance = aShards.theInstances[lShard];
+
+      std::string lData;
+      std::chrono::steady_clock::time_point lStart = std::chrono::steady_clock::now();
+      bool lIsEncoded = false;
+      if (lType == LCB_TEXT)
+      {
+        String lEncoding = aOptions.getEncoding();
+        String lStrValue = lValue.getStringValue();
+        if (lEncoding != "" && transcode::is_necessary(lEncoding.c_str()))
+        {
+          {
+            TraceSpan lTranscode(lTrace, "transcode", "phase");
+            String lEncoded;
+            encode(lStrValue, lEncoding, lEncoded);
+            lStrValue = lEncoded;
+          }
+          lIsEncoded = true;
+        }
+        lData.assign(lStrValue.c_str(), lStrValue.size());
+      }
+      else if (lType == LCB_BASE64)
+      {
+        size_t lLen = 0;
+        const char* lBytes = lValue.getBase64BinaryValue(lLen);
+        lData.assign(lBytes, lLen);
+      }
+      else if (lType == LCB_XML)
+      {
+        {
+          TraceSpan lEncode(lTrace, "encode", "phase");
+          if (!XmlCodec::encode(lValue, lData))
+            throwError("CB0016", " Only document, element, text, comment and processing-instruction nodes can be stored");
+        }
+        lIsEncoded = true;
+      }
+      else
+      {
+        throwError ("CB0004", " Storing type not recognized");
+      }
+
+      if (lIsEncoded)
+      {
+        SlowLog::Entry lEntry("store", "encode");
+        lEntry.theKey = lStrKey.c_str();
+        lEntry.theKeyLen = lStrKey.size();
+        lEntry.theValueSize = lData.size();
+        InstanceData::logSlow(lInstance, lEntry,
+          std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - lStart), true);
+      }
+
+      if (!lBatches[lShard]->charge(lData.size()))
+        memoryLimitError();
+      lOrder.push_back(std::make_pair(lShard, lBatches[lShard]->add(lStrKey, lData)));
+    } while (lOrder.size() < NodeScheduler::BATCH_SIZE && aKeys->next(lKey));
+
+    const std::string& lFirst = lBatches[lOrder[0].first]->getKey(lOrder[0].second);
+    lSpan.addArg("key", lFirst.data(), lFirst.size());
+    lSpan.addArg("batch", lOrder.size());
+    aOptions.getDeadline().check();
+    NodeScheduler::runAll(lBatches, aOptions.getDeadline());
+
+    //Check if wait for disk
+    if (aOptions.getWaitType() == CB_WAIT_FALSE)
+      continue;
+    for (size_t i = 0; i < lOrder.size(); ++i)
+    {
+      lcb_t lInstance = aShards.theInstances[lOrder[i].first];
+      const StoreBatch& lBatch = *lBatches[lOrder[i].first];
+      const std::string& lStrKey = lBatch.getKey(lOrder[i].second);
+      std::chrono::steady_clock::time_point lStart = std::chrono::steady_clock::now();
+      {
+        TraceSpan lObserveWait(lTrace, "observe-wait", "phase");
+        PutOptions* lOptions = &aOptions;
+        Operation lOperation(lOptions);
+        lOperation.theObserveCallback = observe_callback;
+        do {
+          lOptions->getDeadline().check();
+          lcb_observe_cmd_t lObserve;
+          lObserve.version = 0;
+          lObserve.v.v0.key = lStrKey.c_str();
+          lObserve.v.v0.nkey = lStrKey.size();
+          lcb_observe_cmd_t* lCommands[1] = { &lObserve };
+          lOperation.start(lInstance, lStrKey.size(), lStrKey.c_str());
+          lcb_observe(lInstance, &lOperation, 1, lCommands);
+          InstanceData::wait(lInstance);
+        }while(lOptions->isWaiting());
+      }
+
+      //the whole durability wait, the single observe rounds are logged
+      //from their callbacks
+      SlowLog::Entry lEntry("store", "durability");
+      lEntry.theKey = lStrKey.c_str();
+      lEntry.theKeyLen = lStrKey.size();
+      lEntry.theValueSize = lBatch.getValue(lOrder[i].second).size();
+      InstanceData::logSlow(lInstance, lEntry,
+        std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - lStart), true);
+    }
+  }
+
+  if (aValues->next(lValue))
+    throwError("CB0005", "The number of key/value's on the save function is not the same.");
+
+  aKeys->close();
+  aValues->close();
+
+}
+
+size_t
+CouchbaseFunction::StoreBatch::add(const String& aKey, std::string& aValue)
+{
+  return add(aKey, aValue, theFlags);
+}
+
+size_t
+CouchbaseFunction::StoreBatch::add(const String& aKey, std::string& aValue, lcb_uint32_t aFlags)
+{
+  size_t lCommand = NodeScheduler::add(aKey);
+  theValues.push_back(std::string());
+  theValues.back().swap(aValue);
+  theCommandFlags.push_back(aFlags);
+  return lCommand;
+}
+
+void
+CouchbaseFunction::StoreBatch::send(const std::vector<size_t>& aCommands)
+{
+  std::vector<lcb_store_cmd_t> lStores(aCommands.size());
+  std::vector<const lcb_store_cmd_t*> lCommands(aCommands.size());
+  size_t lBytes = 0;
+  for (size_t i = 0; i < aCommands.size(); ++i)
+  {
+    const std::string& lKey = theKeys[aCommands[i]];
+    const std::string& lValue = theValues[aCommands[i]];
+    lBytes += lKey.size() + lValue.size();
+    memset(&lStores[i], 0, sizeof(lcb_store_cmd_t));
+    lStores[i].v.v0.key = lKey.c_str();
+    lStores[i].v.v0.nkey = lKey.size();
+    lStores[i].v.v0.bytes = lValue.data();
+    lStores[i].v.v0.nbytes = lValue.size();
+    lStores[i].v.v0.datatype = theDataType;
+    lStores[i].v.v0.flags = theCommandFlags[aCommands[i]];
+    lStores[i].v.v0.operation = theStorage;
+    if (theExpTime > 0)
+    {
+      lStores[i].v.v0.exptime = theExpTime;
+    }
+    lCommands[i] = &lStores[i];
+  }
+
+  theOperation.start(theInstance, lBytes, theKeys[aCommands[0]].c_str(), aCommands.size());
+  lcb_error_t lError = lcb_store(theInstance, &theOperation, aCommands.size(), &lCommands[0]);
+  if (lError != LCB_SUCCESS)
+  {
+    libCouchbaseError (theInstance, lError);
+  }
+}
+
+/*******************************************************************************
+ ******************************************************************************/
+
+zorba::ItemSequence_t
+PutTextFunction::evaluate(
+  const Arguments_t& aArgs,
+  const zorba::StaticContext* aSctx,
+  const zorba::DynamicContext* aDctx) const
+{
+  String lInstanceID = CouchbaseFunction::getOneStringArgument(aArgs, 0);
+  ShardSet lShards = getShards(aDctx, lInstanceID);
+  Iterator_t lKeys = getIterArgument(aArgs, 1);
+  Iterator_t lValues = getIterArgument(aArgs, 2);
+  
+  PutOptions lOptions(LCB_TEXT);
+  if (aArgs.size() > 3)
+  {
+    Item lOptionsArg = getOneItemArgument(aArgs, 3);
+    lOptions.setOptions(lOptionsArg);
+  }
+
+  put(lShards, lKeys, lValues, lOptions);
+  return ItemSequence_t(new EmptySequence());  
+}
+
+/*******************************************************************************
+ ******************************************************************************/
+
+zorba::ItemSequence_t
+PutBinaryFunction::evaluate(
+  const Arguments_t& aArgs,
+  const zorba::StaticContext* aSctx,
+  const zorba::DynamicContext* aDctx) const
+{
+  String lInstanceID = CouchbaseFunction::getOneStringArgument(aArgs, 0);
+  ShardSet lShards = getShards(aDctx, lInstanceID);
+  Iterator_t lKeys = getIterArgument(aArgs, 1);
+  Iterator_t lValues = getIterArgument(aArgs, 2);
+  
   PutOptions lOptions(LCB_BASE64);
   if (aArgs.size() > 3)
   {
-    Item lOptionsArg = getOneItemArgument(aArgs, 3);
-    lOptions.setOptions(lOptionsArg);
+    Item lOptionsArg = getOneItemArgument(aArgs, 3);
+    lOptions.setOptions(lOptionsArg);
+  }
+
+  put(lShards, lKeys, lValues, lOptions);
+  return ItemSequence_t(new EmptySequence());  
+}
+
+/*******************************************************************************
+ ******************************************************************************/
+
+zorba::ItemSequence_t
+PutXmlFunction::evaluate(
+  const Arguments_t& aArgs,
+  const zorba::StaticContext* aSctx,
+  const zorba::DynamicContext* aDctx) const
+{
+  String lInstanceID = getOneStringArgument(aArgs, 0);
+  ShardSet lShards = getShards(aDctx, lInstanceID);
+  Iterator_t lKeys = getIterArgument(aArgs, 1);
+  Iterator_t lValues = getIterArgument(aArgs, 2);
+
+  PutOptions lOptions(LCB_XML);
+  if (aArgs.size() > 3)
+  {
+    Item lOptionsArg = getOneItemArgument(aArgs, 3);
+    lOptions.setOptions(lOptionsArg);
+  }
+  //concatenated encodings are not a valid value
+  if (lOptions.getOperation() == LCB_APPEND || lOptions.getOperation() == LCB_PREPEND)
+    throwError("CB0007", " append and prepend are not supported for XML values");
+
+  put(lShards, lKeys, lValues, lOptions);
+  return ItemSequence_t(new EmptySequence());
+}
+
+/*******************************************************************************
+ ******************************************************************************/
+
+zorba::ItemSequence_t
+FlushFunction::evaluate(
+  const Arguments_t& aArgs,
+  const zorba::StaticContext* aSctx,
+  const zorba::DynamicContext* aDctx) const
+{
+  String lInstanceID = CouchbaseFunction::getOneStringArgument(aArgs, 0);
+  lcb_t lInstance = getInstance(aDctx, lInstanceID);
+  lcb_error_t lError;
+
+
+  lcb_flush_cmd_st lFlush;
+  lFlush.version=0;
+  lcb_flush_cmd_st* lCommand[] = {&lFlush};
+
+  lError =  lcb_flush(lInstance, NULL, 1, lCommand);
+  if (lError != LCB_SUCCESS)
+  {
+    std::stringstream lErrorMessage;
+    lErrorMessage << "Flush error : " <<  lcb_strerror(lInstance, lError);
+    throwError("LCB0003", lErrorMessage.str().c_str());
+  } 
+    
+  InstanceData::wait(lInstance);
+
+  return ItemSequence_t(new EmptySequence());  
+}
+
+/*******************************************************************************
+ ******************************************************************************/
+
+zorba::ItemSequence_t
+TouchFunction::evaluate(
+  const Arguments_t& aArgs,
+  const zorba::StaticContext* aSctx,
+  const zorba::DynamicContext* aDctx) const
+{
+  String lInstanceID = getOneStringArgument(aArgs, 0);
+  ShardSet lShards = getShards(aDctx, lInstanceID);
+  Iterator_t lKeys = getIterArgument(aArgs, 1);
+  Item lExp = getOneItemArgument(aArgs, 2);
+  unsigned int lInt;
+  try
+  {
+    lInt = lExp.getUnsignedIntValue();
+  }
+  catch (ZorbaException& e)
+  {
+    throwError("CB0009", " expiration-time option must be an integer value");
+  }
+  KeyBatch::runKeys(lShards, lKeys, InstanceStats::OP_TOUCH, lInt);
+
+  return ItemSequence_t(new EmptySequence());  
+}
+
+/*******************************************************************************
+ ******************************************************************************/
+
+void
+CopyFunction::CopyOptions::setOptions(Item& aOptions)
+{
+  if (!aOptions.isJSONItem())
+    isNotJSONError();
+
+  Iterator_t lIter = aOptions.getObjectKeys();
+  Item lItem;
+  lIter->open();
+  while (lIter->next(lItem))
+  {
+    String lStrKey = lItem.getStringValue();
+    std::transform(
+      lStrKey.begin(), lStrKey.end(),
+      lStrKey.begin(), tolower);
+    if (lStrKey == "operation")
+    {
+      Item lValue = aOptions.getObjectValue(lStrKey);
+      String lStrValue = lValue.getStringValue();
+      std::transform(
+        lStrValue.begin(), lStrValue.end(),
+        lStrValue.begin(), tolower);
+      if (lStrValue == "add")
+      {
+        theOperation = LCB_ADD;
+      }
+      else if (lStrValue == "replace")
+      {
+        theOperation = LCB_REPLACE;
+      }
+      else if (lStrValue == "set")
+      {
+        theOperation = LCB_SET;
+      }
+      else
+      {
+        std::ostringstream lMsg;
+        lMsg << lStrKey << "=" << lStrValue << " : option not supported";
+        throwError("CB0007", lMsg.str().c_str());
+      }
+    }
+    else if (lStrKey == "expiration-time")
+    {
+      Item lValue = aOptions.getObjectValue(lStrKey);
+      try
+      {
+        theExpTime = lValue.getUnsignedIntValue();
+      }
+      catch (ZorbaException& e)
+      {
+        throwError("CB0009", " expiration-time option must be an integer value");
+      }
+    }
+    else if (lStrKey == "deadline")
+    {
+      Item lValue = aOptions.getObjectValue(lStrKey);
+      try
+      {
+        theDeadline.set(lValue.getUnsignedIntValue());
+      }
+      catch (ZorbaException& e)
+      {
+        throwError("CB0009", " deadline option must be an integer value");
+      }
+    }
+    else
+    {
+      std::ostringstream lMsg;
+      lMsg << lStrKey << ": option not supported";
+      throwError("CB0007", lMsg.str().c_str());
+    }
+  }
+  lIter->close();
+}
+
+void
+CopyFunction::CopyBatch::get_callback(lcb_t instance, const void *cookie, lcb_error_t error, const lcb_get_resp_t *resp)
+{
+  CopyBatch* lBatch = static_cast<CopyBatch*>((NodeScheduler*)cookie);
+  size_t lCommand;
+  if (!lBatch->complete(resp->v.v0.key, resp->v.v0.nkey, lCommand))
+    return;
+  if (error == LCB_KEY_ENOENT || lBatch->theIsOverLimit)
+    return;
+
+  try
+  {
+    if (error != LCB_SUCCESS)
+    {
+      libCouchbaseError (instance, error);
+    }
+
+    if (!lBatch->theMemory.grow(resp->v.v0.nbytes))
+    {
+      lBatch->theIsOverLimit = true;
+      return;
+    }
+    //the bytes and flags are stored unchanged, the value never becomes an item
+    lBatch->theValues[lCommand].assign((const char*)resp->v.v0.bytes, resp->v.v0.nbytes);
+    lBatch->theFlags[lCommand] = resp->v.v0.flags;
+    lBatch->theFound[lCommand] = true;
+  }
+  catch (...)
+  {
+    lBatch->fail(std::current_exception());
   }
+}
 
-  put(lInstance, lKeys, lValues, lOptions);
-  return ItemSequence_t(new EmptySequence());  
+void
+CopyFunction::CopyBatch::send(const std::vector<size_t>& aCommands)
+{
+  std::vector<lcb_get_cmd_t> lGets(aCommands.size());
+  std::vector<const lcb_get_cmd_t*> lCommands(aCommands.size());
+  size_t lBytes = 0;
+  for (size_t i = 0; i < aCommands.size(); ++i)
+  {
+    const std::string& lKey = theKeys[aCommands[i]];
+    lBytes += lKey.size();
+    memset(&lGets[i], 0, sizeof(lcb_get_cmd_t));
+    lGets[i].v.v0.key = lKey.c_str();
+    lGets[i].v.v0.nkey = lKey.size();
+    lCommands[i] = &lGets[i];
+  }
+
+  theOperation.start(theInstance, lBytes, theKeys[aCommands[0]].c_str(), aCommands.size());
+  lcb_error_t lError = lcb_get(theInstance, &theOperation, aCommands.size(), &lCommands[0]);
+  if (lError != LCB_SUCCESS)
+  {
+    libCouchbaseError (theInstance, lError);
+  }
 }
 
-/*******************************************************************************
- ******************************************************************************/
+size_t
+CopyFunction::CopyBatch::add(const String& aKey)
+{
+  size_t lCommand = NodeScheduler::add(aKey);
+  theValues.push_back(std::string());
+  theFlags.push_back(0);
+  theFound.push_back(false);
+  return lCommand;
+}
 
-zorba::ItemSequence_t
-FlushFunction::evaluate(
-  const Arguments_t& aArgs,
-  const zorba::StaticContext* aSctx,
-  const zorba::DynamicContext* aDctx) const
+void
+CopyFunction::CopyBatch::clear()
 {
-  String lInstanceID = CouchbaseFunction::getOneStringArgument(aArgs, 0);
-  lcb_t lInstance = getInstance(aDctx, lInstanceID);
-  lcb_error_t lError;
+  NodeScheduler::clear();
+  theValues.clear();
+  theFlags.clear();
+  theFound.clear();
+  theMemory.clear();
+  theIsOverLimit = false;
+}
 
+CopyFunction::CopyStage::CopyStage(const ShardSet& aSource)
+  : theSource(aSource)
+{
+  for (size_t i = 0; i < theSource.size(); ++i)
+    theBatches.push_back(std::unique_ptr<CopyBatch>(new CopyBatch(theSource.theInstances[i])));
+}
 
-  lcb_flush_cmd_st lFlush;
-  lFlush.version=0;
-  lcb_flush_cmd_st* lCommand[] = {&lFlush};
+bool
+CopyFunction::CopyStage::start(Iterator_t& aKeys)
+{
+  Item lKey;
+  if (!aKeys->next(lKey))
+    return false;
 
-  lError =  lcb_flush(lInstance, NULL, 1, lCommand);
-  if (lError != LCB_SUCCESS)
+  do
   {
-    std::stringstream lErrorMessage;
-    lErrorMessage << "Flush error : " <<  lcb_strerror(lInstance, lError);
-    throwError("LCB0003", lErrorMessage.str().c_str());
-  } 
-    
-  lcb_wait(lInstance);
+    String lStrKey = lKey.getStringValue();
+    size_t lShard = theSource.getShard(lStrKey);
+    theOrder.push_back(std::make_pair(lShard, theBatches[lShard]->add(lStrKey)));
+  } while (theOrder.size() < NodeScheduler::BATCH_SIZE && aKeys->next(lKey));
 
-  return ItemSequence_t(new EmptySequence());  
+  for (size_t i = 0; i < theBatches.size(); ++i)
+    theBatches[i]->flushAll();
+  return true;
 }
 
-/*******************************************************************************
- ******************************************************************************/
+void
+CopyFunction::CopyStage::finish(const Deadline& aDeadline)
+{
+  NodeScheduler::runAll(theBatches, aDeadline);
+  for (size_t i = 0; i < theBatches.size(); ++i)
+  {
+    if (theBatches[i]->theIsOverLimit)
+      memoryLimitError();
+  }
+}
+
+void
+CopyFunction::CopyStage::cancel()
+{
+  for (size_t i = 0; i < theBatches.size(); ++i)
+    theBatches[i]->cancel();
+}
+
+void
+CopyFunction::CopyStage::clear()
+{
+  for (size_t i = 0; i < theBatches.size(); ++i)
+    theBatches[i]->clear();
+  theOrder.clear();
+}
 
 zorba::ItemSequence_t
-TouchFunction::evaluate(
+CopyFunction::evaluate(
   const Arguments_t& aArgs,
   const zorba::StaticContext* aSctx,
   const zorba::DynamicContext* aDctx) const
 {
-  String lInstanceID = getOneStringArgument(aArgs, 0);
-  lcb_t lInstance = getInstance(aDctx, lInstanceID);
-  Iterator_t lKeys = getIterArgument(aArgs, 1);
-  Item lExp = getOneItemArgument(aArgs, 2);
-  unsigned int lInt;
-  try
-  {
-    lInt = lExp.getUnsignedIntValue();
-  }
-  catch (ZorbaException& e)
+  ShardSet lSource = getShards(aDctx, getOneStringArgument(aArgs, 0));
+  ShardSet lDestination = getShards(aDctx, getOneStringArgument(aArgs, 1));
+  Iterator_t lKeys = getIterArgument(aArgs, 2);
+
+  CopyOptions lOptions;
+  if (aArgs.size() > 3)
   {
-    throwError("CB0009", " expiration-time option must be an integer value");
+    Item lOptionsArg = getOneItemArgument(aArgs, 3);
+    lOptions.setOptions(lOptionsArg);
   }
-  lcb_error_t lError;
-  Item lKey;
+
+  std::vector<std::unique_ptr<StoreBatch> > lStores;
+  for (size_t i = 0; i < lDestination.size(); ++i)
+    lStores.push_back(std::unique_ptr<StoreBatch>(new StoreBatch(
+      lDestination.theInstances[i], lOptions.getOperation(), 0, 0, lOptions.getExpTime())));
+
+  //two stages alternate: the gets of the next batch are sent before the
+  //stores of the current batch are waited for, so if the source and the
+  //destination share an event loop both run at the same time
+  CopyStage lFirst(lSource);
+  CopyStage lSecond(lSource);
+  CopyStage* lCurrent = &lFirst;
+  CopyStage* lNext = &lSecond;
+  unsigned long long lCopied = 0;
+  unsigned long long lMissing = 0;
+  unsigned long long lFailed = 0;
+
+  const TraceFile_t& lTrace = InstanceData::getTrace(lDestination.theInstances[0]);
   lKeys->open();
-  while (lKeys->next(lKey))
+  bool lHasKeys = lCurrent->start(lKeys);
+  //the gets of lCurrent are in flight at the top of the loop, the deadline
+  //is checked once they are waited for
+  while (lHasKeys)
   {
-    lcb_touch_cmd_t lCmd;
-    String lStrKey = lKey.getStringValue();
-    lCmd.v.v0.key = lStrKey.c_str();
-    lCmd.v.v0.nkey = lStrKey.size(); 
-    lCmd.v.v0.exptime = lInt;
-    lcb_touch_cmd_t *lCommand[1] = {&lCmd};
+    TraceSpan lSpan(lTrace, "copy", "function");
+    lSpan.addArg("batch", lCurrent->theOrder.size());
+    lCurrent->finish(lOptions.getDeadline());
 
-    lError = lcb_touch(lInstance, NULL, 1, lCommand);
-    if (lError != LCB_SUCCESS)
+    for (size_t i = 0; i < lStores.size(); ++i)
+      lStores[i]->clear();
+    for (size_t i = 0; i < lCurrent->theOrder.size(); ++i)
     {
-      libCouchbaseError (lInstance, lError);
-    } 
-    
-    lcb_wait(lInstance);
+      CopyBatch& lBatch = *lCurrent->theBatches[lCurrent->theOrder[i].first];
+      size_t lCommand = lCurrent->theOrder[i].second;
+      if (!lBatch.theFound[lCommand])
+      {
+        ++lMissing;
+        continue;
+      }
+      const std::string& lKey = lBatch.getKey(lCommand);
+      String lStrKey(lKey);
+      StoreBatch& lStore = *lStores[lDestination.getShard(lStrKey)];
+      if (!lStore.charge(lBatch.theValues[lCommand].size()))
+        memoryLimitError();
+      lStore.add(lStrKey, lBatch.theValues[lCommand], lBatch.theFlags[lCommand]);
+    }
+    lCurrent->clear();
+
+    lHasKeys = lNext->start(lKeys);
+    try
+    {
+      lOptions.getDeadline().check();
+      NodeScheduler::runAll(lStores, lOptions.getDeadline());
+      for (size_t i = 0; i < lStores.size(); ++i)
+      {
+        for (size_t j = 0; j < lStores[i]->size(); ++j)
+        {
+          lcb_error_t lError = lStores[i]->getResult(j);
+          if (lError == LCB_SUCCESS)
+            ++lCopied;
+          //the key exists ("add") or doesn't exist ("replace") in the destination
+          else if (lError == LCB_KEY_EEXISTS || lError == LCB_KEY_ENOENT)
+            ++lFailed;
+          else
+            libCouchbaseError (lDestination.theInstances[i], lError);
+        }
+      }
+    }
+    catch (...)
+    {
+      //the gets of the next batch point to the stage
+      lNext->cancel();
+      throw;
+    }
+    std::swap(lCurrent, lNext);
   }
   lKeys->close();
 
-  return ItemSequence_t(new EmptySequence());  
+  ItemFactory* lFactory = CouchbaseModule::getItemFactory();
+  std::vector<std::pair<Item, Item> > lResult;
+  addMember(lResult, "copied", lFactory->createUnsignedLong(lCopied));
+  addMember(lResult, "missing", lFactory->createUnsignedLong(lMissing));
+  addMember(lResult, "failed", lFactory->createUnsignedLong(lFailed));
+  return ItemSequence_t(new SingletonItemSequence(lFactory->createJSONObject(lResult)));
 }
 
 /*******************************************************************************
@@ -1069,45 +3236,65 @@ static void streamReleaser(std::istream* aStream)
   
 void CouchbaseFunction::ViewItemSequence::view_callback( lcb_http_request_t request, lcb_t instance, const void* cookie, lcb_error_t error, const lcb_http_resp_t* resp)
 {
+  ViewRequest* lRes = (ViewRequest*) cookie;
+
+  //nothing is raised inside libcouchbase, next() raises the error
   if (error != LCB_SUCCESS)
   {
-    libCouchbaseError (instance, error);
+    if (lRes->theError == LCB_SUCCESS)
+      lRes->theError = error;
+    return;
   }
 
-  ViewOptions* lRes = (ViewOptions*) cookie;
-
-  String lEncoding = lRes->getEncoding();
-  if (resp->v.v0.nbytes > 0)
+  if (resp->v.v0.nbytes > 0 && !lRes->theIsOverLimit)
   {
-    String lTmp = String((const char*)resp->v.v0.bytes, resp->v.v0.nbytes);
+    String lTmp;
+    decode((const char*)resp->v.v0.bytes, resp->v.v0.nbytes, lRes->theIterator->getOptions().getEncoding(), lTmp);
 
-    if (transcode::is_necessary(lEncoding.c_str()))
+    //the rest of the response is dropped, next() raises the error
+    if (!lRes->theMemory.grow(lTmp.size()))
     {
-      transcode::stream<std::istringstream> lTranscoder(lEncoding.c_str(), lTmp.c_str());
-      lTmp.clear();
+      lRes->theIsOverLimit = true;
+      lRes->theStream.reset();
+      return;
+    }
 
-      char buf[1024];
-      while (lTranscoder.good())
-      {
-        lTranscoder.read(buf, 1024);
-        lTmp.append(buf, lTranscoder.gcount());
-      }
+    if (lRes->theDocJoin)
+    {
+      lRes->theDocJoin->feed(lTmp.c_str(), lTmp.size());
+      return;
     }
-    
-    if(!lRes->theStream)
+
+    if (!lRes->theStream)
     {
-      lRes->theStream = new std::unique_ptr<std::stringstream>(new std::stringstream(""));
+      lRes->theStream.reset(new std::stringstream(""));
     }
 
-    *(lRes->theStream->get()) << lTmp.c_str();
-    
+    *lRes->theStream << lTmp.c_str();
   }
 }
 
+void CouchbaseFunction::ViewItemSequence::view_complete_callback( lcb_http_request_t request, lcb_t instance, const void* cookie, lcb_error_t error, const lcb_http_resp_t* resp)
+{
+  ViewRequest* lRes = (ViewRequest*) cookie;
+  if (error != LCB_SUCCESS && lRes->theError == LCB_SUCCESS)
+    lRes->theError = error;
+  lRes->theIterator->complete(lRes);
+}
+
+void
+CouchbaseFunction::ViewDocJoin::doc_callback(lcb_t instance, const void* cookie, lcb_error_t error, const lcb_get_resp_t* resp)
+{
+  ViewDocJoin* lJoin = (ViewDocJoin*) cookie;
+  lJoin->setDocument(resp, error);
+}
+
 void 
 CouchbaseFunction::ViewItemSequence::ViewIterator::open()
 {
-  lcb_set_http_data_callback(theInstance, ViewItemSequence::view_callback);
+  clearRequests();
+  theHasMorePaths = true;
+  theIsExpired = false;
   thePaths->open();
 }
 
@@ -1115,51 +3302,373 @@ void
 CouchbaseFunction::ViewItemSequence::ViewIterator::close()
 {
   thePaths->close();
+  clearRequests();
+}
+
+void
+CouchbaseFunction::ViewItemSequence::ViewIterator::clearRequests()
+{
+  for (std::vector<ViewRequest*>::iterator lIter = theRequests.begin();
+       lIter != theRequests.end(); ++lIter)
+  {
+    delete *lIter;
+  }
+  theRequests.clear();
+  theNext = 0;
+  theInFlight = 0;
+}
+
+void
+CouchbaseFunction::ViewItemSequence::ViewIterator::complete(ViewRequest* aRequest)
+{
+  if (aRequest->theIsDone)
+    return;
+  aRequest->theIsDone = true;
+  --theInFlight;
+}
+
+void
+CouchbaseFunction::ViewItemSequence::ViewIterator::launch()
+{
+  unsigned int lConcurrency = theOptions.getConcurrency();
+  Item lPath;
+  while (theHasMorePaths && (lConcurrency == 0 || theInFlight < lConcurrency))
+  {
+    //the requests started so far are still consumed, next() raises the error
+    if (theOptions.getDeadline().hasPassed())
+    {
+      theHasMorePaths = false;
+      theIsExpired = true;
+      break;
+    }
+    if (!thePaths->next(lPath))
+    {
+      theHasMorePaths = false;
+      break;
+    }
+
+    String lViewPath = lPath.getStringValue();
+    String lPathString = lViewPath;
+    String lPathOptions = theOptions.getPathOptions();
+    if (lPathOptions != "")
+    {
+      lPathString.append(lPathOptions);
+    }
+
+    ViewRequest* lRequest = new ViewRequest(this, theInstance, lPathString);
+    theRequests.push_back(lRequest);
+
+    if (theOptions.getCacheTTL() > 0)
+    {
+      InstanceData* lData = InstanceData::get(theInstance);
+      std::ostringstream lKey;
+      //stale=false results refresh the entry read by stale tolerant requests
+      lKey << lData->theHost << "/" << lData->theBucket << "/" << lViewPath
+           << theOptions.getPathOptions(false)
+           << "|" << theOptions.getEncoding() << (theOptions.includeDocs() ? "|docs" : "");
+      lRequest->theCacheKey = lKey.str();
+
+      std::string lValue;
+      if (theOptions.allowsStale() && ViewCache::getInstance().get(lRequest->theCacheKey, lValue))
+      {
+        lRequest->theIsOverLimit = !lRequest->theMemory.grow(lValue.size());
+        if (!lRequest->theIsOverLimit)
+          lRequest->theStream.reset(new std::stringstream(lValue));
+        lRequest->theIsCached = true;
+        lRequest->theIsDone = true;
+        continue;
+      }
+    }
+    if (theOptions.includeDocs())
+    {
+      lRequest->theDocJoin.reset(new ViewDocJoin(theInstance));
+    }
+
+    lcb_http_request_t lReq;
+    lcb_http_cmd_t lCmd;
+    lCmd.version = 0;
+    lCmd.v.v0.path = lRequest->thePath.c_str();
+    lCmd.v.v0.npath = lRequest->thePath.size();
+    lCmd.v.v0.body = NULL;
+    lCmd.v.v0.nbody = 0;
+    lCmd.v.v0.method = LCB_HTTP_METHOD_GET;
+    lCmd.v.v0.chunked = 1;
+    lCmd.v.v0.content_type = "application/json";
+    lRequest->theOperation.start(theInstance, lRequest->thePath.size(), lRequest->thePath);
+    lcb_error_t err = lcb_make_http_request(theInstance, &lRequest->theOperation, LCB_HTTP_TYPE_VIEW, &lCmd, &lReq);
+    if (err != LCB_SUCCESS)
+    {
+      lRequest->theIsDone = true;
+      //the requests of this round point to theRequests, which are deleted
+      //once the error closes the iterator
+      if (theInFlight > 0)
+        InstanceData::wait(theInstance);
+      libCouchbaseError (theInstance, err);
+    }
+    ++theInFlight;
+  }
 }
 
 bool
 CouchbaseFunction::ViewItemSequence::ViewIterator::next(Item& aItem)
 {
-  Item lPath;
-  if (thePaths->next(lPath))
+  while (true)
+  {
+    if (theNext == theRequests.size())
+    {
+      //all requests issued so far are consumed, start the next ones
+      launch();
+      if (theNext == theRequests.size())
+      {
+        if (theIsExpired)
+          theOptions.getDeadline().check();
+        return false;
+      }
+
+      //the callbacks only record the responses; once the requests of this
+      //round are consumed the next call starts the following paths
+      const TraceFile_t& lTrace = InstanceData::getTrace(theInstance);
+      {
+        TraceSpan lWait(lTrace, "lcb_wait", "phase");
+        InstanceData::wait(theInstance);
+      }
+      for (size_t i = theNext; i < theRequests.size(); ++i)
+      {
+        complete(theRequests[i]);
+      }
+      for (size_t i = theNext; i < theRequests.size(); ++i)
+      {
+        if (theRequests[i]->theError != LCB_SUCCESS)
+          libCouchbaseError (theInstance, theRequests[i]->theError);
+      }
+
+      //fetch the documents of the rows that did not fill a whole batch
+      bool lIsPending = true;
+      while (lIsPending)
+      {
+        lIsPending = false;
+        for (size_t i = theNext; i < theRequests.size(); ++i)
+        {
+          ViewDocJoin* lJoin = theRequests[i]->theDocJoin.get();
+          if (lJoin && lJoin->isPending())
+          {
+            lJoin->schedule(true);
+            lIsPending = true;
+          }
+        }
+        if (lIsPending)
+        {
+          TraceSpan lWait(lTrace, "doc-wait", "phase");
+          InstanceData::wait(theInstance);
+        }
+      }
+      for (size_t i = theNext; i < theRequests.size(); ++i)
+      {
+        ViewDocJoin* lJoin = theRequests[i]->theDocJoin.get();
+        if (lJoin && lJoin->getError() != LCB_SUCCESS)
+          libCouchbaseError (theInstance, lJoin->getError());
+      }
+    }
+
+    ViewRequest* lRequest = theRequests[theNext];
+    theRequests[theNext++] = NULL;
+    std::unique_ptr<ViewRequest> lGuard(lRequest);
+    if (lRequest->theIsOverLimit
+        || (lRequest->theDocJoin && lRequest->theDocJoin->isOverLimit()))
+      memoryLimitError();
+
+    std::stringstream* lStream = NULL;
+    if (lRequest->theDocJoin)
+      lStream = lRequest->theDocJoin->createStream();
+    else
+      lStream = lRequest->theStream.release();
+
+    //paths with an empty response are skipped
+    if (lStream)
+    {
+      if (!lRequest->theCacheKey.empty() && !lRequest->theIsCached)
+        ViewCache::getInstance().put(lRequest->theCacheKey, lStream->str(), theOptions.getCacheTTL());
+
+      TraceSpan lSpan(InstanceData::getTrace(theInstance), "item", "phase");
+      aItem = CouchbaseModule::getItemFactory()->createStreamableString(*lStream, &streamReleaser);
+      return true;
+    }
+  }
+}
+
+/*******************************************************************************
+ ******************************************************************************/
+
+const size_t CouchbaseFunction::ViewDocJoin::BATCH_SIZE;
+const size_t CouchbaseFunction::ViewDocJoin::MAX_IN_FLIGHT;
+
+void
+CouchbaseFunction::ViewDocJoin::feed(const char* aData, size_t aLen)
+{
+  size_t lFirst = theRows.size();
+  theScanner.feed(aData, aLen, theRows);
+  for (size_t i = lFirst; i < theRows.size(); ++i)
+  {
+    if (!theRows[i].theHasId)
+    {
+      theRowDocs.push_back(std::string::npos);
+      continue;
+    }
+    std::pair<std::map<std::string, size_t>::iterator, bool> lRes =
+      theDocIndex.insert(std::make_pair(theRows[i].theId, theIds.size()));
+    if (lRes.second)
+    {
+      theIds.push_back(theRows[i].theId);
+      theDocs.push_back("");
+      theFound.push_back(false);
+      theSendTimes.push_back(std::chrono::steady_clock::time_point());
+      theSendBatches.push_back(0);
+    }
+    theRowDocs.push_back(lRes.first->second);
+  }
+  schedule(false);
+}
+
+void
+CouchbaseFunction::ViewDocJoin::schedule(bool aFlush)
+{
+  if (theError != LCB_SUCCESS)
+    return;
+
+  //the keys to retry are still counted as in flight
+  std::vector<std::string> lRetryKeys;
+  if (aFlush && theOperation.retry(theInstance, &lRetryKeys))
+  {
+    if (!fetch(lRetryKeys, 0, lRetryKeys.size()))
+      theInFlight -= lRetryKeys.size();
+  }
+
+  while (theError == LCB_SUCCESS && theNextFetch < theIds.size() && theInFlight < MAX_IN_FLIGHT)
+  {
+    size_t lCount = theIds.size() - theNextFetch;
+    if (lCount > BATCH_SIZE)
+      lCount = BATCH_SIZE;
+    if (lCount > MAX_IN_FLIGHT - theInFlight)
+      lCount = MAX_IN_FLIGHT - theInFlight;
+    if (lCount < BATCH_SIZE && !aFlush)
+      break;
+
+    if (!fetch(theIds, theNextFetch, lCount))
+      break;
+    theNextFetch += lCount;
+    theInFlight += lCount;
+  }
+}
+
+bool
+CouchbaseFunction::ViewDocJoin::fetch(const std::vector<std::string>& aIds, size_t aFirst, size_t aCount)
+{
+  std::vector<lcb_get_cmd_t> lGets(aCount);
+  std::vector<const lcb_get_cmd_t*> lCommands(aCount);
+  size_t lBytes = 0;
+  std::chrono::steady_clock::time_point lNow = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < aCount; ++i)
+  {
+    const std::string& lId = aIds[aFirst + i];
+    lBytes += lId.size();
+    memset(&lGets[i], 0, sizeof(lcb_get_cmd_t));
+    lGets[i].v.v0.key = lId.c_str();
+    lGets[i].v.v0.nkey = lId.size();
+    lCommands[i] = &lGets[i];
+
+    std::map<std::string, size_t>::const_iterator lIter = theDocIndex.find(lId);
+    if (lIter != theDocIndex.end())
+    {
+      theSendTimes[lIter->second] = lNow;
+      theSendBatches[lIter->second] = aCount;
+    }
+  }
+
+  theOperation.start(theInstance, lBytes, aIds[aFirst].c_str(), aCount);
+  lcb_error_t lError = lcb_get(theInstance, &theOperation, aCount, &lCommands[0]);
+  if (lError != LCB_SUCCESS)
+  {
+    theError = lError;
+    return false;
+  }
+  return true;
+}
+
+bool
+CouchbaseFunction::ViewDocJoin::getSent(
+  const void* aKey,
+  size_t aKeyLen,
+  std::chrono::steady_clock::time_point& aTime,
+  size_t& aBatch,
+  size_t& aBytesOut) const
+{
+  std::map<std::string, size_t>::const_iterator lIter =
+    theDocIndex.find(std::string((const char*)aKey, aKeyLen));
+  if (lIter == theDocIndex.end() || theSendBatches[lIter->second] == 0)
+    return false;
+  aTime = theSendTimes[lIter->second];
+  aBatch = theSendBatches[lIter->second];
+  aBytesOut = aKeyLen;
+  return true;
+}
+
+void
+CouchbaseFunction::ViewDocJoin::setDocument(const lcb_get_resp_t* aResp, lcb_error_t aError)
+{
+  --theInFlight;
+  std::string lId((const char*)aResp->v.v0.key, aResp->v.v0.nkey);
+  std::map<std::string, size_t>::const_iterator lIter = theDocIndex.find(lId);
+  if (lIter != theDocIndex.end())
   {
-    ViewOptions* lOptions = &theOptions;
-    String lPathOptions = lOptions->getPathOptions();
-    String lPathString = lPath.getStringValue();    
-    if (lPathOptions != "")
+    if (aError == LCB_SUCCESS)
     {
-      lPathString.append(lPathOptions);
-    }    
-    lcb_http_request_t lReq;
-    lcb_http_cmd_t lCmd;
-    lCmd.version = 0;
-    lCmd.v.v0.path = lPathString.c_str();
-    lCmd.v.v0.npath = lPathString.size();
-    lCmd.v.v0.body = NULL;
-    lCmd.v.v0.nbody = 0;
-    lCmd.v.v0.method = LCB_HTTP_METHOD_GET;
-    lCmd.v.v0.chunked = 1;
-    lCmd.v.v0.content_type = "application/json";
-    lcb_error_t err = lcb_make_http_request(theInstance, lOptions, LCB_HTTP_TYPE_VIEW, &lCmd, &lReq);
-    if (err != LCB_SUCCESS)
+      if (!theIsOverLimit && theMemory.grow(aResp->v.v0.nbytes))
+      {
+        theDocs[lIter->second].assign((const char*)aResp->v.v0.bytes, aResp->v.v0.nbytes);
+        theFound[lIter->second] = true;
+      }
+      else
+      {
+        theIsOverLimit = true;
+      }
+    }
+    //documents deleted after indexing are reported as null
+    else if (aError != LCB_KEY_ENOENT && theError == LCB_SUCCESS)
     {
-      libCouchbaseError (theInstance, err);
+      theError = aError;
     }
-
-    lcb_wait(theInstance);
-
-    if (lOptions->theStream)
-      aItem = CouchbaseModule::getItemFactory()->createStreamableString(*lOptions->theStream->release(), &streamReleaser);
-
-    if (aItem.isNull())
-      return false;
-
-    return true;
   }
-  else
+  schedule(false);
+}
+
+std::stringstream*
+CouchbaseFunction::ViewDocJoin::createStream() const
+{
+  const std::string& lBuffer = theScanner.getBuffer();
+  std::string lRes;
+  size_t lPos = 0;
+  for (size_t i = 0; i < theRows.size(); ++i)
   {
-    return false;
+    size_t lDoc = theRowDocs[i];
+    if (lDoc == std::string::npos)
+      continue;
+    lRes.append(lBuffer, lPos, theRows[i].theEnd - lPos);
+    lPos = theRows[i].theEnd;
+    lRes += ",\"doc\":";
+    const std::string& lData = theDocs[lDoc];
+    JSONValue lScalar;
+    if (!theFound[lDoc])
+      lRes += "null";
+    //objects and arrays are only checked for balanced brackets, scalars
+    //(numbers, booleans, null, strings) are parsed
+    else if (JSONUtils::isContainer(lData.data(), lData.size())
+             || lScalar.parse(lData.data(), lData.size()))
+      lRes += lData;
+    else
+      JSONUtils::appendString(lRes, lData.data(), lData.size());
   }
+  lRes.append(lBuffer, lPos, std::string::npos);
+  return new std::stringstream(lRes);
 }
 
 /*******************************************************************************
@@ -1172,7 +3681,7 @@ ViewFunction::evaluate(
   const zorba::DynamicContext* aDctx) const
 {
   String lInstanceID = getOneStringArgument(aArgs, 0);
-  lcb_t lInstance = getInstance(aDctx, lInstanceID);
+  ShardSet lShards = getShards(aDctx, lInstanceID);
 
   Iterator_t lPaths = getIterArgument(aArgs, 1);
   ViewOptions lOptions;
@@ -1183,7 +3692,70 @@ ViewFunction::evaluate(
     lOptions.setOptions(lOptionsArg);
   }
 
-  return ItemSequence_t(new ViewItemSequence(lInstance, lPaths, lOptions));  
+  if (!lShards.theRing)
+    return ItemSequence_t(new ViewItemSequence(lShards.theInstances[0], lPaths, lOptions));  
+
+  //every shard answers the views for its own documents, the results are
+  //returned shard by shard
+  std::vector<Item> lPathItems;
+  Item lPath;
+  lPaths->open();
+  while (lPaths->next(lPath))
+    lPathItems.push_back(lPath);
+  lPaths->close();
+
+  ConcatItemSequence* lResult = new ConcatItemSequence();
+  ItemSequence_t lSequence(lResult);
+  for (size_t i = 0; i < lShards.size(); ++i)
+  {
+    ItemSequence_t lInput(new VectorItemSequence(lPathItems));
+    Iterator_t lShardPaths = lInput->getIterator();
+    lResult->theInputs.push_back(lInput);
+    lResult->theSequences.push_back(ItemSequence_t(new ViewItemSequence(lShards.theInstances[i], lShardPaths, lOptions)));
+  }
+  return lSequence;
+}
+
+/*******************************************************************************
+ ******************************************************************************/
+
+void
+ConcatItemSequence::ConcatIterator::open()
+{
+  theCurrent = 0;
+  theIsOpen = true;
+  if (theSequences.empty())
+    return;
+  theIterator = theSequences[0]->getIterator();
+  theIterator->open();
+}
+
+bool
+ConcatItemSequence::ConcatIterator::next(Item& aItem)
+{
+  if (theIterator.isNull())
+    return false;
+  while (!theIterator->next(aItem))
+  {
+    theIterator->close();
+    if (++theCurrent == theSequences.size())
+    {
+      theIterator = Iterator_t();
+      return false;
+    }
+    theIterator = theSequences[theCurrent]->getIterator();
+    theIterator->open();
+  }
+  return true;
+}
+
+void
+ConcatItemSequence::ConcatIterator::close()
+{
+  if (!theIterator.isNull() && theIterator->isOpen())
+    theIterator->close();
+  theIterator = Iterator_t();
+  theIsOpen = false;
 }
 
 /*******************************************************************************
@@ -1216,32 +3788,39 @@ DeleteViewFunction::evaluate(
   const zorba::DynamicContext* aDctx) const
 {
   String lInstanceID = getOneStringArgument(aArgs, 0);
-  lcb_t lInstance = getInstance(aDctx, lInstanceID);
+  ShardSet lShards = getShards(aDctx, lInstanceID);
 
   Iterator_t lDocNames = getIterArgument(aArgs, 1);
   Item lDoc;  
+  Operation lOperation(NULL);
+  lOperation.theHttpCompleteCallback = DeleteViewFunction::delete_view_callback;
   lDocNames->open();
   while(lDocNames->next(lDoc))
   {
-    lcb_set_http_complete_callback(lInstance, DeleteViewFunction::delete_view_callback);
     String lPath = "_design/" + lDoc.getStringValue();
-    lcb_http_request_t req;
-    lcb_http_cmd_t cmd;
-    cmd.version = 0;
-    cmd.v.v0.path = lPath.c_str();
-    cmd.v.v0.npath = lPath.size();
-    cmd.v.v0.body = NULL;
-    cmd.v.v0.nbody = 0;
-    cmd.v.v0.method = LCB_HTTP_METHOD_DELETE;
-    cmd.v.v0.chunked = 0;
-    cmd.v.v0.content_type = "application/json";
-    lcb_error_t err = lcb_make_http_request(lInstance, NULL,
-                           LCB_HTTP_TYPE_VIEW, &cmd, &req);
-
-    if (err != LCB_SUCCESS)
-      libCouchbaseError (lInstance, err);
-
-    lcb_wait(lInstance);
+    //every shard has its own copy of the design document
+    for (size_t i = 0; i < lShards.size(); ++i)
+    {
+      lcb_t lInstance = lShards.theInstances[i];
+      lcb_http_request_t req;
+      lcb_http_cmd_t cmd;
+      cmd.version = 0;
+      cmd.v.v0.path = lPath.c_str();
+      cmd.v.v0.npath = lPath.size();
+      cmd.v.v0.body = NULL;
+      cmd.v.v0.nbody = 0;
+      cmd.v.v0.method = LCB_HTTP_METHOD_DELETE;
+      cmd.v.v0.chunked = 0;
+      cmd.v.v0.content_type = "application/json";
+      lOperation.start(lInstance, lPath.size(), lPath);
+      lcb_error_t err = lcb_make_http_request(lInstance, &lOperation,
+                             LCB_HTTP_TYPE_VIEW, &cmd, &req);
+
+      if (err != LCB_SUCCESS)
+        libCouchbaseError (lInstance, err);
+
+      InstanceData::wait(lInstance);
+    }
   }
   lDocNames->close();
 
@@ -1271,41 +3850,32 @@ void CreateViewFunction::create_view_callback(lcb_http_request_t request, lcb_t
     }    
 }
 
-zorba::ItemSequence_t
-CreateViewFunction::evaluate(
-  const Arguments_t& aArgs,
-  const zorba::StaticContext* aSctx,
-  const zorba::DynamicContext* aDctx) const
+String
+CreateViewFunction::buildDesignDocument(
+  const String& aDocName,
+  Iterator_t aViewNames,
+  Iterator_t aOptions,
+  std::vector<Item>& aPaths)
 {
-  String lInstanceID = getOneStringArgument(aArgs, 0);
-  lcb_t lInstance = getInstance(aDctx, lInstanceID);
-
-  String lDocName = getOneStringArgument(aArgs, 1);
-  String lPath = "_design/" + lDocName;
-
   String lBody = "{\"views\": {";
-  Iterator_t lViewNames = getIterArgument(aArgs, 2);
   Item lView;
 
-  std::vector<Item> lResult;
-
-  Iterator_t lOptions;
-  if (aArgs.size() > 3)
+  if (!aOptions.isNull())
   {
-    lOptions = getIterArgument(aArgs, 3);
     Item lOption;
-    lOptions->open();
-    lViewNames->open();
+    aOptions->open();
+    aViewNames->open();
     bool lIsFirstView = true;
-    while (lViewNames->next(lView))
+    while (aViewNames->next(lView))
     {
-      if (!lOptions->next(lOption))
+      if (!aOptions->next(lOption))
         throwError("CB0005", "The number of options is not the same as the number of views.");
 
       //variables used to form the body
       String lBodyKey;
       String lBodyValues;
       String lBodyFunction;
+      String lBodyReduce;
 
       String lViewName = lView.getStringValue();
       if (lOption.isJSONItem())
@@ -1329,9 +3899,6 @@ CreateViewFunction::evaluate(
               throwError("CB0010", lMsg.str().c_str());
             }
             String lStrValue = lValue.getStringValue();
-            std::transform(
-              lStrValue.begin(), lStrValue.end(),
-              lStrValue.begin(), tolower);
             lBodyKey = lStrValue;
           }
           else if (lStrKey == "values")
@@ -1346,9 +3913,6 @@ CreateViewFunction::evaluate(
               {
                 Item lArrValue = lValue.getArrayValue(i);
                 String lStrArrValue = lArrValue.getStringValue();
-                std::transform(
-                  lStrArrValue.begin(), lStrArrValue.end(),
-                  lStrArrValue.begin(), tolower);
 
                 if (lIsFirstView)
                   lIsFirstView = false;
@@ -1362,9 +3926,6 @@ CreateViewFunction::evaluate(
             else
             {
               String lStrValue = lValue.getStringValue();
-              std::transform(
-                lStrValue.begin(), lStrValue.end(),
-                lStrValue.begin(), tolower);
               lBodyValues = lStrValue;
             }
           }
@@ -1378,11 +3939,19 @@ CreateViewFunction::evaluate(
               throwError("CB0010", lMsg.str().c_str());
             }
             String lStrValue = lValue.getStringValue();
-            std::transform(
-              lStrValue.begin(), lStrValue.end(),
-              lStrValue.begin(), tolower);
             lBodyFunction = lStrValue;
           }
+          else if (lStrKey == "reduce")
+          {
+            Item lValue = lOption.getObjectValue(lStrKey);
+            if (lValue.isJSONItem())
+            {
+              std::ostringstream lMsg;
+              lMsg << lStrKey << ": value must be of type string.";
+              throwError("CB0010", lMsg.str().c_str());
+            }
+            lBodyReduce = lValue.getStringValue();
+          }
           else
           {
             std::ostringstream lMsg;
@@ -1404,60 +3973,411 @@ CreateViewFunction::evaluate(
           lBodyValues = "null";
         lBodyFunction = "function(doc, meta) { emit("+lBodyKey+", "+lBodyValues+");}";
       }
-      lBody += "\"" + lViewName + "\": {\"map\": \""+lBodyFunction+"\"}";
+      std::string lView;
+      JSONUtils::appendString(lView, lViewName.c_str(), lViewName.size());
+      lView += ": {\"map\": ";
+      JSONUtils::appendString(lView, lBodyFunction.c_str(), lBodyFunction.size());
+      if (lBodyReduce.size() > 0)
+      {
+        lView += ", \"reduce\": ";
+        JSONUtils::appendString(lView, lBodyReduce.c_str(), lBodyReduce.size());
+      }
+      lView += "}";
+      lBody += lView;
 
-      String lStrRes = "_design/" + lDocName + "/_view/" + lViewName;
+      String lStrRes = "_design/" + aDocName + "/_view/" + lViewName;
       Item lRes = CouchbaseModule::getItemFactory()->createString(lStrRes);
-      lResult.push_back(lRes);
+      aPaths.push_back(lRes);
 
     }
-    if (lOptions->next(lOption))
+    if (aOptions->next(lOption))
       throwError("CB0005", "The number of options is not the same as the number of views.");
-    lViewNames->close();
-    lOptions->close();
+    aViewNames->close();
+    aOptions->close();
     lBody += "}}";
   }
   else
   {
     bool lIsFirstView = true;
-    lViewNames->open();
-    while (lViewNames->next(lView))
+    aViewNames->open();
+    while (aViewNames->next(lView))
     {
       if (lIsFirstView)
         lIsFirstView = false;
       else
         lBody += " , ";
       String lViewName = lView.getStringValue();
-      lBody += "\"" + lViewName + "\": {\"map\": \"function(doc, meta) { emit(meta.id, null);}\"}";
+      std::string lName;
+      JSONUtils::appendString(lName, lViewName.c_str(), lViewName.size());
+      lBody += lName;
+      lBody += ": {\"map\": \"function(doc, meta) { emit(meta.id, null);}\"}";
 
-      String lStrRes = "_design/" + lDocName + "/_view/" + lViewName;
+      String lStrRes = "_design/" + aDocName + "/_view/" + lViewName;
       Item lRes = CouchbaseModule::getItemFactory()->createString(lStrRes);
-      lResult.push_back(lRes);
+      aPaths.push_back(lRes);
 
     }
-    lViewNames->close();
+    aViewNames->close();
     lBody += "}}";
   }
-  lcb_set_http_complete_callback(lInstance, CreateViewFunction::create_view_callback);
+  return lBody;
+}
+
+bool
+CreateViewFunction::createViews(
+  const Arguments_t& aArgs,
+  const zorba::DynamicContext* aDctx,
+  std::vector<Item>& aResult) const
+{
+  String lInstanceID = getOneStringArgument(aArgs, 0);
+  ShardSet lShards = getShards(aDctx, lInstanceID);
+
+  String lDocName = getOneStringArgument(aArgs, 1);
+  String lPath = "_design/" + lDocName;
+
+  Iterator_t lOptions;
+  if (aArgs.size() > 3)
+    lOptions = getIterArgument(aArgs, 3);
+  String lBody = buildDesignDocument(lDocName, getIterArgument(aArgs, 2), lOptions, aResult);
+
+  //every shard has its own copy of the design document
+  bool lPublished = false;
+  for (size_t i = 0; i < lShards.size(); ++i)
+  {
+    lcb_t lInstance = lShards.theInstances[i];
+    //publishing a design document rebuilds all of its indexes
+    if (isPublished(lInstance, lPath, lBody))
+      continue;
+
+    Operation lOperation(NULL);
+    lOperation.theHttpCompleteCallback = CreateViewFunction::create_view_callback;
+    lcb_http_request_t lReq;
+    lcb_http_cmd_t lCmd;
+    lCmd.version = 0;
+    lCmd.v.v0.path = lPath.c_str();
+    lCmd.v.v0.npath = lPath.size();
+    lCmd.v.v0.content_type = "application/json";
+    lCmd.v.v0.method = LCB_HTTP_METHOD_PUT;
+    lCmd.v.v0.body = lBody.c_str();
+    lCmd.v.v0.nbody = lBody.size();
+    lCmd.v.v0.chunked = 0;
+    lOperation.start(lInstance, lPath.size() + lBody.size(), lPath);
+    lcb_error_t err = lcb_make_http_request(lInstance, &lOperation, LCB_HTTP_TYPE_VIEW, &lCmd, &lReq);
+
+    if (err != LCB_SUCCESS)
+      libCouchbaseError (lInstance, err);
+
+    InstanceData::wait(lInstance);
+    lPublished = true;
+  }
+
+  return lPublished;
+}
+
+void CreateViewFunction::design_doc_callback(lcb_http_request_t request, lcb_t instance, const void* cookie, lcb_error_t error, const lcb_http_resp_t* resp)
+{
+  DesignDocument* lDoc = (DesignDocument*) cookie;
+  if (error != LCB_SUCCESS)
+    return;
+
+  lDoc->theStatus = (int)resp->v.v0.status;
+  if (resp->v.v0.nbytes > 0)
+    lDoc->theBody.append((const char*)resp->v.v0.bytes, resp->v.v0.nbytes);
+}
+
+bool
+CreateViewFunction::isPublished(lcb_t aInstance, const String& aPath, const String& aBody)
+{
+  DesignDocument lDoc;
+  Operation lOperation(&lDoc);
+  lOperation.theHttpCompleteCallback = CreateViewFunction::design_doc_callback;
   lcb_http_request_t lReq;
   lcb_http_cmd_t lCmd;
-  lCmd.v.v0.path = lPath.c_str();
-  lCmd.v.v0.npath = lPath.size();
+  lCmd.version = 0;
+  lCmd.v.v0.path = aPath.c_str();
+  lCmd.v.v0.npath = aPath.size();
   lCmd.v.v0.content_type = "application/json";
-  lCmd.v.v0.method = LCB_HTTP_METHOD_PUT;
-  lCmd.v.v0.body = lBody.c_str();
-  lCmd.v.v0.nbody = lBody.size();
+  lCmd.v.v0.method = LCB_HTTP_METHOD_GET;
+  lCmd.v.v0.body = NULL;
+  lCmd.v.v0.nbody = 0;
   lCmd.v.v0.chunked = 0;
-  lcb_error_t err = lcb_make_http_request(lInstance, NULL, LCB_HTTP_TYPE_VIEW, &lCmd, &lReq);
+  lOperation.start(aInstance, aPath.size(), aPath);
+  lcb_error_t err = lcb_make_http_request(aInstance, &lOperation, LCB_HTTP_TYPE_VIEW, &lCmd, &lReq);
 
   if (err != LCB_SUCCESS)
-    libCouchbaseError (lInstance, err);
+    libCouchbaseError (aInstance, err);
+
+  InstanceData::wait(aInstance);
+
+  //a missing or unreadable document is simply published
+  if (lDoc.theStatus != 200)
+    return false;
+
+  JSONValue lExisting;
+  JSONValue lNew;
+  if (!lExisting.parse(lDoc.theBody.c_str(), lDoc.theBody.size())
+      || !lNew.parse(aBody.c_str(), aBody.size()))
+    return false;
 
-  lcb_wait(lInstance);
+  const JSONValue* lExistingViews = lExisting.getMember("views");
+  const JSONValue* lNewViews = lNew.getMember("views");
+  if (!lExistingViews || !lNewViews)
+    return false;
+
+  std::string lExistingStr;
+  std::string lNewStr;
+  lExistingViews->serializeCanonical(lExistingStr);
+  lNewViews->serializeCanonical(lNewStr);
+  return lExistingStr == lNewStr;
+}
 
+zorba::ItemSequence_t
+CreateViewFunction::evaluate(
+  const Arguments_t& aArgs,
+  const zorba::StaticContext* aSctx,
+  const zorba::DynamicContext* aDctx) const
+{
+  std::vector<Item> lResult;
+  createViews(aArgs, aDctx, lResult);
   return ItemSequence_t(new VectorItemSequence(lResult));  
 }
 
+/*******************************************************************************
+ ******************************************************************************/
+
+zorba::ItemSequence_t
+PublishViewFunction::evaluate(
+  const Arguments_t& aArgs,
+  const zorba::StaticContext* aSctx,
+  const zorba::DynamicContext* aDctx) const
+{
+  std::vector<Item> lPaths;
+  bool lPublished = createViews(aArgs, aDctx, lPaths);
+
+  ItemFactory* lFactory = CouchbaseModule::getItemFactory();
+  std::vector<std::pair<Item, Item> > lPairs;
+  lPairs.push_back(std::make_pair(lFactory->createString("views"), lFactory->createJSONArray(lPaths)));
+  lPairs.push_back(std::make_pair(lFactory->createString("published"), lFactory->createBoolean(lPublished)));
+  return ItemSequence_t(new SingletonItemSequence(lFactory->createJSONObject(lPairs)));
+}
+
+
+
+/*******************************************************************************
+ ******************************************************************************/
+
+void WaitForIndexFunction::index_observe_callback(lcb_t instance, const void* cookie, lcb_error_t error, const lcb_observe_resp_t* resp)
+{
+  //the last call for a command has no key
+  if (resp->v.v0.key == NULL)
+    return;
+
+  //the other observes of the batch are still pending, evaluate raises the
+  //error once they are answered
+  IndexState* lState = (IndexState*) cookie;
+  if (error != LCB_SUCCESS)
+  {
+    if (lState->theError == LCB_SUCCESS)
+      lState->theError = error;
+    return;
+  }
+
+  if (resp->v.v0.from_master > 0)
+  {
+    lcb_observe_t lStatus = resp->v.v0.status;
+    if ((lStatus & LCB_OBSERVE_PERSISTED) || lStatus == LCB_OBSERVE_NOT_FOUND)
+    {
+      lState->thePending.erase(std::string((const char*)resp->v.v0.key, resp->v.v0.nkey));
+    }
+  }
+}
+
+void WaitForIndexFunction::index_update_callback(lcb_http_request_t request, lcb_t instance, const void* cookie, lcb_error_t error, const lcb_http_resp_t* resp)
+{
+  IndexState* lState = (IndexState*) cookie;
+  lState->theError = error;
+  if (error == LCB_SUCCESS)
+    lState->theStatus = (int)resp->v.v0.status;
+}
+
+zorba::ItemSequence_t
+WaitForIndexFunction::evaluate(
+  const Arguments_t& aArgs,
+  const zorba::StaticContext* aSctx,
+  const zorba::DynamicContext* aDctx) const
+{
+  String lInstanceID = getOneStringArgument(aArgs, 0);
+  lcb_t lInstance = getInstance(aDctx, lInstanceID);
+
+  IndexState lState;
+  unsigned int lTimeout = 60000;
+
+  Item lOptions = getOneItemArgument(aArgs, 2);
+  if (!lOptions.isJSONItem())
+    isNotJSONError();
+
+  Iterator_t lIter = lOptions.getObjectKeys();
+  Item lItem;
+  lIter->open();
+  while (lIter->next(lItem))
+  {
+    String lStrKey = lItem.getStringValue();
+    Item lValue = lOptions.getObjectValue(lStrKey);
+    if (lStrKey == "timeout")
+    {
+      try
+      {
+        lTimeout = lValue.getUnsignedIntValue();
+      }
+      catch (ZorbaException& e)
+      {
+        throwError("CB0009", " timeout option must be an integer value");
+      }
+    }
+    else if (lStrKey == "keys")
+    {
+      if (lValue.isJSONItem())
+      {
+        int lSize = lValue.getArraySize()+1;
+        for (int i = 1; i < lSize; i++)
+          lState.thePending.insert(lValue.getArrayValue(i).getStringValue().c_str());
+      }
+      else
+      {
+        lState.thePending.insert(lValue.getStringValue().c_str());
+      }
+    }
+    else
+    {
+      std::ostringstream lMsg;
+      lMsg << lStrKey << ": option not supported";
+      throwError("CB0007", lMsg.str().c_str());
+    }
+  }
+  lIter->close();
+
+  std::chrono::steady_clock::time_point lDeadline =
+    std::chrono::steady_clock::now() + std::chrono::milliseconds(lTimeout);
+  std::chrono::milliseconds lBackoff(10);
+
+  //the indexer only sees documents once they are persisted
+  Operation lOperation(&lState);
+  lOperation.theObserveCallback = index_observe_callback;
+  lOperation.theHttpCompleteCallback = index_update_callback;
+  while (!lState.thePending.empty())
+  {
+    std::vector<std::string> lKeys(lState.thePending.begin(), lState.thePending.end());
+    std::vector<lcb_observe_cmd_t> lObserves(lKeys.size());
+    std::vector<const lcb_observe_cmd_t*> lCommands(lKeys.size());
+    for (size_t i = 0; i < lKeys.size(); ++i)
+    {
+      memset(&lObserves[i], 0, sizeof(lcb_observe_cmd_t));
+      lObserves[i].v.v0.key = lKeys[i].c_str();
+      lObserves[i].v.v0.nkey = lKeys[i].size();
+      lCommands[i] = &lObserves[i];
+    }
+    lState.theError = LCB_SUCCESS;
+    lOperation.start(lInstance, 0, lKeys[0].c_str(), lKeys.size());
+    lcb_error_t lError = lcb_observe(lInstance, &lOperation, lCommands.size(), &lCommands[0]);
+    if (lError != LCB_SUCCESS)
+    {
+      libCouchbaseError (lInstance, lError);
+    }
+    InstanceData::wait(lInstance);
+    if (lState.theError != LCB_SUCCESS)
+    {
+      libCouchbaseError (lInstance, lState.theError);
+    }
+
+    if (lState.thePending.empty())
+      break;
+    if (std::chrono::steady_clock::now() + lBackoff > lDeadline)
+      return ItemSequence_t(new SingletonItemSequence(CouchbaseModule::getItemFactory()->createBoolean(false)));
+    std::this_thread::sleep_for(lBackoff);
+    lBackoff = std::min(lBackoff * 2, std::chrono::milliseconds(500));
+  }
+
+  //a stale=false query blocks until the index has been updated
+  Iterator_t lPaths = getIterArgument(aArgs, 1);
+  Item lPath;
+  lPaths->open();
+  while (lPaths->next(lPath))
+  {
+    String lPathString = lPath.getStringValue() + "?stale=false&limit=1";
+    lBackoff = std::chrono::milliseconds(10);
+    while (true)
+    {
+      //the request blocks until the index is updated, it may not outlast
+      //the timeout (the view timeout of the connection is restored after)
+      std::chrono::steady_clock::duration lRemaining = lDeadline - std::chrono::steady_clock::now();
+      if (lRemaining <= std::chrono::steady_clock::duration::zero())
+      {
+        lPaths->close();
+        return ItemSequence_t(new SingletonItemSequence(CouchbaseModule::getItemFactory()->createBoolean(false)));
+      }
+      lcb_uint32_t lViewTimeout = 0;
+      long long lRemainingUs = std::max<long long>(1,
+        std::chrono::duration_cast<std::chrono::microseconds>(lRemaining).count());
+      bool lIsBounded = lcb_cntl(lInstance, LCB_CNTL_GET, LCB_CNTL_VIEW_TIMEOUT, &lViewTimeout) == LCB_SUCCESS
+        && lRemainingUs < (long long)lViewTimeout;
+      if (lIsBounded)
+      {
+        lcb_uint32_t lRequestTimeout = (lcb_uint32_t)lRemainingUs;
+        lcb_cntl(lInstance, LCB_CNTL_SET, LCB_CNTL_VIEW_TIMEOUT, &lRequestTimeout);
+      }
+
+      lState.theError = LCB_SUCCESS;
+      lState.theStatus = 0;
+      lcb_http_request_t lReq;
+      lcb_http_cmd_t lCmd;
+      lCmd.version = 0;
+      lCmd.v.v0.path = lPathString.c_str();
+      lCmd.v.v0.npath = lPathString.size();
+      lCmd.v.v0.body = NULL;
+      lCmd.v.v0.nbody = 0;
+      lCmd.v.v0.method = LCB_HTTP_METHOD_GET;
+      lCmd.v.v0.chunked = 0;
+      lCmd.v.v0.content_type = "application/json";
+      lOperation.start(lInstance, lPathString.size(), lPathString);
+      lcb_error_t lError = lcb_make_http_request(lInstance, &lOperation, LCB_HTTP_TYPE_VIEW, &lCmd, &lReq);
+      if (lError == LCB_SUCCESS)
+      {
+        InstanceData::wait(lInstance);
+      }
+      if (lIsBounded)
+      {
+        lcb_cntl(lInstance, LCB_CNTL_SET, LCB_CNTL_VIEW_TIMEOUT, &lViewTimeout);
+      }
+      if (lError != LCB_SUCCESS)
+      {
+        libCouchbaseError (lInstance, lError);
+      }
+
+      if (lState.theError == LCB_SUCCESS && lState.theStatus == 200)
+        break;
+      if (lState.theError != LCB_SUCCESS && lState.theError != LCB_ETIMEDOUT)
+        libCouchbaseError (lInstance, lState.theError);
+      if (lState.theStatus >= 400 && lState.theStatus < 500)
+      {
+        std::ostringstream lMsg;
+        lMsg << "HTTP communication with couchbase server throwed error " << lState.theStatus << ".";
+        throwError("CB0012", lMsg.str().c_str());
+      }
+
+      //timeouts and server errors are retried until the deadline
+      if (std::chrono::steady_clock::now() + lBackoff > lDeadline)
+      {
+        lPaths->close();
+        return ItemSequence_t(new SingletonItemSequence(CouchbaseModule::getItemFactory()->createBoolean(false)));
+      }
+      std::this_thread::sleep_for(lBackoff);
+      lBackoff = std::min(lBackoff * 2, std::chrono::milliseconds(1000));
+    }
+  }
+  lPaths->close();
+
+  return ItemSequence_t(new SingletonItemSequence(CouchbaseModule::getItemFactory()->createBoolean(true)));
+}
 
 } /*namespace couchbase*/ } /*namespace zorba*/
 
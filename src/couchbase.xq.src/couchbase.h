@@ -17,13 +17,31 @@
 #ifndef _COM_ZORBA_WWW_MODULES_COUCHBASE_H_
 #define _COM_ZORBA_WWW_MODULES_COUCHBASE_H_
 
+#include <chrono>
+#include <ctime>
+#include <deque>
+#include <exception>
 #include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <sstream>
+#include <vector>
 
 #include <zorba/zorba.h>
 #include <zorba/external_module.h>
 #include <zorba/function.h>
 #include <zorba/dynamic_context.h>
 
+#include "io_loop.h"
+#include "json_item_builder.h"
+#include "json_utils.h"
+#include "retry.h"
+#include "shard_ring.h"
+#include "slow_log.h"
+#include "stats.h"
+#include "trace.h"
+
 #define COUCHBASE_MODULE_NAMESPACE "http://www.zorba-xquery.com/modules/couchbase"
 
 namespace zorba { namespace couchbase {
@@ -44,6 +62,7 @@ class CouchbaseModule : public ExternalModule {
 
     typedef std::map<String, ExternalFunction*, ltstr> FuncMap_t;
     FuncMap_t theFunctions;
+    std::mutex theFunctionsMutex;
 
   public:
     
@@ -70,11 +89,568 @@ class CouchbaseModule : public ExternalModule {
     }
 };
 
+/*******************************************************************************
+ * Information about the connection an lcb_t belongs to. It is attached to
+ * the instance with lcb_set_cookie and released by destroyInstance.
+ ******************************************************************************/
+
+class InstanceData
+{
+  public:
+    String theHost;
+    String theBucket;
+    std::string thePoolKey;
+    IOLoop_t theIO;
+    bool theHasFailed;
+    //commands were issued and not waited for (a wait was interrupted by an
+    //exception), their cookies may point to destroyed objects
+    bool theHasPending;
+    //iterators still using the instance, it is released once they are gone
+    unsigned int theUsers;
+    bool theIsReleased;
+    //seconds after which an unused instance is released, 0 for never
+    unsigned int theIdleTimeout;
+    time_t theLastUse;
+    //times the instance was taken from the pool again
+    unsigned long theReuses;
+    InstanceStats theStats;
+    TraceFile_t theTrace;
+    //operations slower than theSlowThreshold (microseconds) are logged
+    SlowLog_t theSlowLog;
+    uint64_t theSlowThreshold;
+    unsigned int theSlowMaxPerSecond;
+    //response data held for the instance and for the query using it
+    MemoryAccount theMemory;
+    MemoryAccount_t theQueryMemory;
+    RetryPolicy theRetry;
+
+    InstanceData(const String& aHost, const String& aBucket)
+      : theHost(aHost), theBucket(aBucket), theHasFailed(false), theHasPending(false),
+        theUsers(0), theIsReleased(false), theIdleTimeout(0), theLastUse(time(NULL)), theReuses(0),
+        theSlowThreshold(0), theSlowMaxPerSecond(SlowLog::DEFAULT_MAX_PER_SECOND) {}
+
+    static void
+      error_callback(lcb_t instance, lcb_error_t error, const char* errinfo);
+
+    static InstanceData*
+      get(lcb_t aInstance);
+
+    /*
+     * Returns the trace file of the instance, an empty pointer if it isn't
+     * traced.
+     */
+    static const TraceFile_t&
+      getTrace(lcb_t aInstance);
+
+    /*
+     * Writes aEntry to the slow operation log of the instance if it has
+     * one and aDuration reaches its threshold. For key based operations
+     * (aIsKeyed) the node serving the key is looked up.
+     */
+    static void
+      logSlow(lcb_t aInstance, SlowLog::Entry& aEntry, std::chrono::microseconds aDuration, bool aIsKeyed);
+
+    /*
+     * Returns "host:port" of the node the key is mapped to, an empty
+     * string if the cluster map is not known (yet).
+     */
+    static std::string
+      getNode(lcb_t aInstance, const char* aKey, size_t aKeyLen);
+
+    /*
+     * Returns the index (in lcb_get_server_list) of the server owning the
+     * vBucket of the key, -1 if the cluster map is not known (yet).
+     */
+    static int
+      getServerIndex(lcb_t aInstance, const char* aKey, size_t aKeyLen);
+
+    static void
+      destroyInstance(lcb_t aInstance);
+
+    /*
+     * lcb_wait, an instance only has no pending commands once it returns.
+     */
+    static void
+      wait(lcb_t aInstance);
+
+    /*
+     * Returns a pooled instance to the InstancePool, destroys it otherwise,
+     * if it reported a connection error, if it has pending commands or if
+     * it is released while an exception is thrown. Deferred while the
+     * instance has users.
+     */
+    static void
+      releaseInstance(lcb_t aInstance);
+
+    static void
+      addUser(lcb_t aInstance);
+
+    static void
+      removeUser(lcb_t aInstance);
+
+    bool
+      isIdle(time_t aNow) const
+    {
+      return theIdleTimeout > 0 && theUsers == 0 && aNow - theLastUse >= (time_t)theIdleTimeout;
+    }
+};
+
+/*******************************************************************************
+ * Bytes charged to the memory accounts of an instance and of the query it
+ * belongs to, released when the charge is cleared or destroyed. A charge
+ * must not outlive its instance.
+ ******************************************************************************/
+
+class MemoryCharge
+{
+  protected:
+    InstanceData* theData;
+    MemoryAccount_t theQueryMemory;
+    size_t theBytes;
+
+  public:
+    MemoryCharge(lcb_t aInstance);
+
+    ~MemoryCharge() { clear(); }
+
+    /*
+     * Charges aBytes more. Returns false (and charges nothing) if that
+     * would exceed the limit of the instance or of the query.
+     */
+    bool
+      grow(size_t aBytes);
+
+    void
+      clear();
+
+    size_t
+      getBytes() const { return theBytes; }
+};
+
+/*******************************************************************************
+ * The "deadline" option of an operation, unset by default: the point in
+ * time (given in milliseconds relative to the call) after which a
+ * function doesn't issue any new operation.
+ ******************************************************************************/
+
+class Deadline
+{
+  protected:
+    bool theIsSet;
+    std::chrono::steady_clock::time_point theTime;
+
+  public:
+    Deadline() : theIsSet(false) {}
+
+    void
+      set(unsigned int aMillis)
+    {
+      theIsSet = true;
+      theTime = std::chrono::steady_clock::now() + std::chrono::milliseconds(aMillis);
+    }
+
+    bool
+      hasPassed() const { return theIsSet && std::chrono::steady_clock::now() >= theTime; }
+
+    /*
+     * Raises CB0013 if the deadline has passed.
+     */
+    void
+      check() const;
+};
+
+/*******************************************************************************
+ * Send times of the commands of an operation whose commands go out at
+ * different times (batches that send more while earlier commands are in
+ * flight), so that every response is timed from its own send.
+ ******************************************************************************/
+
+class CommandLog
+{
+  public:
+    virtual ~CommandLog() {}
+
+    /*
+     * Sets the send time, batch size and bytes sent of the command in
+     * flight for aKey. Returns false if no such command is in flight.
+     */
+    virtual bool
+      getSent(
+        const void* aKey,
+        size_t aKeyLen,
+        std::chrono::steady_clock::time_point& aTime,
+        size_t& aBatch,
+        size_t& aBytesOut) const = 0;
+};
+
+/*******************************************************************************
+ * Callback state of a single operation. The callbacks of an instance are
+ * installed once when it is created and forward every response to the
+ * Operation given as cookie of the command, so operations never depend on
+ * callbacks (re)installed by somebody else on the same instance.
+ ******************************************************************************/
+
+class Operation
+{
+  public:
+    const void* theCookie;
+    lcb_get_callback theGetCallback;
+    lcb_store_callback theStoreCallback;
+    lcb_remove_callback theRemoveCallback;
+    lcb_touch_callback theTouchCallback;
+    lcb_observe_callback theObserveCallback;
+    lcb_http_data_callback theHttpDataCallback;
+    lcb_http_complete_callback theHttpCompleteCallback;
+    //time the last command of the operation was issued
+    std::chrono::steady_clock::time_point theStart;
+    //set for batches, they know when each of their commands was sent
+    const CommandLog* theCommandLog;
+    //only kept if the instance is traced or logs slow operations
+    std::string theTraceKey;
+    size_t theBatch;
+    size_t theBytesOut;
+    //received by the http data callback
+    mutable size_t theBytesIn;
+    //keys of the commands that failed with a temporary error, their
+    //responses are not passed on and retry() hands them out for resending
+    mutable std::vector<std::string> theRetryKeys;
+    //retry rounds in a row that had failed commands
+    unsigned int theRetryRound;
+
+    Operation(const void* aCookie)
+      : theCookie(aCookie),
+        theGetCallback(NULL),
+        theStoreCallback(NULL),
+        theRemoveCallback(NULL),
+        theTouchCallback(NULL),
+        theObserveCallback(NULL),
+        theHttpDataCallback(NULL),
+        theHttpCompleteCallback(NULL),
+        theCommandLog(NULL),
+        theBatch(1),
+        theBytesOut(0),
+        theBytesIn(0),
+        theRetryRound(0) {}
+
+    static void
+      installCallbacks(lcb_t aInstance);
+
+    /*
+     * To be called right before issuing the command(s) of the operation,
+     * aBytesOut is the size of the keys and values sent. aKey (the first
+     * key or the path) and aBatch (the number of commands) are only used
+     * for tracing and the slow operation log.
+     */
+    void
+      start(lcb_t aInstance, size_t aBytesOut, const String& aKey = String(), size_t aBatch = 1);
+
+    /*
+     * To be called after waiting for the commands of the operation.
+     * Returns false if none of them failed with a temporary error.
+     * Otherwise waits for the backoff of the next retry round and moves
+     * the keys to resend to aKeys; single key operations resend their
+     * command and don't need them.
+     */
+    bool
+      retry(lcb_t aInstance, std::vector<std::string>* aKeys = NULL);
+
+  protected:
+    /*
+     * Remembers the key of a command that failed with a temporary error
+     * and has attempts left. Returns true if the response must not be
+     * passed on in that case.
+     */
+    bool
+      defer(lcb_t aInstance, lcb_error_t aError, const void* aKey, size_t aKeyLen) const;
+
+    static void
+      record(
+        lcb_t aInstance,
+        const void* aCookie,
+        InstanceStats::op_type_t aType,
+        lcb_error_t aError,
+        size_t aBytesIn,
+        const void* aKey = NULL,
+        size_t aKeyLen = 0);
+
+    static void
+      store_callback(lcb_t instance, const void* cookie, lcb_storage_t operation, lcb_error_t error, const lcb_store_resp_t* resp);
+
+    static void
+      remove_callback(lcb_t instance, const void* cookie, lcb_error_t error, const lcb_remove_resp_t* resp);
+
+    static void
+      touch_callback(lcb_t instance, const void* cookie, lcb_error_t error, const lcb_touch_resp_t* resp);
+
+    static void
+      get_callback(lcb_t instance, const void* cookie, lcb_error_t error, const lcb_get_resp_t* resp);
+
+    static void
+      observe_callback(lcb_t instance, const void* cookie, lcb_error_t error, const lcb_observe_resp_t* resp);
+
+    static void
+      http_data_callback(
+        lcb_http_request_t request,
+        lcb_t instance,
+        const void* cookie,
+        lcb_error_t error,
+        const lcb_http_resp_t* resp);
+
+    static void
+      http_complete_callback(
+        lcb_http_request_t request,
+        lcb_t instance,
+        const void* cookie,
+        lcb_error_t error,
+        const lcb_http_resp_t* resp);
+};
+
+/*******************************************************************************
+ * Schedules the commands of a batched get, store, remove or touch. The keys
+ * are mapped to the server owning their vBucket (according to the current
+ * config of the instance) and every server gets its own queue and keeps at
+ * most WINDOW commands in flight; a response frees a slot and refills the
+ * window of its server right away, so a slow node only holds back its own
+ * keys. Subclasses issue the commands of one server with a single lcb_*
+ * call; the responses of stores, removes and touches are handled here,
+ * those of gets have to call complete() themselves.
+ *
+ * Nothing may be thrown from a callback while other commands are in flight
+ * (their cookies would point to a destroyed scheduler the next time the
+ * instance waits): callbacks and failed sends hand their exception to
+ * fail(), and run() raises it once all commands in flight are answered.
+ ******************************************************************************/
+class NodeScheduler : public CommandLog
+{
+  public:
+    //keys read from the input before the batch is scheduled
+    static const size_t BATCH_SIZE = 256;
+    static const size_t WINDOW = 32;
+
+  protected:
+    lcb_t theInstance;
+    std::vector<std::string> theKeys;
+    //queue of each command, the last queue takes the keys without a
+    //known server
+    std::vector<size_t> theServers;
+    std::vector<std::deque<size_t> > theQueues;
+    std::vector<size_t> theInFlight;
+    //commands in flight by key, a key can be requested more than once
+    std::map<std::string, std::deque<size_t> > theSent;
+    //time each command was sent and the number of commands sent with it,
+    //refills from callbacks send while earlier commands are in flight
+    std::vector<std::chrono::steady_clock::time_point> theSendTimes;
+    std::vector<size_t> theSendBatches;
+    //result of each store, remove or touch
+    std::vector<lcb_error_t> theResults;
+    Operation theOperation;
+    //the first failure, no more commands are sent after it
+    std::exception_ptr theError;
+
+    /*
+     * Issues the commands with the given indexes, all of them belong to
+     * the same server.
+     */
+    virtual void
+      send(const std::vector<size_t>& aCommands) = 0;
+
+    /*
+     * Bytes sent for a command: its key and, for stores, its value.
+     */
+    virtual size_t
+      getBytesOut(size_t aCommand) const { return theKeys[aCommand].size(); }
+
+    void
+      flush(size_t aServer);
+
+    static void
+      store_callback(lcb_t instance, const void* cookie, lcb_storage_t operation, lcb_error_t error, const lcb_store_resp_t* resp);
+
+    static void
+      remove_callback(lcb_t instance, const void* cookie, lcb_error_t error, const lcb_remove_resp_t* resp);
+
+    static void
+      touch_callback(lcb_t instance, const void* cookie, lcb_error_t error, const lcb_touch_resp_t* resp);
+
+  public:
+    NodeScheduler(lcb_t aInstance);
+
+    virtual ~NodeScheduler() {}
+
+    /*
+     * Adds a command for aKey and returns its index.
+     */
+    size_t
+      add(const String& aKey);
+
+    size_t
+      size() const { return theKeys.size(); }
+
+    const std::string&
+      getKey(size_t aCommand) const { return theKeys[aCommand]; }
+
+    /*
+     * The error of a store, remove or touch after run(), LCB_SUCCESS for
+     * gets.
+     */
+    lcb_error_t
+      getResult(size_t aCommand) const { return theResults[aCommand]; }
+
+    /*
+     * Drops all commands and picks up the current server list.
+     */
+    void
+      clear();
+
+    /*
+     * Sends the first window of every server without waiting.
+     */
+    void
+      flushAll();
+
+    /*
+     * Frees the window slot of the response for aKey and sets aCommand
+     * to the index of its command. Returns false if no such command is
+     * in flight.
+     */
+    bool
+      complete(const void* aKey, size_t aKeyLen, size_t& aCommand);
+
+    /*
+     * To be called before complete().
+     */
+    virtual bool
+      getSent(
+        const void* aKey,
+        size_t aKeyLen,
+        std::chrono::steady_clock::time_point& aTime,
+        size_t& aBatch,
+        size_t& aBytesOut) const;
+
+    /*
+     * Remembers the first failure of the batch, the commands not sent yet
+     * are dropped.
+     */
+    void
+      fail(std::exception_ptr aError) { if (!theError) theError = aError; }
+
+    /*
+     * Sends all commands and waits for them, resending those that failed
+     * with a temporary error. Raises the first failure after all commands
+     * in flight are answered, and CB0013 instead of another retry round
+     * once aDeadline has passed.
+     */
+    void
+      run(const Deadline& aDeadline = Deadline());
+
+    /*
+     * Drops the commands not sent yet and waits for those in flight,
+     * ignoring their failures.
+     */
+    void
+      cancel();
+
+    /*
+     * Runs the schedulers of several instances (the shards of a sharded
+     * connection): all of them send their first windows before the first
+     * wait, so instances sharing an event loop work concurrently. After a
+     * failure the remaining schedulers are cancelled and the failure is
+     * raised.
+     */
+    template <class Scheduler>
+    static void
+      runAll(const std::vector<std::unique_ptr<Scheduler> >& aSchedulers, const Deadline& aDeadline = Deadline())
+    {
+      for (size_t i = 0; i < aSchedulers.size(); ++i)
+        aSchedulers[i]->flushAll();
+      std::exception_ptr lError;
+      for (size_t i = 0; i < aSchedulers.size(); ++i)
+      {
+        if (lError)
+        {
+          aSchedulers[i]->cancel();
+          continue;
+        }
+        try
+        {
+          aSchedulers[i]->run(aDeadline);
+        }
+        catch (...)
+        {
+          lError = std::current_exception();
+        }
+      }
+      if (lError)
+        std::rethrow_exception(lError);
+    }
+};
+
+/*******************************************************************************
+ * The instances a function works on: the single instance of a connection or
+ * the shards of one made by connect-sharded, together with the ring that
+ * routes the keys.
+ ******************************************************************************/
+class ShardSet
+{
+  public:
+    std::vector<lcb_t> theInstances;
+    //NULL for a connection to a single bucket
+    std::shared_ptr<const ShardRing> theRing;
+
+    size_t
+      getShard(const String& aKey) const { return theRing ? theRing->getShard(aKey.c_str(), aKey.size()) : 0; }
+
+    size_t
+      size() const { return theInstances.size(); }
+};
+
+/*******************************************************************************
+ * The items of several sequences one after the other, merges the results of
+ * the shards of a sharded connection. theInputs only keeps alive the
+ * sequences the others read from.
+ ******************************************************************************/
+class ConcatItemSequence : public ItemSequence
+{
+  public:
+    class ConcatIterator : public Iterator
+    {
+      protected:
+        std::vector<ItemSequence_t> theSequences;
+        size_t theCurrent;
+        Iterator_t theIterator;
+        bool theIsOpen;
+
+      public:
+        ConcatIterator(const std::vector<ItemSequence_t>& aSequences)
+          : theSequences(aSequences), theCurrent(0), theIsOpen(false) {}
+
+        void
+          open();
+
+        bool
+          next(Item& aItem);
+
+        void
+          close();
+
+        bool
+          isOpen() const { return theIsOpen; }
+    };
+
+    std::vector<ItemSequence_t> theInputs;
+    std::vector<ItemSequence_t> theSequences;
+
+    zorba::Iterator_t
+      getIterator() { return new ConcatIterator(theSequences); }
+};
+
 /*******************************************************************************
  ******************************************************************************/
 
 class CouchbaseFunction : public ContextualExternalFunction
 {
+  friend class Deadline;
+
   protected:
 
     typedef enum
@@ -86,6 +662,9 @@ class CouchbaseFunction : public ContextualExternalFunction
 
     } lcb_storage_type_t;
 
+    //item flags of values stored by put-xml in the XmlCodec encoding
+    static const lcb_uint32_t XML_FLAGS = 0x584D4C00 | LCB_XML;
+
     typedef enum
     {
       CB_WAIT_FALSE = 0x00,
@@ -100,23 +679,41 @@ class CouchbaseFunction : public ContextualExternalFunction
         String thePath;
         String theStaleOption;
         String theLimitOption;
+        String theGroupOption;
+        String theReduceOption;
+        bool theIncludeDocs;
+        unsigned int theConcurrency;
+        unsigned int theCacheTTL;
+        Deadline theDeadline;
 
       public:
-        std::unique_ptr<std::stringstream>* theStream;
+        ViewOptions() : theEncoding("UTF-8"), thePath(""), theStaleOption(""), theLimitOption(""), theGroupOption(""), theReduceOption(""), theIncludeDocs(false), theConcurrency(0), theCacheTTL(0) {}
 
-        ViewOptions() : theEncoding("UTF-8"), thePath(""), theStaleOption(""), theLimitOption("") { theStream = NULL; }
-
-        ViewOptions(String& aPath) : theEncoding("UTF-8"), thePath(aPath) {}
+        ViewOptions(String& aPath) : theEncoding("UTF-8"), thePath(aPath), theIncludeDocs(false), theConcurrency(0), theCacheTTL(0) {}
 
         void setOptions(Item& aOptions);
 
-        ~ViewOptions() { if(theStream) delete theStream; }
+        ~ViewOptions() {}
 
         String getEncoding() { return theEncoding; }
 
         String getPath() { return thePath; }
 
-        String getPathOptions();
+        /*
+         * The query string of the options, without "stale" for
+         * aWithStale false (stale and fresh results share a cache entry).
+         */
+        String getPathOptions(bool aWithStale = true);
+
+        bool includeDocs() { return theIncludeDocs; }
+
+        bool allowsStale() { return theStaleOption != "stale=false"; }
+
+        unsigned int getCacheTTL() { return theCacheTTL; }
+
+        unsigned int getConcurrency() { return theConcurrency; }
+
+        const Deadline& getDeadline() { return theDeadline; }
     };
 
     class GetOptions
@@ -125,13 +722,18 @@ class CouchbaseFunction : public ContextualExternalFunction
         lcb_storage_type_t theType;
         unsigned int theExpTime;
         String theEncoding;
+        Deadline theDeadline;
+        //with the paths of the "project" option
+        JSONItemBuilder theBuilder;
 
       public:
         Item theItem;
+        //set by the callback if the value exceeded a memory limit
+        bool theIsOverLimit;
 
-        GetOptions() : theType(LCB_JSON), theExpTime(0), theEncoding("") {}
+        GetOptions() : theType(LCB_JSON), theExpTime(0), theEncoding(""), theIsOverLimit(false) {}
 
-        GetOptions(lcb_storage_type_t aType) : theType(aType), theExpTime(0) {} 
+        GetOptions(lcb_storage_type_t aType) : theType(aType), theExpTime(0), theIsOverLimit(false) {} 
 
         void setOptions(Item& aOptions);
 
@@ -143,6 +745,9 @@ class CouchbaseFunction : public ContextualExternalFunction
 
         String getEncoding() { return theEncoding; }
 
+        const Deadline& getDeadline() { return theDeadline; }
+
+        const JSONItemBuilder& getBuilder() { return theBuilder; }
     };
 
     class PutOptions
@@ -154,6 +759,7 @@ class CouchbaseFunction : public ContextualExternalFunction
         String theEncoding;
         cb_wait_type_t theWaitType;
         bool theIsWaiting;
+        Deadline theDeadline;
 
       public:
 
@@ -178,6 +784,174 @@ class CouchbaseFunction : public ContextualExternalFunction
         bool isWaiting() { return theIsWaiting; }
 
         void setWaiting(bool isWaiting) { theIsWaiting = isWaiting; }
+
+        const Deadline& getDeadline() { return theDeadline; }
+    };
+
+    /*
+     * The stores of put and copy, every command has its own (encoded)
+     * value and item flags.
+     */
+    class StoreBatch : public NodeScheduler
+    {
+      protected:
+        std::vector<std::string> theValues;
+        std::vector<lcb_uint32_t> theCommandFlags;
+        //the values are released once the stores of the batch completed
+        MemoryCharge theMemory;
+        lcb_storage_t theStorage;
+        lcb_datatype_t theDataType;
+        lcb_uint32_t theFlags;
+        unsigned int theExpTime;
+
+        void
+          send(const std::vector<size_t>& aCommands);
+
+        size_t
+          getBytesOut(size_t aCommand) const { return theKeys[aCommand].size() + theValues[aCommand].size(); }
+
+      public:
+        StoreBatch(lcb_t aInstance, lcb_storage_t aStorage, lcb_datatype_t aDataType, lcb_uint32_t aFlags, unsigned int aExpTime)
+          : NodeScheduler(aInstance), theMemory(aInstance), theStorage(aStorage), theDataType(aDataType), theFlags(aFlags), theExpTime(aExpTime) {}
+
+        /*
+         * Charges aBytes of values to the memory of the instance, returns
+         * false if that exceeds a limit.
+         */
+        bool
+          charge(size_t aBytes) { return theMemory.grow(aBytes); }
+
+        /*
+         * Takes over the content of aValue, the value gets the flags of
+         * the batch or aFlags.
+         */
+        size_t
+          add(const String& aKey, std::string& aValue);
+
+        size_t
+          add(const String& aKey, std::string& aValue, lcb_uint32_t aFlags);
+
+        const std::string&
+          getValue(size_t aCommand) const { return theValues[aCommand]; }
+
+        void
+          clear() { NodeScheduler::clear(); theValues.clear(); theCommandFlags.clear(); theMemory.clear(); }
+    };
+
+    /*
+     * The commands of remove (aType OP_REMOVE) or touch (OP_TOUCH), they
+     * only have a key.
+     */
+    class KeyBatch : public NodeScheduler
+    {
+      protected:
+        InstanceStats::op_type_t theType;
+        unsigned int theExpTime;
+
+        void
+          send(const std::vector<size_t>& aCommands);
+
+      public:
+        KeyBatch(lcb_t aInstance, InstanceStats::op_type_t aType, unsigned int aExpTime = 0)
+          : NodeScheduler(aInstance), theType(aType), theExpTime(aExpTime) {}
+
+        /*
+         * Removes or touches aKeys in batches of BATCH_SIZE, routed to the
+         * shards of aShards.
+         */
+        static void
+          runKeys(const ShardSet& aShards, Iterator_t& aKeys, InstanceStats::op_type_t aType, unsigned int aExpTime = 0);
+    };
+
+    /*
+     * Emulates include_docs: the ids of the rows are collected while the
+     * view response streams in and the documents are fetched with
+     * batched gets, keeping at most MAX_IN_FLIGHT keys pending. Once
+     * everything arrived, each row gets a "doc" member. Its gets are sent
+     * from the view callbacks, so errors are only recorded and raised by
+     * the view iterator after waiting.
+     */
+    class ViewDocJoin : public CommandLog
+    {
+      protected:
+        static const size_t BATCH_SIZE = 64;
+        static const size_t MAX_IN_FLIGHT = 256;
+
+        lcb_t theInstance;
+        ViewRowScanner theScanner;
+        std::vector<ViewRowScanner::Row> theRows;
+        std::vector<size_t> theRowDocs;
+        std::map<std::string, size_t> theDocIndex;
+        std::vector<std::string> theIds;
+        std::vector<std::string> theDocs;
+        std::vector<bool> theFound;
+        //time each document was requested and the size of its batch
+        std::vector<std::chrono::steady_clock::time_point> theSendTimes;
+        std::vector<size_t> theSendBatches;
+        size_t theNextFetch;
+        size_t theInFlight;
+        Operation theOperation;
+        MemoryCharge theMemory;
+        bool theIsOverLimit;
+        //first error of a get, no more documents are fetched after it
+        lcb_error_t theError;
+
+        static void
+          doc_callback(lcb_t instance, const void *cookie, lcb_error_t error, const lcb_get_resp_t *resp);
+
+        /*
+         * Issues one batched get for aCount ids starting at aFirst.
+         * Returns false (and records the error) if it could not be sent.
+         */
+        bool
+          fetch(const std::vector<std::string>& aIds, size_t aFirst, size_t aCount);
+
+      public:
+        ViewDocJoin(lcb_t aInstance)
+          : theInstance(aInstance), theNextFetch(0), theInFlight(0), theOperation(this),
+            theMemory(aInstance), theIsOverLimit(false), theError(LCB_SUCCESS)
+        {
+          theOperation.theGetCallback = doc_callback;
+          theOperation.theCommandLog = this;
+        }
+
+        void
+          feed(const char* aData, size_t aLen);
+
+        /*
+         * Fetches the next full batches, with aFlush also the remaining
+         * ids and (after the backoff) those that failed with a temporary
+         * error.
+         */
+        void
+          schedule(bool aFlush);
+
+        bool
+          isPending() const
+        {
+          return theError == LCB_SUCCESS
+            && (theNextFetch < theIds.size() || !theOperation.theRetryKeys.empty());
+        }
+
+        void
+          setDocument(const lcb_get_resp_t* aResp, lcb_error_t aError);
+
+        std::stringstream*
+          createStream() const;
+
+        bool
+          isOverLimit() const { return theIsOverLimit; }
+
+        lcb_error_t
+          getError() const { return theError; }
+
+        virtual bool
+          getSent(
+            const void* aKey,
+            size_t aKeyLen,
+            std::chrono::steady_clock::time_point& aTime,
+            size_t& aBatch,
+            size_t& aBytesOut) const;
     };
 
     class ViewItemSequence : public ItemSequence
@@ -189,6 +963,39 @@ class CouchbaseFunction : public ContextualExternalFunction
 
       public:
 
+        class ViewIterator;
+
+        /*
+         * State of one view request; every path gets its own buffer so that
+         * several requests can be in flight on the same instance.
+         */
+        class ViewRequest
+        {
+          public:
+            ViewIterator* theIterator;
+            String thePath;
+            std::unique_ptr<std::stringstream> theStream;
+            std::unique_ptr<ViewDocJoin> theDocJoin;
+            bool theIsDone;
+            std::string theCacheKey;
+            bool theIsCached;
+            Operation theOperation;
+            //buffered response bytes, dropped once the limit is exceeded
+            MemoryCharge theMemory;
+            bool theIsOverLimit;
+            //first error of the request, raised by next() after the wait
+            lcb_error_t theError;
+
+            ViewRequest(ViewIterator* aIterator, lcb_t aInstance, const String& aPath)
+              : theIterator(aIterator), thePath(aPath), theIsDone(false), theIsCached(false),
+                theOperation(this), theMemory(aInstance), theIsOverLimit(false),
+                theError(LCB_SUCCESS)
+            {
+              theOperation.theHttpDataCallback = view_callback;
+              theOperation.theHttpCompleteCallback = view_complete_callback;
+            }
+        };
+
         class ViewIterator : public Iterator
         {
           protected:
@@ -196,12 +1003,33 @@ class CouchbaseFunction : public ContextualExternalFunction
             Iterator_t thePaths;
             lcb_error_t theError;
             ViewOptions theOptions;
+            std::vector<ViewRequest*> theRequests;
+            size_t theNext;
+            size_t theInFlight;
+            bool theHasMorePaths;
+            bool theIsExpired;
+
+            void
+              clearRequests();
 
           public:
             ViewIterator(lcb_t& aInstance, Iterator_t& aPaths, ViewOptions& aOptions)
               : theInstance(aInstance),
                 thePaths(aPaths),
-                theOptions(aOptions){}
+                theOptions(aOptions),
+                theNext(0),
+                theInFlight(0),
+                theHasMorePaths(true),
+                theIsExpired(false)
+            {
+              InstanceData::addUser(theInstance);
+            }
+
+            virtual ~ViewIterator()
+            {
+              clearRequests();
+              InstanceData::removeUser(theInstance);
+            }
             
             void 
               open();
@@ -215,6 +1043,14 @@ class CouchbaseFunction : public ContextualExternalFunction
             bool
               isOpen() const{ return thePaths->isOpen(); }
 
+            void
+              launch();
+
+            void
+              complete(ViewRequest* aRequest);
+
+            ViewOptions&
+              getOptions() { return theOptions; }
         };
 
         ViewItemSequence(lcb_t& aInstance, Iterator_t& aPaths, ViewOptions aOptions)
@@ -235,32 +1071,78 @@ class CouchbaseFunction : public ContextualExternalFunction
             const void *cookie,
             lcb_error_t error,
             const lcb_http_resp_t *resp);
+
+        static void
+          view_complete_callback( 
+            lcb_http_request_t request,
+            lcb_t instance,
+            const void *cookie,
+            lcb_error_t error,
+            const lcb_http_resp_t *resp);
     };
 
     class GetItemSequence : public ItemSequence
     {
       protected:
-        lcb_t theInstance;
+        ShardSet theShards;
         Iterator_t theKeys;
         GetOptions theOptions;
     
       public:
 
+        /*
+         * The gets of one batch of keys, the items are kept in the order
+         * of the keys.
+         */
+        class GetBatch : public NodeScheduler
+        {
+          protected:
+            void
+              send(const std::vector<size_t>& aCommands);
+
+          public:
+            GetOptions* theOptions;
+            std::vector<Item> theItems;
+
+            GetBatch(lcb_t aInstance, GetOptions* aOptions)
+              : NodeScheduler(aInstance), theOptions(aOptions)
+            {
+              theOperation.theGetCallback = get_callback;
+            }
+        };
+
         class GetIterator : public Iterator
         {
           protected:            
-            lcb_t theInstance;
-            lcb_error_t theError;
+            ShardSet theShards;
             Iterator_t theKeys;
             GetOptions theOptions;
+            //one batch per shard
+            std::vector<std::unique_ptr<GetBatch> > theBatches;
+            //shard and command of each key of the current batches
+            std::vector<std::pair<size_t, size_t> > theOrder;
+            //next item of theOrder to return
+            size_t theNext;
 
           public:
-            GetIterator(lcb_t& aInstance, Iterator_t& aKeys, GetOptions& aOptions) 
-              : theInstance(aInstance),
+            GetIterator(const ShardSet& aShards, Iterator_t& aKeys, GetOptions& aOptions) 
+              : theShards(aShards),
                 theKeys(aKeys),
-                theOptions(aOptions) {}
-
-            virtual ~GetIterator() {}
+                theOptions(aOptions),
+                theNext(0)
+            {
+              for (size_t i = 0; i < theShards.size(); ++i)
+              {
+                theBatches.push_back(std::unique_ptr<GetBatch>(new GetBatch(theShards.theInstances[i], &theOptions)));
+                InstanceData::addUser(theShards.theInstances[i]);
+              }
+            }
+
+            virtual ~GetIterator()
+            {
+              for (size_t i = 0; i < theShards.size(); ++i)
+                InstanceData::removeUser(theShards.theInstances[i]);
+            }
 
             void
               open();
@@ -276,15 +1158,22 @@ class CouchbaseFunction : public ContextualExternalFunction
         };
 
       public:
-        GetItemSequence(lcb_t& aInstance, Iterator_t& aKeys, GetOptions aOptions) 
-          : theInstance(aInstance),
+        GetItemSequence(const ShardSet& aShards, Iterator_t& aKeys, GetOptions aOptions) 
+          : theShards(aShards),
             theKeys(aKeys),
             theOptions(aOptions){}
 
         virtual ~GetItemSequence(){}
 
         zorba::Iterator_t
-          getIterator() { return new GetIterator(theInstance, theKeys, theOptions); }
+          getIterator() { return new GetIterator(theShards, theKeys, theOptions); }
+
+        /*
+         * Creates the item for the value of aResp (decoded according to
+         * aOptions) and stores it in aOptions.theItem.
+         */
+        static void
+          createItem(GetOptions& aOptions, const lcb_get_resp_t* aResp, const TraceFile_t& aTrace);
 
       protected:
         static void 
@@ -308,14 +1197,40 @@ class CouchbaseFunction : public ContextualExternalFunction
     static void 
       isNotJSONError();
 
+    static void
+      memoryLimitError();
+
     static void
       libCouchbaseError(lcb_t aInstance, lcb_error_t aError);
 
+    /*
+     * Returns the instance of a connection, raises CB0018 for a sharded
+     * connection.
+     */
     lcb_t
       getInstance (const DynamicContext*, const String& aIdent) const;
 
+    /*
+     * Returns the instances of a connection, sharded or not.
+     */
+    ShardSet
+      getShards (const DynamicContext*, const String& aIdent) const;
+
+    /*
+     * Converts aLen bytes stored in aEncoding to a string, no conversion
+     * is done for an empty aEncoding.
+     */
+    static void
+      decode(const char* aData, size_t aLen, const String& aEncoding, String& aResult);
+
+    /*
+     * Converts aValue to aEncoding before it is stored.
+     */
     static void
-      put (lcb_t aInstance, Iterator_t aKeys, Iterator_t aValues, PutOptions aOptions);
+      encode(const String& aValue, const String& aEncoding, String& aResult);
+
+    static void
+      put (const ShardSet& aShards, Iterator_t aKeys, Iterator_t aValues, PutOptions aOptions);
 
     
     static void
@@ -345,9 +1260,31 @@ class InstanceMap : public ExternalFunctionParameter
   private:
     typedef std::map<String, lcb_t> InstanceMap_t;
     InstanceMap_t* instanceMap;
+    //connections made by connect-sharded, their shards are kept in
+    //instanceMap under their own identifiers
+    class Sharded
+    {
+      public:
+        std::vector<String> theIds;
+        std::shared_ptr<const ShardRing> theRing;
+    };
+    typedef std::map<String, Sharded> ShardedMap_t;
+    ShardedMap_t theSharded;
+    //shared by all instances of the query
+    MemoryAccount_t theMemory;
+
+    /*
+     * Returns the instance (NULL if there is none) and marks it as used,
+     * without closing idle instances first.
+     */
+    lcb_t
+    findInstance(const String&);
 
   public:
     InstanceMap();
+
+    const MemoryAccount_t&
+    getMemory() const { return theMemory; }
     
     bool
     storeInstance(const String&, lcb_t);
@@ -355,9 +1292,30 @@ class InstanceMap : public ExternalFunctionParameter
     lcb_t
     getInstance(const String&);
 
+    bool
+    storeSharded(const String&, const std::vector<String>& aIds, const std::shared_ptr<const ShardRing>& aRing);
+
+    bool
+    isSharded(const String&) const;
+
+    /*
+     * Sets aShards to the shards of a sharded connection, returns false
+     * if there is no such connection or one of its shards was released.
+     */
+    bool
+    getShards(const String&, ShardSet& aShards);
+
     bool 
     deleteInstance(const String&);
 
+    /*
+     * Closes (without returning them to the pool) the instances that
+     * exceeded their idle timeout. A sharded connection is closed as a
+     * whole once one of its shards is idle.
+     */
+    void
+    releaseIdle();
+
     virtual void
     destroy() throw()
     {
@@ -366,7 +1324,7 @@ class InstanceMap : public ExternalFunctionParameter
         for (InstanceMap_t::const_iterator lIter = instanceMap->begin();
              lIter != instanceMap->end(); ++lIter)
         {
-          lcb_destroy(lIter->second);
+          InstanceData::releaseInstance(lIter->second);
         }
         instanceMap->clear();
         delete instanceMap;
@@ -381,6 +1339,122 @@ class InstanceMap : public ExternalFunctionParameter
 
 class ConnectFunction : public CouchbaseFunction
 {
+  protected:
+    class ConnectOptions
+    {
+      public:
+        //bootstrap hosts separated by ';'
+        String theHost;
+        String theBucket;
+        String theUserName;
+        String thePassword;
+        String theConfigCache;
+        bool theUsePool;
+        //largest timeout in milliseconds, libcouchbase takes the timeouts
+        //as 32 bit microseconds
+        static const unsigned int MAX_TIMEOUT = 4294967;
+
+        //timeouts in milliseconds, 0 keeps the libcouchbase default
+        unsigned int theOperationTimeout;
+        unsigned int theViewTimeout;
+        unsigned int theConnectTimeout;
+        unsigned int theIdleTimeout;
+        std::string theTraceFile;
+        std::string theSlowLog;
+        //-1 if slow operations are not logged
+        long long theSlowThreshold;
+        unsigned int theSlowMaxPerSecond;
+        //memory limits in bytes, 0 for unlimited
+        uint64_t theMemoryLimit;
+        uint64_t theQueryMemoryLimit;
+        RetryPolicy theRetry;
+        //I/O plugin and the name of a shared event loop (empty for none)
+        lcb_io_ops_type_t theIOType;
+        bool theHasIOType;
+        std::string theIOLoop;
+        //only used by connect-sharded, the name defaults to host/bucket
+        std::string theShardName;
+        unsigned int theVirtualNodes;
+
+        ConnectOptions()
+          : theUsePool(true),
+            theOperationTimeout(0),
+            theViewTimeout(0),
+            theConnectTimeout(0),
+            theIdleTimeout(0),
+            theSlowLog("couchbase-slow-ops.log"),
+            theSlowThreshold(-1),
+            theSlowMaxPerSecond(SlowLog::DEFAULT_MAX_PER_SECOND),
+            theMemoryLimit(0),
+            theQueryMemoryLimit(0),
+            theIOType(LCB_IO_OPS_DEFAULT),
+            theHasIOType(false),
+            theVirtualNodes(ShardRing::DEFAULT_VIRTUAL_NODES) {}
+
+        void setOptions(Item& aOptions);
+
+        /*
+         * Key of the instances in the InstancePool, empty if pooling is
+         * disabled.
+         */
+        std::string getPoolKey() const;
+    };
+
+    static InstanceMap*
+      getInstanceMap(const zorba::DynamicContext* aDctx);
+
+    /*
+     * Returns an idle instance from the pool or NULL.
+     */
+    static lcb_t
+      acquireInstance(const ConnectOptions& aOptions);
+
+    /*
+     * Creates an instance and starts its bootstrap. Instances created with
+     * the same aIO (or the same "io-loop" option) share an event loop and
+     * are not pooled.
+     */
+    static lcb_t
+      createInstance(const ConnectOptions& aOptions, IOLoop_t aIO);
+
+    /*
+     * Opens the "trace-file" of the options, raises CB0014 if that fails.
+     */
+    static TraceFile_t
+      openTrace(const ConnectOptions& aOptions);
+
+    /*
+     * Opens the "slow-op-log" of the options if slow operations are
+     * logged, raises CB0014 if that fails.
+     */
+    static SlowLog_t
+      openSlowLog(const ConnectOptions& aOptions);
+
+    static void
+      setSlowLog(InstanceData* aData, const ConnectOptions& aOptions, const SlowLog_t& aLog);
+
+    /*
+     * Waits for the bootstrap of aInstance to finish.
+     */
+    static bool
+      isConnected(lcb_t aInstance);
+
+    /*
+     * Connects to several buckets, bootstrapping them concurrently on one
+     * event loop per I/O plugin. With aUsePool pooled instances are taken
+     * if available, otherwise all instances share the loop afterwards. All
+     * instances are released if one of them fails.
+     */
+    static void
+      connectAll(const std::vector<ConnectOptions>& aOptions, bool aUsePool, std::vector<lcb_t>& aInstances);
+
+    /*
+     * Stores aInstance in the map of the query and applies the
+     * "query-memory-limit" of the options.
+     */
+    Item
+      storeInstance(InstanceMap* aInstanceMap, lcb_t aInstance, const ConnectOptions& aOptions) const;
+
   public:
     ConnectFunction(const CouchbaseModule* aModule)
       : CouchbaseFunction(aModule) {}
@@ -396,6 +1470,46 @@ class ConnectFunction : public CouchbaseFunction
                 const zorba::DynamicContext*) const;
 };
 
+/*******************************************************************************
+ ******************************************************************************/
+
+class ConnectAllFunction : public ConnectFunction
+{
+  public:
+    ConnectAllFunction(const CouchbaseModule* aModule)
+      : ConnectFunction(aModule) {}
+
+    virtual ~ConnectAllFunction(){}
+
+    virtual zorba::String
+      getLocalName() const { return "connect-all"; }
+
+    virtual zorba::ItemSequence_t
+      evaluate( const Arguments_t&,
+                const zorba::StaticContext*,
+                const zorba::DynamicContext*) const;
+};
+
+/*******************************************************************************
+ ******************************************************************************/
+
+class ConnectShardedFunction : public ConnectFunction
+{
+  public:
+    ConnectShardedFunction(const CouchbaseModule* aModule)
+      : ConnectFunction(aModule) {}
+
+    virtual ~ConnectShardedFunction(){}
+
+    virtual zorba::String
+      getLocalName() const { return "connect-sharded"; }
+
+    virtual zorba::ItemSequence_t
+      evaluate( const Arguments_t&,
+                const zorba::StaticContext*,
+                const zorba::DynamicContext*) const;
+};
+
 /*******************************************************************************
  ******************************************************************************/
 
@@ -466,6 +1580,66 @@ class RemoveFunction : public CouchbaseFunction
                 const zorba::DynamicContext*) const;
 };
 
+/*******************************************************************************
+ ******************************************************************************/
+
+class DisconnectFunction : public CouchbaseFunction
+{
+  public:
+    DisconnectFunction(const CouchbaseModule* aModule)
+      : CouchbaseFunction(aModule) {}
+
+    virtual ~DisconnectFunction(){}
+
+    virtual zorba::String
+      getLocalName() const { return "disconnect"; }
+
+    virtual zorba::ItemSequence_t
+      evaluate( const Arguments_t&,
+                const zorba::StaticContext*,
+                const zorba::DynamicContext*) const;
+};
+
+/*******************************************************************************
+ ******************************************************************************/
+
+class StatsFunction : public CouchbaseFunction
+{
+  public:
+    StatsFunction(const CouchbaseModule* aModule)
+      : CouchbaseFunction(aModule) {}
+
+    virtual ~StatsFunction(){}
+
+    virtual zorba::String
+      getLocalName() const { return "stats"; }
+
+    virtual zorba::ItemSequence_t
+      evaluate( const Arguments_t&,
+                const zorba::StaticContext*,
+                const zorba::DynamicContext*) const;
+};
+
+/*******************************************************************************
+ ******************************************************************************/
+
+class ResetStatsFunction : public CouchbaseFunction
+{
+  public:
+    ResetStatsFunction(const CouchbaseModule* aModule)
+      : CouchbaseFunction(aModule) {}
+
+    virtual ~ResetStatsFunction(){}
+
+    virtual zorba::String
+      getLocalName() const { return "reset-stats"; }
+
+    virtual zorba::ItemSequence_t
+      evaluate( const Arguments_t&,
+                const zorba::StaticContext*,
+                const zorba::DynamicContext*) const;
+};
+
 /*******************************************************************************
  ******************************************************************************/
 
@@ -486,6 +1660,46 @@ class PutTextFunction : public CouchbaseFunction
                 const zorba::DynamicContext*) const;
 };
 
+/*******************************************************************************
+ ******************************************************************************/
+
+class GetJsonFunction : public CouchbaseFunction
+{
+  public:
+    GetJsonFunction(const CouchbaseModule* aModule)
+      : CouchbaseFunction(aModule) {}
+
+    virtual ~GetJsonFunction(){}
+
+    virtual zorba::String
+      getLocalName() const { return "get-json"; }
+
+    virtual zorba::ItemSequence_t
+      evaluate( const Arguments_t&,
+                const zorba::StaticContext*,
+                const zorba::DynamicContext*) const;
+};
+
+/*******************************************************************************
+ ******************************************************************************/
+
+class GetXmlFunction : public CouchbaseFunction
+{
+  public:
+    GetXmlFunction(const CouchbaseModule* aModule)
+      : CouchbaseFunction(aModule) {}
+
+    virtual ~GetXmlFunction(){}
+
+    virtual zorba::String
+      getLocalName() const { return "get-xml"; }
+
+    virtual zorba::ItemSequence_t
+      evaluate( const Arguments_t&,
+                const zorba::StaticContext*,
+                const zorba::DynamicContext*) const;
+};
+
 /*******************************************************************************
  ******************************************************************************/
 
@@ -506,6 +1720,26 @@ class PutBinaryFunction : public CouchbaseFunction
                 const zorba::DynamicContext*) const;
 };
 
+/*******************************************************************************
+ ******************************************************************************/
+
+class PutXmlFunction : public CouchbaseFunction
+{
+  public:
+    PutXmlFunction(const CouchbaseModule* aModule)
+      : CouchbaseFunction(aModule) {}
+
+    virtual ~PutXmlFunction(){}
+
+    virtual zorba::String
+      getLocalName() const { return "put-xml"; }
+
+    virtual zorba::ItemSequence_t
+      evaluate( const Arguments_t&,
+                const zorba::StaticContext*,
+                const zorba::DynamicContext*) const;
+};
+
 /*******************************************************************************
  ******************************************************************************/
 
@@ -546,6 +1780,120 @@ class TouchFunction : public CouchbaseFunction
                 const zorba::DynamicContext*) const;
 };
 
+/*******************************************************************************
+ ******************************************************************************/
+
+class CopyFunction : public CouchbaseFunction
+{
+  protected:
+    class CopyOptions
+    {
+      protected:
+        lcb_storage_t theOperation;
+        unsigned int theExpTime;
+        Deadline theDeadline;
+
+      public:
+        CopyOptions() : theOperation(LCB_SET), theExpTime(0) {}
+
+        void setOptions(Item& aOptions);
+
+        lcb_storage_t getOperation() const { return theOperation; }
+
+        unsigned int getExpTime() const { return theExpTime; }
+
+        const Deadline& getDeadline() const { return theDeadline; }
+    };
+
+    /*
+     * The gets of a batch of keys from one instance of the source; the
+     * values are kept as raw bytes with their flags.
+     */
+    class CopyBatch : public NodeScheduler
+    {
+      protected:
+        MemoryCharge theMemory;
+
+        void
+          send(const std::vector<size_t>& aCommands);
+
+        static void
+          get_callback(lcb_t instance, const void *cookie, lcb_error_t error, const lcb_get_resp_t *resp);
+
+      public:
+        std::vector<std::string> theValues;
+        std::vector<lcb_uint32_t> theFlags;
+        //false for the keys that don't exist in the source
+        std::vector<bool> theFound;
+        bool theIsOverLimit;
+
+        CopyBatch(lcb_t aInstance)
+          : NodeScheduler(aInstance), theMemory(aInstance), theIsOverLimit(false)
+        {
+          theOperation.theGetCallback = get_callback;
+        }
+
+        size_t
+          add(const String& aKey);
+
+        void
+          clear();
+    };
+
+    /*
+     * One stage of the pipeline: the gets of a batch of keys on every
+     * instance of the source and the instance and command of each key.
+     * Two stages alternate, the gets of the next batch are sent before
+     * waiting for the stores of the current one.
+     */
+    class CopyStage
+    {
+      public:
+        const ShardSet& theSource;
+        std::vector<std::unique_ptr<CopyBatch> > theBatches;
+        std::vector<std::pair<size_t, size_t> > theOrder;
+
+        CopyStage(const ShardSet& aSource);
+
+        /*
+         * Reads the next batch of keys and sends its first windows,
+         * returns false if there are no keys left.
+         */
+        bool
+          start(Iterator_t& aKeys);
+
+        /*
+         * Waits for the gets, raises CB0015 if a value exceeded the memory
+         * limit.
+         */
+        void
+          finish(const Deadline& aDeadline);
+
+        /*
+         * Waits for the gets in flight without raising their failures.
+         */
+        void
+          cancel();
+
+        void
+          clear();
+    };
+
+  public:
+    CopyFunction(const CouchbaseModule* aModule)
+      : CouchbaseFunction(aModule) {}
+
+    virtual ~CopyFunction(){}
+
+    virtual zorba::String
+      getLocalName() const { return "copy"; }
+
+    virtual zorba::ItemSequence_t
+      evaluate( const Arguments_t&,
+                const zorba::StaticContext*,
+                const zorba::DynamicContext*) const;
+};
+
 /*******************************************************************************
  ******************************************************************************/
 
@@ -572,6 +1920,15 @@ class ViewFunction : public CouchbaseFunction
 class CreateViewFunction : public CouchbaseFunction
 {
   private:
+    class DesignDocument
+    {
+      public:
+        int theStatus;
+        std::string theBody;
+
+        DesignDocument() : theStatus(0) {}
+    };
+
     static void create_view_callback(
       lcb_http_request_t request, 
       lcb_t instance, 
@@ -579,6 +1936,43 @@ class CreateViewFunction : public CouchbaseFunction
       lcb_error_t error, 
       const lcb_http_resp_t* resp);
 
+    static void design_doc_callback(
+      lcb_http_request_t request, 
+      lcb_t instance, 
+      const void* cookie, 
+      lcb_error_t error, 
+      const lcb_http_resp_t* resp);
+
+    /*
+     * Returns true if the design document at aPath already holds the
+     * views of aBody, in which case it doesn't need to be published.
+     */
+    static bool
+      isPublished(lcb_t aInstance, const String& aPath, const String& aBody);
+
+  protected:
+    /*
+     * Returns the body of the design document aDocName holding the views
+     * aViewNames, built with aOptions (one object per view) if given.
+     * The paths of the views are appended to aPaths.
+     */
+    static String
+      buildDesignDocument(
+        const String& aDocName,
+        Iterator_t aViewNames,
+        Iterator_t aOptions,
+        std::vector<Item>& aPaths);
+
+    /*
+     * Builds the design document from the arguments and publishes it
+     * unless it is unchanged. Returns true if it was published.
+     */
+    bool
+      createViews(
+        const Arguments_t& aArgs,
+        const zorba::DynamicContext* aDctx,
+        std::vector<Item>& aResult) const;
+
   public:
     CreateViewFunction(const CouchbaseModule* aModule)
       : CouchbaseFunction(aModule) {}
@@ -594,6 +1988,70 @@ class CreateViewFunction : public CouchbaseFunction
                 const zorba::DynamicContext*) const;
 };
 
+/*******************************************************************************
+ ******************************************************************************/
+
+class PublishViewFunction : public CreateViewFunction
+{
+  public:
+    PublishViewFunction(const CouchbaseModule* aModule)
+      : CreateViewFunction(aModule) {}
+
+    virtual ~PublishViewFunction(){}
+
+    virtual zorba::String
+      getLocalName() const { return "publish-view"; }
+
+    virtual zorba::ItemSequence_t
+      evaluate( const Arguments_t&,
+                const zorba::StaticContext*,
+                const zorba::DynamicContext*) const;
+};
+
+/*******************************************************************************
+ ******************************************************************************/
+
+class WaitForIndexFunction : public CouchbaseFunction
+{
+  private:
+    class IndexState
+    {
+      public:
+        std::set<std::string> thePending;
+        lcb_error_t theError;
+        int theStatus;
+
+        IndexState() : theError(LCB_SUCCESS), theStatus(0) {}
+    };
+
+    static void index_observe_callback(
+      lcb_t instance,
+      const void* cookie,
+      lcb_error_t error,
+      const lcb_observe_resp_t* resp);
+
+    static void index_update_callback(
+      lcb_http_request_t request, 
+      lcb_t instance, 
+      const void* cookie, 
+      lcb_error_t error, 
+      const lcb_http_resp_t* resp);
+
+  public:
+    WaitForIndexFunction(const CouchbaseModule* aModule)
+      : CouchbaseFunction(aModule) {}
+
+    virtual ~WaitForIndexFunction(){}
+
+    virtual zorba::String
+      getLocalName() const { return "wait-for-index"; }
+
+    virtual zorba::ItemSequence_t
+      evaluate( const Arguments_t&,
+                const zorba::StaticContext*,
+                const zorba::DynamicContext*) const;
+};
+
 /*******************************************************************************
  ******************************************************************************/
 
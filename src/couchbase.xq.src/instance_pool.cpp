@@ -0,0 +1,140 @@
+/*
+ * Copyright 2012 The FLWOR Foundation.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "instance_pool.h"
+#include "couchbase.h"
+
+namespace zorba { namespace couchbase {
+
+/*******************************************************************************
+ ******************************************************************************/
+
+const size_t InstancePool::MAX_IDLE_PER_KEY;
+const time_t InstancePool::MAX_IDLE_TIME;
+
+InstancePool&
+InstancePool::getInstance()
+{
+  static InstancePool thePool;
+  return thePool;
+}
+
+InstancePool::~InstancePool()
+{
+  for (EntryMap_t::iterator lIter = theEntries.begin();
+       lIter != theEntries.end(); ++lIter)
+  {
+    for (std::list<Entry>::iterator lEntry = lIter->second.begin();
+         lEntry != lIter->second.end(); ++lEntry)
+    {
+      InstanceData::destroyInstance(lEntry->theInstance);
+    }
+  }
+}
+
+std::string
+InstancePool::getKey(
+  const std::string& aHost,
+  const std::string& aBucket,
+  const std::string& aUser,
+  const std::string& aPassword)
+{
+  std::string lKey;
+  lKey.append(aHost).append(1, '\0');
+  lKey.append(aBucket).append(1, '\0');
+  lKey.append(aUser).append(1, '\0');
+  lKey.append(aPassword);
+  return lKey;
+}
+
+void
+InstancePool::evict(time_t aNow, std::list<lcb_t>& aEvicted)
+{
+  EntryMap_t::iterator lIter = theEntries.begin();
+  while (lIter != theEntries.end())
+  {
+    //the oldest instances are at the front
+    std::list<Entry>& lEntries = lIter->second;
+    while (!lEntries.empty() && lEntries.front().theReleased + MAX_IDLE_TIME < aNow)
+    {
+      aEvicted.push_back(lEntries.front().theInstance);
+      lEntries.pop_front();
+    }
+    if (lEntries.empty())
+      theEntries.erase(lIter++);
+    else
+      ++lIter;
+  }
+}
+
+lcb_t
+InstancePool::acquire(const std::string& aKey)
+{
+  lcb_t lInstance = NULL;
+  std::list<lcb_t> lEvicted;
+  {
+    std::lock_guard<std::mutex> lLock(theMutex);
+    evict(time(NULL), lEvicted);
+
+    EntryMap_t::iterator lIter = theEntries.find(aKey);
+    if (lIter != theEntries.end())
+    {
+      //the most recently used instance is the most likely to be healthy
+      lInstance = lIter->second.back().theInstance;
+      lIter->second.pop_back();
+      if (lIter->second.empty())
+        theEntries.erase(lIter);
+    }
+  }
+
+  for (std::list<lcb_t>::iterator lIter = lEvicted.begin();
+       lIter != lEvicted.end(); ++lIter)
+  {
+    InstanceData::destroyInstance(*lIter);
+  }
+  return lInstance;
+}
+
+void
+InstancePool::release(const std::string& aKey, lcb_t aInstance)
+{
+  std::list<lcb_t> lEvicted;
+  {
+    std::lock_guard<std::mutex> lLock(theMutex);
+    time_t lNow = time(NULL);
+    evict(lNow, lEvicted);
+
+    std::list<Entry>& lEntries = theEntries[aKey];
+    if (lEntries.size() < MAX_IDLE_PER_KEY)
+    {
+      Entry lEntry;
+      lEntry.theInstance = aInstance;
+      lEntry.theReleased = lNow;
+      lEntries.push_back(lEntry);
+      aInstance = NULL;
+    }
+  }
+
+  if (aInstance)
+    lEvicted.push_back(aInstance);
+  for (std::list<lcb_t>::iterator lIter = lEvicted.begin();
+       lIter != lEvicted.end(); ++lIter)
+  {
+    InstanceData::destroyInstance(*lIter);
+  }
+}
+
+} /*namespace couchbase*/ } /*namespace zorba*/
@@ -0,0 +1,91 @@
+/*
+ * Copyright 2012 The FLWOR Foundation.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _COM_ZORBA_WWW_MODULES_COUCHBASE_INSTANCE_POOL_H_
+#define _COM_ZORBA_WWW_MODULES_COUCHBASE_INSTANCE_POOL_H_
+
+#include <ctime>
+#include <list>
+#include <map>
+#include <mutex>
+#include <string>
+
+#include <libcouchbase/couchbase.h>
+
+namespace zorba { namespace couchbase {
+
+/*******************************************************************************
+ * Process wide pool of bootstrapped instances, keyed by host, bucket and
+ * credentials. Instances of a dynamic context are returned to the pool
+ * when the context is destroyed so that later queries don't pay for the
+ * cluster bootstrap again. Instances idle for longer than MAX_IDLE_TIME
+ * seconds are destroyed, as are instances returned while the pool already
+ * holds MAX_IDLE_PER_KEY instances of the same key.
+ ******************************************************************************/
+
+class InstancePool
+{
+  public:
+    static const size_t MAX_IDLE_PER_KEY = 8;
+    static const time_t MAX_IDLE_TIME = 60;
+
+  protected:
+    class Entry
+    {
+      public:
+        lcb_t theInstance;
+        time_t theReleased;
+    };
+
+    typedef std::map<std::string, std::list<Entry> > EntryMap_t;
+
+    EntryMap_t theEntries;
+    std::mutex theMutex;
+
+    InstancePool() {}
+
+    ~InstancePool();
+
+    void
+      evict(time_t aNow, std::list<lcb_t>& aEvicted);
+
+  public:
+    static InstancePool&
+      getInstance();
+
+    static std::string
+      getKey(
+        const std::string& aHost,
+        const std::string& aBucket,
+        const std::string& aUser,
+        const std::string& aPassword);
+
+    /*
+     * Returns an idle instance for aKey or NULL if there is none.
+     */
+    lcb_t
+      acquire(const std::string& aKey);
+
+    /*
+     * Gives an instance that is not used anymore back to the pool.
+     */
+    void
+      release(const std::string& aKey, lcb_t aInstance);
+};
+
+} /*namespace couchbase*/ } /*namespace zorba*/
+
+#endif //_COM_ZORBA_WWW_MODULES_COUCHBASE_INSTANCE_POOL_H_
@@ -0,0 +1,90 @@
+/*
+ * Copyright 2012 The FLWOR Foundation.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <cstring>
+
+#include "io_loop.h"
+
+namespace zorba { namespace couchbase {
+
+/*******************************************************************************
+ ******************************************************************************/
+
+IOLoops&
+IOLoops::getInstance()
+{
+  static IOLoops theLoops;
+  return theLoops;
+}
+
+bool
+IOLoops::getType(const std::string& aName, lcb_io_ops_type_t& aType)
+{
+  if (aName == "default")
+    aType = LCB_IO_OPS_DEFAULT;
+  else if (aName == "select")
+    aType = LCB_IO_OPS_SELECT;
+  else if (aName == "libevent")
+    aType = LCB_IO_OPS_LIBEVENT;
+  else if (aName == "libev")
+    aType = LCB_IO_OPS_LIBEV;
+  else
+    return false;
+  return true;
+}
+
+IOLoop_t
+IOLoops::create(lcb_io_ops_type_t aType)
+{
+  struct lcb_create_io_ops_st lOptions;
+  memset(&lOptions, 0, sizeof(lOptions));
+  lOptions.version = 0;
+  lOptions.v.v0.type = aType;
+
+  lcb_io_opt_t lIO;
+  if (lcb_create_io_ops(&lIO, &lOptions) != LCB_SUCCESS)
+    return IOLoop_t();
+  return IOLoop_t(lIO, lcb_destroy_io_ops);
+}
+
+IOLoop_t
+IOLoops::getShared(const std::string& aName, lcb_io_ops_type_t aType)
+{
+  LoopKey_t lKey(std::this_thread::get_id(), aName);
+  std::lock_guard<std::mutex> lLock(theMutex);
+
+  IOLoop_t lLoop = theLoops[lKey].lock();
+  if (!lLoop)
+  {
+    lLoop = create(aType);
+    if (lLoop)
+      theLoops[lKey] = lLoop;
+    else
+      theLoops.erase(lKey);
+  }
+
+  //forget the loops that were destroyed in the meantime
+  for (LoopMap_t::iterator lIter = theLoops.begin(); lIter != theLoops.end(); )
+  {
+    if (lIter->second.expired())
+      theLoops.erase(lIter++);
+    else
+      ++lIter;
+  }
+  return lLoop;
+}
+
+} /*namespace couchbase*/ } /*namespace zorba*/
@@ -0,0 +1,81 @@
+/*
+ * Copyright 2012 The FLWOR Foundation.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _COM_ZORBA_WWW_MODULES_COUCHBASE_IO_LOOP_H_
+#define _COM_ZORBA_WWW_MODULES_COUCHBASE_IO_LOOP_H_
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+
+#include <libcouchbase/couchbase.h>
+
+namespace zorba { namespace couchbase {
+
+/*******************************************************************************
+ * Event loops (libcouchbase I/O plugins) that can be shared by several
+ * instances. Any lcb_wait on one of the instances of a loop also drives the
+ * pending operations of all others, so work on several connections
+ * overlaps. libcouchbase instances are not thread safe, hence shared loops
+ * are registered per thread: instances of different threads never share a
+ * loop. A loop is destroyed together with the last instance using it.
+ ******************************************************************************/
+
+typedef std::shared_ptr<lcb_io_opt_st> IOLoop_t;
+
+class IOLoops
+{
+  protected:
+    typedef std::pair<std::thread::id, std::string> LoopKey_t;
+    typedef std::map<LoopKey_t, std::weak_ptr<lcb_io_opt_st> > LoopMap_t;
+
+    LoopMap_t theLoops;
+    std::mutex theMutex;
+
+    IOLoops() {}
+
+  public:
+    static IOLoops&
+      getInstance();
+
+    /*
+     * Maps the name of a plugin ("default", "select", "libevent" or
+     * "libev") to its type, returns false if the name is unknown.
+     */
+    static bool
+      getType(const std::string& aName, lcb_io_ops_type_t& aType);
+
+    /*
+     * Creates a new loop with the given plugin, returns an empty
+     * pointer if the plugin is not available.
+     */
+    static IOLoop_t
+      create(lcb_io_ops_type_t aType);
+
+    /*
+     * Returns the loop registered with aName for the calling thread,
+     * creating it with the given plugin if there is none.
+     */
+    IOLoop_t
+      getShared(const std::string& aName, lcb_io_ops_type_t aType);
+};
+
+} /*namespace couchbase*/ } /*namespace zorba*/
+
+#endif //_COM_ZORBA_WWW_MODULES_COUCHBASE_IO_LOOP_H_
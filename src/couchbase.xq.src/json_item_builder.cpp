@@ -0,0 +1,370 @@
+/*
+ * Copyright 2012 The FLWOR Foundation.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <cctype>
+#include <cstring>
+
+#include <zorba/item_factory.h>
+
+#include "json_item_builder.h"
+#include "json_utils.h"
+
+namespace zorba { namespace couchbase {
+
+/*******************************************************************************
+ ******************************************************************************/
+
+const unsigned int JSONItemBuilder::MAX_DEPTH;
+
+static ItemFactory*
+getFactory()
+{
+  return Zorba::getInstance(0)->getItemFactory();
+}
+
+static bool
+isLiteral(char c)
+{
+  return isalnum((unsigned char)c) || c == '-' || c == '+' || c == '.';
+}
+
+const JSONItemBuilder::PathNode::Member_t*
+JSONItemBuilder::PathNode::find(const char* aName, size_t aLen) const
+{
+  for (size_t i = 0; i < theMembers.size(); ++i)
+  {
+    const std::string& lName = theMembers[i].first;
+    if (lName.size() == aLen && memcmp(lName.data(), aName, aLen) == 0)
+      return &theMembers[i];
+  }
+  return NULL;
+}
+
+void
+JSONItemBuilder::Cursor::skipSpace()
+{
+  while (thePos < theLen && isspace((unsigned char)theData[thePos]))
+    ++thePos;
+}
+
+bool
+JSONItemBuilder::Cursor::scanString(bool& aHasEscape)
+{
+  //thePos is on the opening quote and ends up on the closing one
+  aHasEscape = false;
+  for (++thePos; thePos < theLen; ++thePos)
+  {
+    char c = theData[thePos];
+    if (c == '\\')
+    {
+      aHasEscape = true;
+      ++thePos;
+    }
+    else if (c == '"')
+      return true;
+  }
+  return false;
+}
+
+bool
+JSONItemBuilder::Cursor::skipValue()
+{
+  skipSpace();
+  if (thePos == theLen)
+    return false;
+
+  char c = theData[thePos];
+  bool lHasEscape;
+  if (c == '"')
+  {
+    if (!scanString(lHasEscape))
+      return false;
+    ++thePos;
+    return true;
+  }
+  if (c != '{' && c != '[')
+  {
+    size_t lStart = thePos;
+    while (thePos < theLen && isLiteral(theData[thePos]))
+      ++thePos;
+    return thePos > lStart;
+  }
+
+  //containers are only checked for balanced brackets
+  unsigned int lDepth = 0;
+  for (; thePos < theLen; ++thePos)
+  {
+    c = theData[thePos];
+    if (c == '"')
+    {
+      if (!scanString(lHasEscape))
+        return false;
+    }
+    else if (c == '{' || c == '[')
+      ++lDepth;
+    else if ((c == '}' || c == ']') && --lDepth == 0)
+    {
+      ++thePos;
+      return true;
+    }
+  }
+  return false;
+}
+
+/*******************************************************************************
+ ******************************************************************************/
+
+void
+JSONItemBuilder::addPath(const std::string& aPath)
+{
+  theIsProjected = true;
+  PathNode* lNode = &theRoot;
+  size_t lStart = 0;
+  while (true)
+  {
+    size_t lEnd = aPath.find('.', lStart);
+    std::string lName = aPath.substr(lStart, lEnd == std::string::npos ? std::string::npos : lEnd - lStart);
+
+    PathNode::Member_t* lMember = const_cast<PathNode::Member_t*>(lNode->find(lName.data(), lName.size()));
+    if (!lMember)
+    {
+      lNode->theMembers.push_back(std::make_pair(lName, PathNode()));
+      lMember = &lNode->theMembers.back();
+    }
+    lNode = &lMember->second;
+    if (lEnd == std::string::npos)
+      break;
+    lStart = lEnd + 1;
+  }
+  lNode->theIsSelected = true;
+}
+
+bool
+JSONItemBuilder::buildValue(Cursor& aCursor, Item& aResult)
+{
+  aCursor.skipSpace();
+  if (aCursor.thePos == aCursor.theLen || aCursor.theDepth > MAX_DEPTH)
+    return false;
+
+  ItemFactory* lFactory = getFactory();
+  const char* lData = aCursor.theData;
+  char c = lData[aCursor.thePos];
+  if (c == '"')
+  {
+    size_t lStart = aCursor.thePos + 1;
+    bool lHasEscape;
+    if (!aCursor.scanString(lHasEscape))
+      return false;
+    size_t lLen = aCursor.thePos - lStart;
+    ++aCursor.thePos;
+    if (lHasEscape)
+      aResult = lFactory->createString(JSONUtils::unescape(lData + lStart, lLen));
+    else
+      aResult = lFactory->createString(String(lData + lStart, lLen));
+    return true;
+  }
+  if (c == '{' || c == '[')
+  {
+    bool lIsObject = (c == '{');
+    char lEnd = lIsObject ? '}' : ']';
+    std::vector<std::pair<Item, Item> > lMembers;
+    std::vector<Item> lItems;
+    ++aCursor.theDepth;
+    ++aCursor.thePos;
+    aCursor.skipSpace();
+    if (aCursor.thePos < aCursor.theLen && lData[aCursor.thePos] == lEnd)
+    {
+      ++aCursor.thePos;
+    }
+    else
+    {
+      while (true)
+      {
+        Item lValue;
+        if (lIsObject)
+        {
+          Item lName;
+          aCursor.skipSpace();
+          if (aCursor.thePos == aCursor.theLen || lData[aCursor.thePos] != '"'
+              || !buildValue(aCursor, lName))
+            return false;
+          aCursor.skipSpace();
+          if (aCursor.thePos == aCursor.theLen || lData[aCursor.thePos++] != ':'
+              || !buildValue(aCursor, lValue))
+            return false;
+          lMembers.push_back(std::make_pair(lName, lValue));
+        }
+        else
+        {
+          if (!buildValue(aCursor, lValue))
+            return false;
+          lItems.push_back(lValue);
+        }
+        aCursor.skipSpace();
+        if (aCursor.thePos == aCursor.theLen)
+          return false;
+        c = lData[aCursor.thePos++];
+        if (c == lEnd)
+          break;
+        if (c != ',')
+          return false;
+      }
+    }
+    --aCursor.theDepth;
+    aResult = lIsObject ? lFactory->createJSONObject(lMembers) : lFactory->createJSONArray(lItems);
+    return true;
+  }
+
+  size_t lStart = aCursor.thePos;
+  bool lIsDecimal = false;
+  bool lIsDouble = false;
+  while (aCursor.thePos < aCursor.theLen && isLiteral(lData[aCursor.thePos]))
+  {
+    c = lData[aCursor.thePos++];
+    if (c == '.')
+      lIsDecimal = true;
+    else if (c == 'e' || c == 'E')
+      lIsDouble = true;
+  }
+  String lLiteral(lData + lStart, aCursor.thePos - lStart);
+  if (lLiteral == "null")
+    aResult = lFactory->createJSONNull();
+  else if (lLiteral == "true" || lLiteral == "false")
+    aResult = lFactory->createBoolean(lLiteral == "true");
+  else if (lLiteral.empty() || (lData[lStart] != '-' && !isdigit((unsigned char)lData[lStart])))
+    return false;
+  else if (lIsDouble)
+    aResult = lFactory->createDouble(lLiteral);
+  else if (lIsDecimal)
+    aResult = lFactory->createDecimal(lLiteral);
+  else
+    aResult = lFactory->createInteger(lLiteral);
+  return !aResult.isNull();
+}
+
+bool
+JSONItemBuilder::projectObject(Cursor& aCursor, const PathNode& aNode, Item& aResult, bool& aIsFound)
+{
+  //aCursor is on the opening brace
+  const char* lData = aCursor.theData;
+  std::vector<std::pair<Item, Item> > lMembers;
+  ++aCursor.thePos;
+  aCursor.skipSpace();
+  if (aCursor.thePos < aCursor.theLen && lData[aCursor.thePos] == '}')
+  {
+    ++aCursor.thePos;
+  }
+  else
+  {
+    while (true)
+    {
+      aCursor.skipSpace();
+      if (aCursor.thePos == aCursor.theLen || lData[aCursor.thePos] != '"')
+        return false;
+      size_t lStart = aCursor.thePos + 1;
+      bool lHasEscape;
+      if (!aCursor.scanString(lHasEscape))
+        return false;
+      size_t lLen = aCursor.thePos - lStart;
+      ++aCursor.thePos;
+
+      const PathNode::Member_t* lMember;
+      if (lHasEscape)
+      {
+        std::string lName = JSONUtils::unescape(lData + lStart, lLen);
+        lMember = aNode.find(lName.data(), lName.size());
+      }
+      else
+      {
+        lMember = aNode.find(lData + lStart, lLen);
+      }
+      const PathNode* lChild = lMember ? &lMember->second : NULL;
+
+      aCursor.skipSpace();
+      if (aCursor.thePos == aCursor.theLen || lData[aCursor.thePos++] != ':')
+        return false;
+      aCursor.skipSpace();
+
+      Item lValue;
+      bool lIsFound = false;
+      if (lChild && lChild->theIsSelected)
+      {
+        if (!buildValue(aCursor, lValue))
+          return false;
+        lIsFound = true;
+      }
+      else if (lChild && aCursor.thePos < aCursor.theLen && lData[aCursor.thePos] == '{')
+      {
+        if (aCursor.theDepth++ > MAX_DEPTH || !projectObject(aCursor, *lChild, lValue, lIsFound))
+          return false;
+        --aCursor.theDepth;
+      }
+      else if (!aCursor.skipValue())
+      {
+        return false;
+      }
+
+      //objects on the way to missing members are left out
+      if (lIsFound)
+        lMembers.push_back(std::make_pair(getFactory()->createString(lMember->first), lValue));
+
+      aCursor.skipSpace();
+      if (aCursor.thePos == aCursor.theLen)
+        return false;
+      char c = lData[aCursor.thePos++];
+      if (c == '}')
+        break;
+      if (c != ',')
+        return false;
+    }
+  }
+  aIsFound = !lMembers.empty();
+  aResult = getFactory()->createJSONObject(lMembers);
+  return true;
+}
+
+bool
+JSONItemBuilder::build(const char* aData, size_t aLen, Item& aResult) const
+{
+  Cursor lCursor(aData, aLen);
+  bool lIsValid;
+  if (!theIsProjected)
+  {
+    lIsValid = buildValue(lCursor, aResult);
+  }
+  else
+  {
+    lCursor.skipSpace();
+    if (lCursor.thePos < lCursor.theLen && aData[lCursor.thePos] == '{')
+    {
+      bool lIsFound;
+      lIsValid = projectObject(lCursor, theRoot, aResult, lIsFound);
+    }
+    else
+    {
+      //other values have no members to select
+      std::vector<std::pair<Item, Item> > lNoMembers;
+      lIsValid = lCursor.skipValue();
+      aResult = getFactory()->createJSONObject(lNoMembers);
+    }
+  }
+  if (!lIsValid)
+    return false;
+  lCursor.skipSpace();
+  return lCursor.thePos == lCursor.theLen;
+}
+
+} /*namespace couchbase*/ } /*namespace zorba*/
@@ -0,0 +1,110 @@
+/*
+ * Copyright 2012 The FLWOR Foundation.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _COM_ZORBA_WWW_MODULES_COUCHBASE_JSON_ITEM_BUILDER_H_
+#define _COM_ZORBA_WWW_MODULES_COUCHBASE_JSON_ITEM_BUILDER_H_
+
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <zorba/zorba.h>
+
+namespace zorba { namespace couchbase {
+
+/*******************************************************************************
+ * Builds the items of a JSON value directly from the raw bytes returned by
+ * the server. If paths were added ("a.b" selects member b of the object in
+ * member a), only the selected members are built, together with the
+ * objects leading to them, and everything else is skipped without
+ * allocating. Paths only descend into objects; a selected array or object
+ * is built as a whole.
+ ******************************************************************************/
+
+class JSONItemBuilder
+{
+  public:
+    static const unsigned int MAX_DEPTH = 512;
+
+  protected:
+    class PathNode
+    {
+      public:
+        typedef std::pair<std::string, PathNode> Member_t;
+
+        std::vector<Member_t> theMembers;
+        bool theIsSelected;
+
+        PathNode() : theIsSelected(false) {}
+
+        const Member_t*
+          find(const char* aName, size_t aLen) const;
+    };
+
+    class Cursor
+    {
+      public:
+        const char* theData;
+        size_t theLen;
+        size_t thePos;
+        unsigned int theDepth;
+
+        Cursor(const char* aData, size_t aLen)
+          : theData(aData), theLen(aLen), thePos(0), theDepth(0) {}
+
+        void
+          skipSpace();
+
+        bool
+          scanString(bool& aHasEscape);
+
+        bool
+          skipValue();
+    };
+
+    PathNode theRoot;
+    bool theIsProjected;
+
+    static bool
+      buildValue(Cursor& aCursor, Item& aResult);
+
+    static bool
+      projectObject(Cursor& aCursor, const PathNode& aNode, Item& aResult, bool& aIsFound);
+
+  public:
+    JSONItemBuilder() : theIsProjected(false) {}
+
+    /*
+     * Selects the member at the dot separated aPath.
+     */
+    void
+      addPath(const std::string& aPath);
+
+    bool
+      isProjected() const { return theIsProjected; }
+
+    /*
+     * Builds the value (or with paths, an object holding the selected
+     * members) of aData. Returns false if aData is not valid JSON as far
+     * as it was read.
+     */
+    bool
+      build(const char* aData, size_t aLen, Item& aResult) const;
+};
+
+} /*namespace couchbase*/ } /*namespace zorba*/
+
+#endif //_COM_ZORBA_WWW_MODULES_COUCHBASE_JSON_ITEM_BUILDER_H_
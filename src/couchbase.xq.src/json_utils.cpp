@@ -0,0 +1,446 @@
+/*
+ * Copyright 2012 The FLWOR Foundation.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <algorithm>
+#include <cctype>
+#include <cstdio>
+#include <cstdlib>
+
+#include "json_utils.h"
+
+namespace zorba { namespace couchbase {
+
+/*******************************************************************************
+ ******************************************************************************/
+
+void
+JSONUtils::appendString(std::string& aOut, const char* aData, size_t aLen)
+{
+  aOut.reserve(aOut.size() + aLen + 2);
+  aOut += '"';
+  for (size_t i = 0; i < aLen; ++i)
+  {
+    unsigned char c = aData[i];
+    switch (c)
+    {
+      case '"':  aOut += "\\\""; break;
+      case '\\': aOut += "\\\\"; break;
+      case '\b': aOut += "\\b"; break;
+      case '\f': aOut += "\\f"; break;
+      case '\n': aOut += "\\n"; break;
+      case '\r': aOut += "\\r"; break;
+      case '\t': aOut += "\\t"; break;
+      default:
+        if (c < 0x20)
+        {
+          char lBuf[8];
+          sprintf(lBuf, "\\u%04x", c);
+          aOut += lBuf;
+        }
+        else
+        {
+          aOut += (char)c;
+        }
+    }
+  }
+  aOut += '"';
+}
+
+bool
+JSONUtils::isContainer(const char* aData, size_t aLen)
+{
+  size_t i = 0;
+  while (i < aLen && isspace((unsigned char)aData[i]))
+    ++i;
+  if (i == aLen || (aData[i] != '{' && aData[i] != '['))
+    return false;
+
+  int lDepth = 0;
+  bool lInString = false;
+  bool lEscape = false;
+  for (; i < aLen; ++i)
+  {
+    char c = aData[i];
+    if (lInString)
+    {
+      if (lEscape)
+        lEscape = false;
+      else if (c == '\\')
+        lEscape = true;
+      else if (c == '"')
+        lInString = false;
+    }
+    else if (c == '"')
+      lInString = true;
+    else if (c == '{' || c == '[')
+      ++lDepth;
+    else if (c == '}' || c == ']')
+    {
+      if (--lDepth == 0)
+        break;
+    }
+  }
+  if (lDepth != 0 || i == aLen)
+    return false;
+
+  for (++i; i < aLen; ++i)
+  {
+    if (!isspace((unsigned char)aData[i]))
+      return false;
+  }
+  return true;
+}
+
+static void
+appendUTF8(std::string& aOut, unsigned long aCode)
+{
+  if (aCode < 0x80)
+  {
+    aOut += (char)aCode;
+  }
+  else if (aCode < 0x800)
+  {
+    aOut += (char)(0xC0 | (aCode >> 6));
+    aOut += (char)(0x80 | (aCode & 0x3F));
+  }
+  else if (aCode < 0x10000)
+  {
+    aOut += (char)(0xE0 | (aCode >> 12));
+    aOut += (char)(0x80 | ((aCode >> 6) & 0x3F));
+    aOut += (char)(0x80 | (aCode & 0x3F));
+  }
+  else
+  {
+    aOut += (char)(0xF0 | (aCode >> 18));
+    aOut += (char)(0x80 | ((aCode >> 12) & 0x3F));
+    aOut += (char)(0x80 | ((aCode >> 6) & 0x3F));
+    aOut += (char)(0x80 | (aCode & 0x3F));
+  }
+}
+
+std::string
+JSONUtils::unescape(const char* aData, size_t aLen)
+{
+  std::string lRes;
+  lRes.reserve(aLen);
+  for (size_t i = 0; i < aLen; ++i)
+  {
+    char c = aData[i];
+    if (c != '\\' || i + 1 == aLen)
+    {
+      lRes += c;
+      continue;
+    }
+    c = aData[++i];
+    switch (c)
+    {
+      case 'b': lRes += '\b'; break;
+      case 'f': lRes += '\f'; break;
+      case 'n': lRes += '\n'; break;
+      case 'r': lRes += '\r'; break;
+      case 't': lRes += '\t'; break;
+      case 'u':
+      {
+        if (i + 4 >= aLen)
+          return lRes;
+        unsigned long lCode = strtoul(std::string(aData + i + 1, 4).c_str(), NULL, 16);
+        i += 4;
+        if (lCode >= 0xD800 && lCode < 0xDC00 && i + 6 < aLen
+            && aData[i + 1] == '\\' && aData[i + 2] == 'u')
+        {
+          unsigned long lLow = strtoul(std::string(aData + i + 3, 4).c_str(), NULL, 16);
+          lCode = 0x10000 + ((lCode - 0xD800) << 10) + (lLow - 0xDC00);
+          i += 6;
+        }
+        appendUTF8(lRes, lCode);
+        break;
+      }
+      default: lRes += c;
+    }
+  }
+  return lRes;
+}
+
+/*******************************************************************************
+ ******************************************************************************/
+
+static void
+skipSpace(const char* aData, size_t aLen, size_t& aPos)
+{
+  while (aPos < aLen && isspace((unsigned char)aData[aPos]))
+    ++aPos;
+}
+
+static bool
+parseString(const char* aData, size_t aLen, size_t& aPos, std::string& aOut)
+{
+  size_t lStart = ++aPos;
+  bool lEscape = false;
+  for (; aPos < aLen; ++aPos)
+  {
+    if (lEscape)
+      lEscape = false;
+    else if (aData[aPos] == '\\')
+      lEscape = true;
+    else if (aData[aPos] == '"')
+    {
+      aOut = JSONUtils::unescape(aData + lStart, aPos - lStart);
+      ++aPos;
+      return true;
+    }
+  }
+  return false;
+}
+
+static bool
+lessMember(const std::pair<std::string, JSONValue>* a, const std::pair<std::string, JSONValue>* b)
+{
+  return a->first < b->first;
+}
+
+bool
+JSONValue::parse(const char* aData, size_t aLen)
+{
+  size_t lPos = 0;
+  if (!parse(aData, aLen, lPos))
+    return false;
+  skipSpace(aData, aLen, lPos);
+  return lPos == aLen;
+}
+
+bool
+JSONValue::parse(const char* aData, size_t aLen, size_t& aPos)
+{
+  theItems.clear();
+  theMembers.clear();
+  skipSpace(aData, aLen, aPos);
+  if (aPos == aLen)
+    return false;
+
+  char c = aData[aPos];
+  if (c == '"')
+  {
+    theKind = JSON_STRING;
+    return parseString(aData, aLen, aPos, theValue);
+  }
+  else if (c == '[' || c == '{')
+  {
+    theKind = (c == '[') ? JSON_ARRAY : JSON_OBJECT;
+    char lEnd = (c == '[') ? ']' : '}';
+    ++aPos;
+    skipSpace(aData, aLen, aPos);
+    if (aPos < aLen && aData[aPos] == lEnd)
+    {
+      ++aPos;
+      return true;
+    }
+    while (aPos < aLen)
+    {
+      if (theKind == JSON_ARRAY)
+      {
+        theItems.push_back(JSONValue());
+        if (!theItems.back().parse(aData, aLen, aPos))
+          return false;
+      }
+      else
+      {
+        skipSpace(aData, aLen, aPos);
+        std::string lName;
+        if (aPos == aLen || aData[aPos] != '"' || !parseString(aData, aLen, aPos, lName))
+          return false;
+        skipSpace(aData, aLen, aPos);
+        if (aPos == aLen || aData[aPos++] != ':')
+          return false;
+        theMembers.push_back(std::make_pair(lName, JSONValue()));
+        if (!theMembers.back().second.parse(aData, aLen, aPos))
+          return false;
+      }
+      skipSpace(aData, aLen, aPos);
+      if (aPos == aLen)
+        return false;
+      if (aData[aPos] == lEnd)
+      {
+        ++aPos;
+        return true;
+      }
+      if (aData[aPos++] != ',')
+        return false;
+    }
+    return false;
+  }
+  else
+  {
+    size_t lStart = aPos;
+    while (aPos < aLen && (isalnum((unsigned char)aData[aPos])
+           || aData[aPos] == '-' || aData[aPos] == '+' || aData[aPos] == '.'))
+      ++aPos;
+    theValue.assign(aData + lStart, aPos - lStart);
+    if (theValue == "null")
+      theKind = JSON_NULL;
+    else if (theValue == "true" || theValue == "false")
+      theKind = JSON_BOOLEAN;
+    else if (!theValue.empty() && (isdigit((unsigned char)c) || c == '-'))
+      theKind = JSON_NUMBER;
+    else
+      return false;
+    return true;
+  }
+}
+
+void
+JSONValue::serializeCanonical(std::string& aOut) const
+{
+  switch (theKind)
+  {
+    case JSON_STRING:
+      JSONUtils::appendString(aOut, theValue.data(), theValue.size());
+      break;
+    case JSON_ARRAY:
+      aOut += '[';
+      for (size_t i = 0; i < theItems.size(); ++i)
+      {
+        if (i > 0)
+          aOut += ',';
+        theItems[i].serializeCanonical(aOut);
+      }
+      aOut += ']';
+      break;
+    case JSON_OBJECT:
+    {
+      std::vector<const std::pair<std::string, JSONValue>*> lSorted;
+      for (size_t i = 0; i < theMembers.size(); ++i)
+        lSorted.push_back(&theMembers[i]);
+      std::sort(lSorted.begin(), lSorted.end(), lessMember);
+
+      aOut += '{';
+      for (size_t i = 0; i < lSorted.size(); ++i)
+      {
+        if (i > 0)
+          aOut += ',';
+        JSONUtils::appendString(aOut, lSorted[i]->first.data(), lSorted[i]->first.size());
+        aOut += ':';
+        lSorted[i]->second.serializeCanonical(aOut);
+      }
+      aOut += '}';
+      break;
+    }
+    default:
+      aOut += theValue;
+  }
+}
+
+const JSONValue*
+JSONValue::getMember(const std::string& aName) const
+{
+  for (size_t i = 0; i < theMembers.size(); ++i)
+  {
+    if (theMembers[i].first == aName)
+      return &theMembers[i].second;
+  }
+  return NULL;
+}
+
+/*******************************************************************************
+ ******************************************************************************/
+
+void
+ViewRowScanner::endString(size_t aEnd)
+{
+  const char* lData = theBuffer.data() + theStringStart;
+  size_t lLen = aEnd - theStringStart;
+  if (theDepth == 1)
+  {
+    theLastTopKey.assign(lData, lLen);
+  }
+  else if (theInRows && theDepth == 3)
+  {
+    if (theExpectKey)
+    {
+      theKey = JSONUtils::unescape(lData, lLen);
+      theExpectKey = false;
+    }
+    else if (theKey == "id")
+    {
+      theRow.theId = JSONUtils::unescape(lData, lLen);
+      theRow.theHasId = true;
+    }
+  }
+}
+
+void
+ViewRowScanner::feed(const char* aData, size_t aLen, std::vector<Row>& aRows)
+{
+  theBuffer.append(aData, aLen);
+  for (; thePos < theBuffer.size(); ++thePos)
+  {
+    char c = theBuffer[thePos];
+    if (theInString)
+    {
+      if (theEscape)
+        theEscape = false;
+      else if (c == '\\')
+        theEscape = true;
+      else if (c == '"')
+      {
+        theInString = false;
+        endString(thePos);
+      }
+      continue;
+    }
+    switch (c)
+    {
+      case '"':
+        theInString = true;
+        theStringStart = thePos + 1;
+        break;
+      case '[':
+        if (theDepth == 1 && theLastTopKey == "rows")
+          theInRows = true;
+        ++theDepth;
+        break;
+      case '{':
+        if (theInRows && theDepth == 2)
+        {
+          theRow = Row();
+          theKey.clear();
+          theExpectKey = true;
+        }
+        ++theDepth;
+        break;
+      case '}':
+        if (theInRows && theDepth == 3)
+        {
+          theRow.theEnd = thePos;
+          aRows.push_back(theRow);
+        }
+        --theDepth;
+        break;
+      case ']':
+        if (theInRows && theDepth == 2)
+          theInRows = false;
+        --theDepth;
+        break;
+      case ',':
+        if (theInRows && theDepth == 3)
+          theExpectKey = true;
+        break;
+      default:
+        break;
+    }
+  }
+}
+
+} /*namespace couchbase*/ } /*namespace zorba*/
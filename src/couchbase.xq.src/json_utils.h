@@ -0,0 +1,158 @@
+/*
+ * Copyright 2012 The FLWOR Foundation.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _COM_ZORBA_WWW_MODULES_COUCHBASE_JSON_UTILS_H_
+#define _COM_ZORBA_WWW_MODULES_COUCHBASE_JSON_UTILS_H_
+
+#include <cstddef>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace zorba { namespace couchbase {
+
+/*******************************************************************************
+ * Small helpers to work on raw JSON bytes as returned by the server without
+ * building Zorba items for them.
+ ******************************************************************************/
+
+class JSONUtils
+{
+  public:
+    /*
+     * Appends aData as a quoted and escaped JSON string to aOut.
+     */
+    static void
+      appendString(std::string& aOut, const char* aData, size_t aLen);
+
+    /*
+     * Returns true if aData holds exactly one JSON object or array
+     * (surrounding whitespace allowed) with balanced brackets.
+     */
+    static bool
+      isContainer(const char* aData, size_t aLen);
+
+    /*
+     * Decodes the escapes of a JSON string body (without the quotes).
+     */
+    static std::string
+      unescape(const char* aData, size_t aLen);
+};
+
+/*******************************************************************************
+ * Minimal JSON tree, used to compare documents independently of whitespace
+ * and member order.
+ ******************************************************************************/
+
+class JSONValue
+{
+  public:
+    typedef enum
+    {
+      JSON_NULL,
+      JSON_BOOLEAN,
+      JSON_NUMBER,
+      JSON_STRING,
+      JSON_ARRAY,
+      JSON_OBJECT
+    } json_kind_t;
+
+    json_kind_t theKind;
+    std::string theValue;
+    std::vector<JSONValue> theItems;
+    std::vector<std::pair<std::string, JSONValue> > theMembers;
+
+    JSONValue() : theKind(JSON_NULL) {}
+
+    /*
+     * Parses aData, returns false if it is not a single JSON value.
+     */
+    bool
+      parse(const char* aData, size_t aLen);
+
+    /*
+     * Writes the value without whitespace and with the members of all
+     * objects sorted by name.
+     */
+    void
+      serializeCanonical(std::string& aOut) const;
+
+    const JSONValue*
+      getMember(const std::string& aName) const;
+
+  protected:
+    bool
+      parse(const char* aData, size_t aLen, size_t& aPos);
+};
+
+/*******************************************************************************
+ * Incremental scanner over the body of a view response
+ * ({"total_rows":..,"rows":[{...},{...}]}). Data can be fed in arbitrary
+ * chunks; every completed row of the "rows" array is reported with the
+ * offset of its closing brace and the value of its "id" member.
+ ******************************************************************************/
+
+class ViewRowScanner
+{
+  public:
+    class Row
+    {
+      public:
+        size_t theEnd;
+        std::string theId;
+        bool theHasId;
+
+        Row() : theEnd(0), theHasId(false) {}
+    };
+
+  protected:
+    std::string theBuffer;
+    size_t thePos;
+    int theDepth;
+    bool theInString;
+    bool theEscape;
+    size_t theStringStart;
+    bool theInRows;
+    bool theExpectKey;
+    std::string theKey;
+    std::string theLastTopKey;
+    Row theRow;
+
+    void
+      endString(size_t aEnd);
+
+  public:
+    ViewRowScanner()
+      : thePos(0), theDepth(0), theInString(false), theEscape(false),
+        theStringStart(0), theInRows(false), theExpectKey(false) {}
+
+    /*
+     * Appends a chunk of the response and pushes every row completed
+     * by it to aRows.
+     */
+    void
+      feed(const char* aData, size_t aLen, std::vector<Row>& aRows);
+
+    const std::string&
+      getBuffer() const { return theBuffer; }
+
+    void
+      clear() { theBuffer.clear(); }
+};
+
+} /*namespace couchbase*/ } /*namespace zorba*/
+
+#endif //_COM_ZORBA_WWW_MODULES_COUCHBASE_JSON_UTILS_H_
@@ -0,0 +1,53 @@
+/*
+ * Copyright 2012 The FLWOR Foundation.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <random>
+
+#include "retry.h"
+
+namespace zorba { namespace couchbase {
+
+/*******************************************************************************
+ ******************************************************************************/
+
+const unsigned int RetryPolicy::DEFAULT_MAX_ATTEMPTS;
+const unsigned int RetryPolicy::DEFAULT_BASE_DELAY;
+const unsigned int RetryPolicy::DEFAULT_MAX_DELAY;
+
+bool
+RetryPolicy::isTemporary(lcb_error_t aError)
+{
+  return aError == LCB_ETMPFAIL
+      || aError == LCB_EBUSY
+      || aError == LCB_NOT_MY_VBUCKET;
+}
+
+std::chrono::milliseconds
+RetryPolicy::getDelay(unsigned int aRound) const
+{
+  unsigned long long lDelay = theBaseDelay;
+  for (unsigned int i = 1; i < aRound && lDelay < theMaxDelay; ++i)
+    lDelay *= 2;
+  if (lDelay > theMaxDelay)
+    lDelay = theMaxDelay;
+
+  //the jitter keeps the clients that failed together from retrying together
+  static thread_local std::minstd_rand theRandom(std::random_device{}());
+  std::uniform_int_distribution<unsigned long long> lJitter(0, lDelay / 2);
+  return std::chrono::milliseconds(lDelay - lJitter(theRandom));
+}
+
+} /*namespace couchbase*/ } /*namespace zorba*/
@@ -0,0 +1,64 @@
+/*
+ * Copyright 2012 The FLWOR Foundation.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _COM_ZORBA_WWW_MODULES_COUCHBASE_RETRY_H_
+#define _COM_ZORBA_WWW_MODULES_COUCHBASE_RETRY_H_
+
+#include <chrono>
+
+#include <libcouchbase/couchbase.h>
+
+namespace zorba { namespace couchbase {
+
+/*******************************************************************************
+ * Retries of commands that failed with a temporary error (the server is
+ * busy or a vBucket moved during a rebalance). Each retry round waits with
+ * exponential backoff and jitter: round n waits a random time between half
+ * and all of min(theMaxDelay, theBaseDelay * 2^(n-1)) milliseconds.
+ ******************************************************************************/
+
+class RetryPolicy
+{
+  public:
+    static const unsigned int DEFAULT_MAX_ATTEMPTS = 5;
+    static const unsigned int DEFAULT_BASE_DELAY = 10;
+    static const unsigned int DEFAULT_MAX_DELAY = 1000;
+
+    //attempts per command including the first one, 1 disables retries
+    unsigned int theMaxAttempts;
+    //milliseconds
+    unsigned int theBaseDelay;
+    unsigned int theMaxDelay;
+
+    RetryPolicy()
+      : theMaxAttempts(DEFAULT_MAX_ATTEMPTS),
+        theBaseDelay(DEFAULT_BASE_DELAY),
+        theMaxDelay(DEFAULT_MAX_DELAY) {}
+
+    static bool
+      isTemporary(lcb_error_t aError);
+
+    /*
+     * Returns the time to wait before the given retry round (starting
+     * at 1).
+     */
+    std::chrono::milliseconds
+      getDelay(unsigned int aRound) const;
+};
+
+} /*namespace couchbase*/ } /*namespace zorba*/
+
+#endif //_COM_ZORBA_WWW_MODULES_COUCHBASE_RETRY_H_
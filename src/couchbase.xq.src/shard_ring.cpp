@@ -0,0 +1,77 @@
+/*
+ * Copyright 2012 The FLWOR Foundation.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <algorithm>
+#include <sstream>
+
+#include "shard_ring.h"
+
+namespace zorba { namespace couchbase {
+
+/*******************************************************************************
+ ******************************************************************************/
+
+bool
+ShardRing::addShard(const std::string& aName, unsigned int aVirtualNodes)
+{
+  if (aVirtualNodes == 0
+      || std::find(theNames.begin(), theNames.end(), aName) != theNames.end())
+    return false;
+
+  for (unsigned int i = 0; i < aVirtualNodes; ++i)
+  {
+    std::ostringstream lNode;
+    lNode << aName << '#' << i;
+    std::string lStrNode = lNode.str();
+    thePoints.push_back(std::make_pair(hash(lStrNode.data(), lStrNode.size()), theShards));
+  }
+  std::sort(thePoints.begin(), thePoints.end());
+  theNames.push_back(aName);
+  ++theShards;
+  return true;
+}
+
+size_t
+ShardRing::getShard(const char* aKey, size_t aKeyLen) const
+{
+  std::pair<uint64_t, size_t> lPoint(hash(aKey, aKeyLen), 0);
+  std::vector<std::pair<uint64_t, size_t> >::const_iterator lIter =
+    std::lower_bound(thePoints.begin(), thePoints.end(), lPoint);
+  if (lIter == thePoints.end())
+    lIter = thePoints.begin();
+  return lIter->second;
+}
+
+uint64_t
+ShardRing::hash(const char* aData, size_t aLen)
+{
+  //FNV-1a, followed by the finalizer of MurmurHash3 to spread the bits of
+  //short and similar keys over the whole ring
+  uint64_t lHash = 0xcbf29ce484222325ULL;
+  for (size_t i = 0; i < aLen; ++i)
+  {
+    lHash ^= (unsigned char)aData[i];
+    lHash *= 0x100000001b3ULL;
+  }
+  lHash ^= lHash >> 33;
+  lHash *= 0xff51afd7ed558ccdULL;
+  lHash ^= lHash >> 33;
+  lHash *= 0xc4ceb9fe1a85ec53ULL;
+  lHash ^= lHash >> 33;
+  return lHash;
+}
+
+} /*namespace couchbase*/ } /*namespace zorba*/
@@ -0,0 +1,73 @@
+/*
+ * Copyright 2012 The FLWOR Foundation.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _COM_ZORBA_WWW_MODULES_COUCHBASE_SHARD_RING_H_
+#define _COM_ZORBA_WWW_MODULES_COUCHBASE_SHARD_RING_H_
+
+#include <stdint.h>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace zorba { namespace couchbase {
+
+/*******************************************************************************
+ * Consistent hashing ring of a sharded connection. Every shard owns a number
+ * of virtual nodes, i.e. points on the ring placed by the hash of its name,
+ * and a key belongs to the shard of the first point at or after the hash of
+ * the key. The points of a shard don't depend on the other shards, so adding
+ * or removing a shard only moves the keys of its own points; the number of
+ * virtual nodes weights the shards.
+ ******************************************************************************/
+
+class ShardRing
+{
+  public:
+    static const unsigned int DEFAULT_VIRTUAL_NODES = 160;
+
+  protected:
+    //sorted points of the ring and the shard owning each of them
+    std::vector<std::pair<uint64_t, size_t> > thePoints;
+    std::vector<std::string> theNames;
+    size_t theShards;
+
+  public:
+    ShardRing() : theShards(0) {}
+
+    /*
+     * Adds the next shard, returns false if aName is used by another
+     * shard or aVirtualNodes is 0.
+     */
+    bool
+      addShard(const std::string& aName, unsigned int aVirtualNodes);
+
+    /*
+     * Returns the index (in the order of addShard) of the shard owning
+     * the key, the ring must not be empty.
+     */
+    size_t
+      getShard(const char* aKey, size_t aKeyLen) const;
+
+    size_t
+      getShardCount() const { return theShards; }
+
+    static uint64_t
+      hash(const char* aData, size_t aLen);
+};
+
+} /*namespace couchbase*/ } /*namespace zorba*/
+
+#endif //_COM_ZORBA_WWW_MODULES_COUCHBASE_SHARD_RING_H_
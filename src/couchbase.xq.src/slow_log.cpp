@@ -0,0 +1,117 @@
+/*
+ * Copyright 2012 The FLWOR Foundation.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <sstream>
+
+#include "json_utils.h"
+#include "slow_log.h"
+
+namespace zorba { namespace couchbase {
+
+/*******************************************************************************
+ ******************************************************************************/
+
+const unsigned int SlowLog::DEFAULT_MAX_PER_SECOND;
+
+std::mutex SlowLog::theLogsMutex;
+std::map<std::string, std::weak_ptr<SlowLog> > SlowLog::theLogs;
+
+SlowLog::~SlowLog()
+{
+  fclose(theFile);
+}
+
+std::shared_ptr<SlowLog>
+SlowLog::get(const std::string& aPath)
+{
+  std::lock_guard<std::mutex> lLock(theLogsMutex);
+  std::shared_ptr<SlowLog> lLog = theLogs[aPath].lock();
+  if (lLog)
+    return lLog;
+
+  FILE* lHandle = fopen(aPath.c_str(), "a");
+  if (!lHandle)
+  {
+    theLogs.erase(aPath);
+    return lLog;
+  }
+  lLog.reset(new SlowLog(lHandle));
+  theLogs[aPath] = lLog;
+  return lLog;
+}
+
+bool
+SlowLog::write(const Entry& aEntry, unsigned int aMaxPerSecond)
+{
+  time_t lNow = time(NULL);
+  uint64_t lSuppressed;
+  {
+    std::lock_guard<std::mutex> lLock(theMutex);
+    if (lNow != theSecond)
+    {
+      theSecond = lNow;
+      theWritten = 0;
+    }
+    if (theWritten >= aMaxPerSecond)
+    {
+      ++theSuppressed;
+      return false;
+    }
+    ++theWritten;
+    lSuppressed = theSuppressed;
+    theSuppressed = 0;
+  }
+
+  char lTime[32];
+  struct tm lTm;
+#ifdef WIN32
+  gmtime_s(&lTm, &lNow);
+#else
+  gmtime_r(&lNow, &lTm);
+#endif
+  strftime(lTime, sizeof(lTime), "%Y-%m-%dT%H:%M:%SZ", &lTm);
+
+  std::string lLine;
+  lLine.reserve(128 + aEntry.theKeyLen);
+  lLine += "{\"time\":\"";
+  lLine += lTime;
+  lLine += "\",\"operation\":\"";
+  lLine += aEntry.theOperation;
+  lLine += "\",\"phase\":\"";
+  lLine += aEntry.thePhase;
+  lLine += "\",\"key\":";
+  JSONUtils::appendString(lLine, aEntry.theKey, aEntry.theKeyLen);
+  std::ostringstream lNumbers;
+  lNumbers << ",\"value-size\":" << aEntry.theValueSize
+           << ",\"duration-us\":" << aEntry.theDuration;
+  if (lSuppressed > 0)
+    lNumbers << ",\"suppressed\":" << lSuppressed;
+  lLine += lNumbers.str();
+  if (!aEntry.theNode.empty())
+  {
+    lLine += ",\"node\":";
+    JSONUtils::appendString(lLine, aEntry.theNode.data(), aEntry.theNode.size());
+  }
+  lLine += "}\n";
+
+  std::lock_guard<std::mutex> lLock(theMutex);
+  fwrite(lLine.data(), 1, lLine.size(), theFile);
+  //lines are rare, keep the log readable while the process is running
+  fflush(theFile);
+  return true;
+}
+
+} /*namespace couchbase*/ } /*namespace zorba*/
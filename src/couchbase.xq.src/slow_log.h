@@ -0,0 +1,96 @@
+/*
+ * Copyright 2012 The FLWOR Foundation.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _COM_ZORBA_WWW_MODULES_COUCHBASE_SLOW_LOG_H_
+#define _COM_ZORBA_WWW_MODULES_COUCHBASE_SLOW_LOG_H_
+
+#include <cstdio>
+#include <ctime>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <stdint.h>
+#include <string>
+
+namespace zorba { namespace couchbase {
+
+/*******************************************************************************
+ * Log of the operations (or phases of operations) that took longer than
+ * the threshold of their connection, one JSON object per line. The log is
+ * cheap enough to stay enabled: nothing is formatted for fast operations
+ * and at most theMaxPerSecond lines are written per second, the skipped
+ * entries are counted and reported with the next written line. All
+ * connections logging to the same path share one SlowLog.
+ ******************************************************************************/
+
+class SlowLog
+{
+  public:
+    static const unsigned int DEFAULT_MAX_PER_SECOND = 10;
+
+    class Entry
+    {
+      public:
+        const char* theOperation;
+        const char* thePhase;
+        const char* theKey;
+        size_t theKeyLen;
+        size_t theValueSize;
+        //empty if the node serving the operation is not known
+        std::string theNode;
+        uint64_t theDuration;
+
+        Entry(const char* aOperation, const char* aPhase)
+          : theOperation(aOperation), thePhase(aPhase), theKey(""),
+            theKeyLen(0), theValueSize(0), theDuration(0) {}
+    };
+
+  protected:
+    FILE* theFile;
+    std::mutex theMutex;
+    time_t theSecond;
+    unsigned int theWritten;
+    uint64_t theSuppressed;
+
+    static std::mutex theLogsMutex;
+    static std::map<std::string, std::weak_ptr<SlowLog> > theLogs;
+
+    SlowLog(FILE* aFile)
+      : theFile(aFile), theSecond(0), theWritten(0), theSuppressed(0) {}
+
+  public:
+    ~SlowLog();
+
+    /*
+     * Returns the SlowLog for aPath, opening (and creating) the file if
+     * needed. Returns an empty pointer if the file can't be opened.
+     */
+    static std::shared_ptr<SlowLog>
+      get(const std::string& aPath);
+
+    /*
+     * Writes aEntry unless aMaxPerSecond lines were already written in
+     * the current second. Returns false if the entry was dropped.
+     */
+    bool
+      write(const Entry& aEntry, unsigned int aMaxPerSecond);
+};
+
+typedef std::shared_ptr<SlowLog> SlowLog_t;
+
+} /*namespace couchbase*/ } /*namespace zorba*/
+
+#endif //_COM_ZORBA_WWW_MODULES_COUCHBASE_SLOW_LOG_H_
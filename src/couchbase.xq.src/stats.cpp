@@ -0,0 +1,142 @@
+/*
+ * Copyright 2012 The FLWOR Foundation.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <cstring>
+
+#include "stats.h"
+
+namespace zorba { namespace couchbase {
+
+/*******************************************************************************
+ ******************************************************************************/
+
+const unsigned int LatencyHistogram::SUB_BUCKETS;
+const unsigned int LatencyHistogram::BUCKETS;
+
+unsigned int
+LatencyHistogram::getBucket(uint64_t aValue)
+{
+  if (aValue < SUB_BUCKETS)
+    return (unsigned int)aValue;
+
+  //position of the highest bit beyond the sub bucket bits
+  unsigned int lShift = 0;
+  while ((aValue >> lShift) >= 2 * SUB_BUCKETS)
+    ++lShift;
+  unsigned int lSub = (unsigned int)(aValue >> lShift) - SUB_BUCKETS;
+  unsigned int lBucket = (lShift + 1) * SUB_BUCKETS + lSub;
+  return lBucket < BUCKETS ? lBucket : BUCKETS - 1;
+}
+
+uint64_t
+LatencyHistogram::getUpperBound(unsigned int aBucket)
+{
+  if (aBucket < SUB_BUCKETS)
+    return aBucket;
+
+  unsigned int lShift = aBucket / SUB_BUCKETS - 1;
+  uint64_t lSub = aBucket % SUB_BUCKETS;
+  return ((SUB_BUCKETS + lSub + 1) << lShift) - 1;
+}
+
+void
+LatencyHistogram::reset()
+{
+  memset(theCounts, 0, sizeof(theCounts));
+  theCount = 0;
+  theSum = 0;
+  theMin = 0;
+  theMax = 0;
+}
+
+void
+LatencyHistogram::record(uint64_t aValue)
+{
+  ++theCounts[getBucket(aValue)];
+  if (theCount == 0 || aValue < theMin)
+    theMin = aValue;
+  if (aValue > theMax)
+    theMax = aValue;
+  ++theCount;
+  theSum += aValue;
+}
+
+uint64_t
+LatencyHistogram::getPercentile(double aPercentile) const
+{
+  if (theCount == 0)
+    return 0;
+
+  uint64_t lRank = (uint64_t)(aPercentile / 100 * theCount + 0.5);
+  if (lRank == 0)
+    lRank = 1;
+
+  uint64_t lSeen = 0;
+  for (unsigned int i = 0; i < BUCKETS; ++i)
+  {
+    lSeen += theCounts[i];
+    if (lSeen >= lRank)
+    {
+      uint64_t lBound = getUpperBound(i);
+      return lBound < theMax ? lBound : theMax;
+    }
+  }
+  return theMax;
+}
+
+/*******************************************************************************
+ ******************************************************************************/
+
+const char*
+InstanceStats::getName(op_type_t aType)
+{
+  switch (aType)
+  {
+    case OP_GET: return "get";
+    case OP_STORE: return "store";
+    case OP_REMOVE: return "remove";
+    case OP_TOUCH: return "touch";
+    case OP_OBSERVE: return "observe";
+    case OP_HTTP: return "http";
+    default: return "unknown";
+  }
+}
+
+void
+InstanceStats::reset()
+{
+  for (int i = 0; i < OP_COUNT; ++i)
+  {
+    theOps[i] = 0;
+    theLatencies[i].reset();
+  }
+  theBytesIn = 0;
+  theBytesOut = 0;
+  theRetries = 0;
+  theErrors.clear();
+}
+
+void
+InstanceStats::record(op_type_t aType, uint64_t aMicros, lcb_error_t aError, size_t aBytesIn)
+{
+  ++theOps[aType];
+  theLatencies[aType].record(aMicros);
+  theBytesIn += aBytesIn;
+  if (aError != LCB_SUCCESS)
+    ++theErrors[aError];
+}
+
+} /*namespace couchbase*/ } /*namespace zorba*/
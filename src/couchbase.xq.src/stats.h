@@ -0,0 +1,208 @@
+/*
+ * Copyright 2012 The FLWOR Foundation.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _COM_ZORBA_WWW_MODULES_COUCHBASE_STATS_H_
+#define _COM_ZORBA_WWW_MODULES_COUCHBASE_STATS_H_
+
+#include <map>
+#include <memory>
+#include <stdint.h>
+
+#include <libcouchbase/couchbase.h>
+
+namespace zorba { namespace couchbase {
+
+/*******************************************************************************
+ * Latency histogram with logarithmic buckets (HDR style): every power of
+ * two is split into SUB_BUCKETS linear buckets, so a recorded value is
+ * off by at most 1/SUB_BUCKETS. Values are in microseconds.
+ ******************************************************************************/
+
+class LatencyHistogram
+{
+  public:
+    static const unsigned int SUB_BUCKETS = 8;
+    static const unsigned int BUCKETS = 64 * SUB_BUCKETS;
+
+  protected:
+    uint64_t theCounts[BUCKETS];
+    uint64_t theCount;
+    uint64_t theSum;
+    uint64_t theMin;
+    uint64_t theMax;
+
+    static unsigned int
+      getBucket(uint64_t aValue);
+
+    static uint64_t
+      getUpperBound(unsigned int aBucket);
+
+  public:
+    LatencyHistogram() { reset(); }
+
+    void
+      reset();
+
+    void
+      record(uint64_t aValue);
+
+    uint64_t
+      getCount() const { return theCount; }
+
+    uint64_t
+      getMin() const { return theCount ? theMin : 0; }
+
+    uint64_t
+      getMax() const { return theMax; }
+
+    uint64_t
+      getMean() const { return theCount ? theSum / theCount : 0; }
+
+    /*
+     * Returns the upper bound of the bucket holding the given percentile
+     * (0 to 100) of the recorded values.
+     */
+    uint64_t
+      getPercentile(double aPercentile) const;
+};
+
+/*******************************************************************************
+ * Counters of the operations of one instance. An instance is only used by
+ * one thread at a time, so the counters are not synchronized.
+ ******************************************************************************/
+
+class InstanceStats
+{
+  public:
+    typedef enum
+    {
+      OP_GET = 0,
+      OP_STORE,
+      OP_REMOVE,
+      OP_TOUCH,
+      OP_OBSERVE,
+      OP_HTTP,
+      OP_COUNT
+    } op_type_t;
+
+    typedef std::map<lcb_error_t, uint64_t> ErrorMap_t;
+
+  protected:
+    uint64_t theOps[OP_COUNT];
+    LatencyHistogram theLatencies[OP_COUNT];
+    uint64_t theBytesIn;
+    uint64_t theBytesOut;
+    uint64_t theRetries;
+    ErrorMap_t theErrors;
+
+  public:
+    InstanceStats() { reset(); }
+
+    static const char*
+      getName(op_type_t aType);
+
+    void
+      reset();
+
+    /*
+     * Records a completed operation, aMicros is the time between issuing
+     * the command and its callback.
+     */
+    void
+      record(op_type_t aType, uint64_t aMicros, lcb_error_t aError, size_t aBytesIn);
+
+    void
+      addBytesIn(size_t aBytes) { theBytesIn += aBytes; }
+
+    void
+      addBytesOut(size_t aBytes) { theBytesOut += aBytes; }
+
+    /*
+     * Counts commands resent after a temporary error.
+     */
+    void
+      addRetries(size_t aCount) { theRetries += aCount; }
+
+    uint64_t
+      getOps(op_type_t aType) const { return theOps[aType]; }
+
+    const LatencyHistogram&
+      getLatencies(op_type_t aType) const { return theLatencies[aType]; }
+
+    uint64_t
+      getBytesIn() const { return theBytesIn; }
+
+    uint64_t
+      getBytesOut() const { return theBytesOut; }
+
+    uint64_t
+      getRetries() const { return theRetries; }
+
+    const ErrorMap_t&
+      getErrors() const { return theErrors; }
+};
+
+/*******************************************************************************
+ * Bytes of server data held by the module at a time (buffered view
+ * responses, values being decoded or encoded), either for one instance or
+ * for all instances of a query. A limit of 0 means unlimited.
+ ******************************************************************************/
+
+class MemoryAccount
+{
+  protected:
+    uint64_t theCurrent;
+    uint64_t thePeak;
+    uint64_t theLimit;
+
+  public:
+    MemoryAccount() : theCurrent(0), thePeak(0), theLimit(0) {}
+
+    bool
+      canCharge(size_t aBytes) const { return theLimit == 0 || theCurrent + aBytes <= theLimit; }
+
+    void
+      charge(size_t aBytes)
+    {
+      theCurrent += aBytes;
+      if (theCurrent > thePeak)
+        thePeak = theCurrent;
+    }
+
+    void
+      release(size_t aBytes) { theCurrent -= aBytes < theCurrent ? aBytes : theCurrent; }
+
+    void
+      resetPeak() { thePeak = theCurrent; }
+
+    void
+      setLimit(uint64_t aLimit) { theLimit = aLimit; }
+
+    uint64_t
+      getCurrent() const { return theCurrent; }
+
+    uint64_t
+      getPeak() const { return thePeak; }
+
+    uint64_t
+      getLimit() const { return theLimit; }
+};
+
+typedef std::shared_ptr<MemoryAccount> MemoryAccount_t;
+
+} /*namespace couchbase*/ } /*namespace zorba*/
+
+#endif //_COM_ZORBA_WWW_MODULES_COUCHBASE_STATS_H_
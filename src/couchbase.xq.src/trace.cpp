@@ -0,0 +1,126 @@
+/*
+ * Copyright 2012 The FLWOR Foundation.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <functional>
+#include <sstream>
+#include <thread>
+
+#include "json_utils.h"
+#include "trace.h"
+
+namespace zorba { namespace couchbase {
+
+/*******************************************************************************
+ ******************************************************************************/
+
+std::mutex TraceFile::theFilesMutex;
+std::map<std::string, std::weak_ptr<TraceFile> > TraceFile::theFiles;
+
+TraceFile::~TraceFile()
+{
+  fclose(theFile);
+}
+
+std::shared_ptr<TraceFile>
+TraceFile::get(const std::string& aPath)
+{
+  std::lock_guard<std::mutex> lLock(theFilesMutex);
+  std::shared_ptr<TraceFile> lFile = theFiles[aPath].lock();
+  if (lFile)
+    return lFile;
+
+  FILE* lHandle = fopen(aPath.c_str(), "a");
+  if (!lHandle)
+  {
+    theFiles.erase(aPath);
+    return lFile;
+  }
+  //a new file starts the event array, appended events continue it
+  fseek(lHandle, 0, SEEK_END);
+  if (ftell(lHandle) == 0)
+    fputs("[\n", lHandle);
+
+  lFile.reset(new TraceFile(lHandle));
+  theFiles[aPath] = lFile;
+  return lFile;
+}
+
+void
+TraceFile::complete(
+  const char* aName,
+  const char* aCategory,
+  time_point_t aStart,
+  time_point_t aEnd,
+  const std::string& aArgs)
+{
+  long long lStart = std::chrono::duration_cast<std::chrono::microseconds>(
+    aStart.time_since_epoch()).count();
+  long long lDuration = std::chrono::duration_cast<std::chrono::microseconds>(
+    aEnd - aStart).count();
+  unsigned long lThread = (unsigned long)(std::hash<std::thread::id>()(std::this_thread::get_id()) % 1000000);
+
+  std::ostringstream lEvent;
+  lEvent << "{\"name\":\"" << aName << "\",\"cat\":\"" << aCategory
+         << "\",\"ph\":\"X\",\"ts\":" << lStart << ",\"dur\":" << lDuration
+         << ",\"pid\":1,\"tid\":" << lThread << ",\"args\":{" << aArgs << "}},\n";
+  std::string lLine = lEvent.str();
+
+  std::lock_guard<std::mutex> lLock(theMutex);
+  fwrite(lLine.data(), 1, lLine.size(), theFile);
+}
+
+/*******************************************************************************
+ ******************************************************************************/
+
+void
+TraceSpan::appendArg(std::string& aArgs, const char* aName, const char* aValue, size_t aLen)
+{
+  if (!aArgs.empty())
+    aArgs += ',';
+  aArgs += '"';
+  aArgs += aName;
+  aArgs += "\":";
+  JSONUtils::appendString(aArgs, aValue, aLen);
+}
+
+void
+TraceSpan::appendArg(std::string& aArgs, const char* aName, uint64_t aValue)
+{
+  std::ostringstream lValue;
+  lValue << aValue;
+  if (!aArgs.empty())
+    aArgs += ',';
+  aArgs += '"';
+  aArgs += aName;
+  aArgs += "\":";
+  aArgs += lValue.str();
+}
+
+void
+TraceSpan::addArg(const char* aName, const char* aValue, size_t aLen)
+{
+  if (theFile)
+    appendArg(theArgs, aName, aValue, aLen);
+}
+
+void
+TraceSpan::addArg(const char* aName, uint64_t aValue)
+{
+  if (theFile)
+    appendArg(theArgs, aName, aValue);
+}
+
+} /*namespace couchbase*/ } /*namespace zorba*/
@@ -0,0 +1,126 @@
+/*
+ * Copyright 2012 The FLWOR Foundation.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _COM_ZORBA_WWW_MODULES_COUCHBASE_TRACE_H_
+#define _COM_ZORBA_WWW_MODULES_COUCHBASE_TRACE_H_
+
+#include <chrono>
+#include <cstdio>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <stdint.h>
+#include <string>
+
+namespace zorba { namespace couchbase {
+
+/*******************************************************************************
+ * File receiving trace events in the Chrome trace event format (the JSON
+ * array form, which may be left unterminated), so that it can be loaded
+ * into chrome://tracing or Perfetto. All connections tracing to the same
+ * path share one TraceFile; events are appended under a mutex.
+ ******************************************************************************/
+
+class TraceFile
+{
+  protected:
+    FILE* theFile;
+    std::mutex theMutex;
+
+    static std::mutex theFilesMutex;
+    static std::map<std::string, std::weak_ptr<TraceFile> > theFiles;
+
+    TraceFile(FILE* aFile) : theFile(aFile) {}
+
+  public:
+    typedef std::chrono::steady_clock::time_point time_point_t;
+
+    ~TraceFile();
+
+    /*
+     * Returns the TraceFile for aPath, opening (and creating) the file
+     * if needed. Returns an empty pointer if the file can't be opened.
+     */
+    static std::shared_ptr<TraceFile>
+      get(const std::string& aPath);
+
+    /*
+     * Writes a complete event ("ph":"X"). aArgs holds the members of the
+     * "args" object, without braces.
+     */
+    void
+      complete(
+        const char* aName,
+        const char* aCategory,
+        time_point_t aStart,
+        time_point_t aEnd,
+        const std::string& aArgs);
+};
+
+typedef std::shared_ptr<TraceFile> TraceFile_t;
+
+/*******************************************************************************
+ * Scoped trace event, written when the span goes out of scope. A span
+ * without TraceFile does nothing, so spans can stay in the code paths
+ * when tracing is disabled.
+ ******************************************************************************/
+
+class TraceSpan
+{
+  protected:
+    TraceFile* theFile;
+    const char* theName;
+    const char* theCategory;
+    TraceFile::time_point_t theStart;
+    std::string theArgs;
+
+  public:
+    TraceSpan(const TraceFile_t& aFile, const char* aName, const char* aCategory)
+      : theFile(aFile.get()), theName(aName), theCategory(aCategory)
+    {
+      if (theFile)
+        theStart = std::chrono::steady_clock::now();
+    }
+
+    ~TraceSpan()
+    {
+      if (theFile)
+        theFile->complete(theName, theCategory, theStart, std::chrono::steady_clock::now(), theArgs);
+    }
+
+    bool
+      isActive() const { return theFile != NULL; }
+
+    void
+      addArg(const char* aName, const char* aValue, size_t aLen);
+
+    void
+      addArg(const char* aName, uint64_t aValue);
+
+    /*
+     * Appends the argument to aArgs, used for events written directly
+     * with TraceFile::complete.
+     */
+    static void
+      appendArg(std::string& aArgs, const char* aName, const char* aValue, size_t aLen);
+
+    static void
+      appendArg(std::string& aArgs, const char* aName, uint64_t aValue);
+};
+
+} /*namespace couchbase*/ } /*namespace zorba*/
+
+#endif //_COM_ZORBA_WWW_MODULES_COUCHBASE_TRACE_H_
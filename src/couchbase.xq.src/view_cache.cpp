@@ -0,0 +1,84 @@
+/*
+ * Copyright 2012 The FLWOR Foundation.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "view_cache.h"
+
+namespace zorba { namespace couchbase {
+
+/*******************************************************************************
+ ******************************************************************************/
+
+const size_t ViewCache::DEFAULT_BUDGET;
+
+ViewCache&
+ViewCache::getInstance()
+{
+  static ViewCache theCache;
+  return theCache;
+}
+
+void
+ViewCache::erase(EntryMap_t::iterator aIter)
+{
+  theSize -= aIter->first.size() + aIter->second.theValue.size();
+  theUses.erase(aIter->second.theUse);
+  theEntries.erase(aIter);
+}
+
+bool
+ViewCache::get(const std::string& aKey, std::string& aValue)
+{
+  std::lock_guard<std::mutex> lLock(theMutex);
+  EntryMap_t::iterator lIter = theEntries.find(aKey);
+  if (lIter == theEntries.end())
+    return false;
+
+  if (lIter->second.theExpires <= time(NULL))
+  {
+    erase(lIter);
+    return false;
+  }
+
+  theUses.splice(theUses.end(), theUses, lIter->second.theUse);
+  aValue = lIter->second.theValue;
+  return true;
+}
+
+void
+ViewCache::put(const std::string& aKey, const std::string& aValue, unsigned int aTTL)
+{
+  size_t lSize = aKey.size() + aValue.size();
+  std::lock_guard<std::mutex> lLock(theMutex);
+
+  EntryMap_t::iterator lIter = theEntries.find(aKey);
+  if (lIter != theEntries.end())
+    erase(lIter);
+
+  //a single result may not take over the whole cache
+  if (aTTL == 0 || lSize > theBudget / 4)
+    return;
+
+  while (theSize + lSize > theBudget && !theUses.empty())
+    erase(theEntries.find(theUses.front()));
+
+  Entry& lEntry = theEntries[aKey];
+  lEntry.theValue = aValue;
+  lEntry.theExpires = time(NULL) + aTTL;
+  lEntry.theUse = theUses.insert(theUses.end(), aKey);
+  theSize += lSize;
+}
+
+} /*namespace couchbase*/ } /*namespace zorba*/
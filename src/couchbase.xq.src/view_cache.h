@@ -0,0 +1,79 @@
+/*
+ * Copyright 2012 The FLWOR Foundation.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _COM_ZORBA_WWW_MODULES_COUCHBASE_VIEW_CACHE_H_
+#define _COM_ZORBA_WWW_MODULES_COUCHBASE_VIEW_CACHE_H_
+
+#include <ctime>
+#include <list>
+#include <map>
+#include <mutex>
+#include <string>
+
+namespace zorba { namespace couchbase {
+
+/*******************************************************************************
+ * Process wide cache for view results. Entries are stored as the final
+ * (already transcoded) response text and expire after the TTL given when
+ * they were stored. The least recently used entries are evicted once the
+ * total size exceeds the byte budget.
+ ******************************************************************************/
+
+class ViewCache
+{
+  public:
+    static const size_t DEFAULT_BUDGET = 64 * 1024 * 1024;
+
+  protected:
+    class Entry
+    {
+      public:
+        std::string theValue;
+        time_t theExpires;
+        std::list<std::string>::iterator theUse;
+    };
+
+    typedef std::map<std::string, Entry> EntryMap_t;
+
+    EntryMap_t theEntries;
+    std::list<std::string> theUses;
+    size_t theSize;
+    size_t theBudget;
+    std::mutex theMutex;
+
+    ViewCache() : theSize(0), theBudget(DEFAULT_BUDGET) {}
+
+    void
+      erase(EntryMap_t::iterator aIter);
+
+  public:
+    static ViewCache&
+      getInstance();
+
+    /*
+     * Copies the value cached for aKey into aValue. Returns false if
+     * there is no entry or the entry has expired.
+     */
+    bool
+      get(const std::string& aKey, std::string& aValue);
+
+    void
+      put(const std::string& aKey, const std::string& aValue, unsigned int aTTL);
+};
+
+} /*namespace couchbase*/ } /*namespace zorba*/
+
+#endif //_COM_ZORBA_WWW_MODULES_COUCHBASE_VIEW_CACHE_H_
@@ -0,0 +1,332 @@
+/*
+ * Copyright 2012 The FLWOR Foundation.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <zorba/item_factory.h>
+#include <zorba/store_consts.h>
+
+#include "xml_codec.h"
+
+namespace zorba { namespace couchbase {
+
+/*******************************************************************************
+ ******************************************************************************/
+
+const unsigned char XmlCodec::VERSION;
+
+static ItemFactory*
+getFactory()
+{
+  return Zorba::getInstance(0)->getItemFactory();
+}
+
+void
+XmlCodec::Writer::writeNumber(size_t aNumber)
+{
+  while (aNumber >= 0x80)
+  {
+    theOut += (char)(0x80 | (aNumber & 0x7F));
+    aNumber >>= 7;
+  }
+  theOut += (char)aNumber;
+}
+
+void
+XmlCodec::Writer::writeString(const String& aString)
+{
+  writeNumber(aString.size());
+  theOut.append(aString.c_str(), aString.size());
+}
+
+void
+XmlCodec::Writer::writeName(const Item& aName)
+{
+  String lNamespace = aName.getNamespace();
+  String lPrefix = aName.getPrefix();
+  String lLocal = aName.getLocalName();
+
+  std::string lKey;
+  lKey.append(lNamespace.c_str(), lNamespace.size()).append(1, '\0');
+  lKey.append(lPrefix.c_str(), lPrefix.size()).append(1, '\0');
+  lKey.append(lLocal.c_str(), lLocal.size());
+
+  std::map<std::string, size_t>::const_iterator lIter = theNames.find(lKey);
+  if (lIter != theNames.end())
+  {
+    writeNumber(lIter->second);
+    return;
+  }
+  //indexes start at 1, 0 announces a new name
+  size_t lIndex = theNames.size() + 1;
+  theNames[lKey] = lIndex;
+  writeNumber(0);
+  writeString(lNamespace);
+  writeString(lPrefix);
+  writeString(lLocal);
+}
+
+void
+XmlCodec::Writer::writeNode(const Item& aNode, bool aIsRoot)
+{
+  Item lName;
+  Item lChild;
+  switch (aNode.getNodeKind())
+  {
+    case store::StoreConsts::documentNode:
+    {
+      theOut += (char)XML_DOCUMENT;
+      Iterator_t lChildren = aNode.getChildren();
+      lChildren->open();
+      while (lChildren->next(lChild))
+        writeNode(lChild, false);
+      lChildren->close();
+      theOut += (char)XML_END;
+      break;
+    }
+    case store::StoreConsts::elementNode:
+    {
+      theOut += (char)XML_ELEMENT;
+      aNode.getNodeName(lName);
+      writeName(lName);
+
+      //descendants inherit the bindings of their rebuilt ancestors
+      NsBindings lBindings;
+      aNode.getNamespaceBindings(lBindings,
+        aIsRoot ? store::StoreConsts::ALL_NAMESPACES : store::StoreConsts::ONLY_LOCAL_NAMESPACES);
+      writeNumber(lBindings.size());
+      for (NsBindings::const_iterator lIter = lBindings.begin(); lIter != lBindings.end(); ++lIter)
+      {
+        writeString(lIter->first);
+        writeString(lIter->second);
+      }
+
+      std::vector<Item> lAttributes;
+      Iterator_t lAttrs = aNode.getAttributes();
+      lAttrs->open();
+      while (lAttrs->next(lChild))
+        lAttributes.push_back(lChild);
+      lAttrs->close();
+      writeNumber(lAttributes.size());
+      for (size_t i = 0; i < lAttributes.size(); ++i)
+      {
+        lAttributes[i].getNodeName(lName);
+        writeName(lName);
+        writeString(lAttributes[i].getStringValue());
+      }
+
+      Iterator_t lChildren = aNode.getChildren();
+      lChildren->open();
+      while (lChildren->next(lChild))
+        writeNode(lChild, false);
+      lChildren->close();
+      theOut += (char)XML_END;
+      break;
+    }
+    case store::StoreConsts::textNode:
+      theOut += (char)XML_TEXT;
+      writeString(aNode.getStringValue());
+      break;
+    case store::StoreConsts::commentNode:
+      theOut += (char)XML_COMMENT;
+      writeString(aNode.getStringValue());
+      break;
+    case store::StoreConsts::piNode:
+      theOut += (char)XML_PI;
+      aNode.getNodeName(lName);
+      writeString(lName.getLocalName());
+      writeString(aNode.getStringValue());
+      break;
+    default:
+      break;
+  }
+}
+
+bool
+XmlCodec::encode(const Item& aNode, std::string& aOut)
+{
+  if (!aNode.isNode())
+    return false;
+  int lKind = aNode.getNodeKind();
+  if (lKind == store::StoreConsts::attributeNode || lKind == store::StoreConsts::namespaceNode)
+    return false;
+
+  aOut += (char)VERSION;
+  Writer lWriter(aOut);
+  lWriter.writeNode(aNode, true);
+  return true;
+}
+
+/*******************************************************************************
+ ******************************************************************************/
+
+XmlCodec::Reader::Reader(const char* aData, size_t aLen)
+  : theData(aData), theLen(aLen), thePos(0)
+{
+  theUntyped = getFactory()->createQName("http://www.w3.org/2001/XMLSchema", "untyped");
+  theUntypedAtomic = getFactory()->createQName("http://www.w3.org/2001/XMLSchema", "untypedAtomic");
+}
+
+bool
+XmlCodec::Reader::readNumber(size_t& aNumber)
+{
+  aNumber = 0;
+  for (unsigned int lShift = 0; thePos < theLen && lShift < 64; lShift += 7)
+  {
+    unsigned char c = theData[thePos++];
+    aNumber |= (size_t)(c & 0x7F) << lShift;
+    if (!(c & 0x80))
+      return true;
+  }
+  return false;
+}
+
+bool
+XmlCodec::Reader::readString(String& aString)
+{
+  size_t lLen;
+  if (!readNumber(lLen) || lLen > theLen - thePos)
+    return false;
+  aString = String(theData + thePos, lLen);
+  thePos += lLen;
+  return true;
+}
+
+bool
+XmlCodec::Reader::readName(Item& aName)
+{
+  size_t lIndex;
+  if (!readNumber(lIndex))
+    return false;
+  if (lIndex > 0)
+  {
+    if (lIndex > theNames.size())
+      return false;
+    aName = theNames[lIndex - 1];
+    return true;
+  }
+
+  String lNamespace;
+  String lPrefix;
+  String lLocal;
+  if (!readString(lNamespace) || !readString(lPrefix) || !readString(lLocal))
+    return false;
+  aName = getFactory()->createQName(lNamespace, lPrefix, lLocal);
+  theNames.push_back(aName);
+  return true;
+}
+
+bool
+XmlCodec::Reader::readChildren(Item& aParent)
+{
+  while (thePos < theLen)
+  {
+    if (theData[thePos] == XML_END)
+    {
+      ++thePos;
+      return true;
+    }
+    Item lChild;
+    if (!readNode(aParent, lChild))
+      return false;
+  }
+  return false;
+}
+
+bool
+XmlCodec::Reader::readNode(Item& aParent, Item& aNode)
+{
+  if (thePos == theLen)
+    return false;
+
+  ItemFactory* lFactory = getFactory();
+  switch (theData[thePos++])
+  {
+    case XML_DOCUMENT:
+      aNode = lFactory->createDocumentNode("", "");
+      return readChildren(aNode);
+    case XML_ELEMENT:
+    {
+      Item lName;
+      size_t lCount;
+      if (!readName(lName) || !readNumber(lCount))
+        return false;
+      NsBindings lBindings;
+      for (size_t i = 0; i < lCount; ++i)
+      {
+        String lPrefix;
+        String lURI;
+        if (!readString(lPrefix) || !readString(lURI))
+          return false;
+        lBindings.push_back(std::make_pair(lPrefix, lURI));
+      }
+      aNode = lFactory->createElementNode(aParent, lName, theUntyped, false, false, lBindings);
+
+      if (!readNumber(lCount))
+        return false;
+      for (size_t i = 0; i < lCount; ++i)
+      {
+        String lValue;
+        if (!readName(lName) || !readString(lValue))
+          return false;
+        lFactory->createAttributeNode(aNode, lName, theUntypedAtomic, lFactory->createUntypedAtomic(lValue));
+      }
+      return readChildren(aNode);
+    }
+    case XML_TEXT:
+    {
+      String lContent;
+      if (!readString(lContent))
+        return false;
+      aNode = lFactory->createTextNode(aParent, lContent);
+      return true;
+    }
+    case XML_COMMENT:
+    {
+      String lContent;
+      if (!readString(lContent))
+        return false;
+      aNode = lFactory->createCommentNode(aParent, lContent);
+      return true;
+    }
+    case XML_PI:
+    {
+      String lTarget;
+      String lContent;
+      String lBaseURI;
+      if (!readString(lTarget) || !readString(lContent))
+        return false;
+      aNode = lFactory->createPiNode(aParent, lTarget, lContent, lBaseURI);
+      return true;
+    }
+    default:
+      return false;
+  }
+}
+
+Item
+XmlCodec::decode(const char* aData, size_t aLen)
+{
+  if (aLen == 0 || (unsigned char)aData[0] != VERSION)
+    return Item();
+
+  Reader lReader(aData + 1, aLen - 1);
+  Item lParent;
+  Item lNode;
+  if (!lReader.readNode(lParent, lNode) || lReader.thePos != lReader.theLen)
+    return Item();
+  return lNode;
+}
+
+} /*namespace couchbase*/ } /*namespace zorba*/
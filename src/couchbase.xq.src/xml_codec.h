@@ -0,0 +1,130 @@
+/*
+ * Copyright 2012 The FLWOR Foundation.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _COM_ZORBA_WWW_MODULES_COUCHBASE_XML_CODEC_H_
+#define _COM_ZORBA_WWW_MODULES_COUCHBASE_XML_CODEC_H_
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include <zorba/zorba.h>
+
+namespace zorba { namespace couchbase {
+
+/*******************************************************************************
+ * Compact binary encoding of XML nodes, so that stored documents can be
+ * rebuilt with the ItemFactory instead of being parsed again. A value
+ * starts with VERSION and holds one node:
+ *
+ *   document:  DOCUMENT child* END
+ *   element:   ELEMENT name bindings attributes child* END
+ *              with bindings = count (prefix uri)*
+ *              and attributes = count (name value)*
+ *   text:      TEXT content
+ *   comment:   COMMENT content
+ *   pi:        PI target content
+ *
+ * Numbers are unsigned LEB128 varints, strings a length and UTF-8 bytes.
+ * A name is an index into the names seen so far, or 0 followed by the
+ * namespace, prefix and local name of a new one. Type annotations are not
+ * kept, elements are rebuilt as xs:untyped.
+ ******************************************************************************/
+
+class XmlCodec
+{
+  public:
+    static const unsigned char VERSION = 1;
+
+  protected:
+    typedef enum
+    {
+      XML_END = 0,
+      XML_DOCUMENT,
+      XML_ELEMENT,
+      XML_TEXT,
+      XML_COMMENT,
+      XML_PI
+    } xml_tag_t;
+
+    class Writer
+    {
+      public:
+        std::string& theOut;
+        std::map<std::string, size_t> theNames;
+
+        Writer(std::string& aOut) : theOut(aOut) {}
+
+        void
+          writeNumber(size_t aNumber);
+
+        void
+          writeString(const String& aString);
+
+        void
+          writeName(const Item& aName);
+
+        void
+          writeNode(const Item& aNode, bool aIsRoot);
+    };
+
+    class Reader
+    {
+      public:
+        const char* theData;
+        size_t theLen;
+        size_t thePos;
+        std::vector<Item> theNames;
+        Item theUntyped;
+        Item theUntypedAtomic;
+
+        Reader(const char* aData, size_t aLen);
+
+        bool
+          readNumber(size_t& aNumber);
+
+        bool
+          readString(String& aString);
+
+        bool
+          readName(Item& aName);
+
+        bool
+          readNode(Item& aParent, Item& aNode);
+
+        bool
+          readChildren(Item& aParent);
+    };
+
+  public:
+    /*
+     * Appends the encoding of a document, element, text, comment or
+     * processing instruction node to aOut. Returns false for other items.
+     */
+    static bool
+      encode(const Item& aNode, std::string& aOut);
+
+    /*
+     * Rebuilds the node, returns a null item if aData is not a valid
+     * encoding.
+     */
+    static Item
+      decode(const char* aData, size_t aLen);
+};
+
+} /*namespace couchbase*/ } /*namespace zorba*/
+
+#endif //_COM_ZORBA_WWW_MODULES_COUCHBASE_XML_CODEC_H_
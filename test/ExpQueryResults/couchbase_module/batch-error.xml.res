@@ -0,0 +1 @@
+LCB0002 100
@@ -0,0 +1 @@
+301 true
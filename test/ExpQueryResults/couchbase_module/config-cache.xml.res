@@ -0,0 +1 @@
+true true cached true
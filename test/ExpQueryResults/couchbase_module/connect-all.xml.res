@@ -0,0 +1 @@
+2 connect-all
@@ -0,0 +1 @@
+pooled pooled true true 0
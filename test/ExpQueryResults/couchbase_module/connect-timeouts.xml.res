@@ -0,0 +1 @@
+timeouts
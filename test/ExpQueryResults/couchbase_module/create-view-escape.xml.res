@@ -0,0 +1 @@
+_design/dev_escape/_view/te"st
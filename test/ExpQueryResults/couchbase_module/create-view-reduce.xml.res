@@ -0,0 +1 @@
+{ "key" : "a", "value" : 3 }
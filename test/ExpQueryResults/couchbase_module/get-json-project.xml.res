@@ -0,0 +1 @@
+7 2 2 a b 1
@@ -0,0 +1 @@
+false true true [ "_design/dev_test_publish/_view/publish" ]
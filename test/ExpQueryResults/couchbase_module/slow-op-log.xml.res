@@ -0,0 +1 @@
+slow true true
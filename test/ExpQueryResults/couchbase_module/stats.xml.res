@@ -0,0 +1 @@
+2 3 true 0
@@ -0,0 +1 @@
+true true urn:orders gadget
@@ -0,0 +1 @@
+traced true true
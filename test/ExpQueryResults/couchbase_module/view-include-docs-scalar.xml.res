@@ -0,0 +1 @@
+view-scalar1 false view-scalar2 false view-scalar3 true
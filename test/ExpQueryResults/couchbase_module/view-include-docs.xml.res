@@ -0,0 +1 @@
+{ "docs" : 1 }
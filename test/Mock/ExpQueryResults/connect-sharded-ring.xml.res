@@ -0,0 +1 @@
+1 2 7 8 10 11 13 15 16 18 19 21 22 23 25 26 28 29 30 | 3 4 5 6 9 12 14 17 20 24 27 | 4 6 8 12 14 20 28 | 4 6 8 12 14 20 28
@@ -0,0 +1 @@
+5 1 0 0 1 5 true value1,value2,value3,value4,value5
@@ -0,0 +1 @@
+100 200 true
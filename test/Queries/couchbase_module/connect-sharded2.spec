@@ -0,0 +1 @@
+Error: http://www.zorba-xquery.com/modules/couchbase:CB0018